@@ -0,0 +1,488 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of regression detection over splits.
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "random.h"
+#include "statistics.h"
+
+/**
+ * Flags splits that are far from the median of the splits
+ * before them, in units of their median absolute deviation
+ * (a Hampel filter). Only the last width splits are kept,
+ * so it streams over captures of any length. Splits are
+ * flagged once the window is full. The deviation is taken
+ * to be at least one unit, so quantized splits that differ
+ * by a tick are not flagged.
+ */
+template <typename Duration = std::chrono::milliseconds>
+class OutlierFilter {
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // The most recent splits, in a ring.
+  std::vector<typename Duration::rep> window;
+  size_t width;
+  size_t next = 0;
+
+  // Deviations from the median that count as outliers.
+  double cutoff;
+
+  // Number of splits added and flagged.
+  uint64_t num = 0;
+  uint64_t flagged = 0;
+
+  // Reused to select medians without allocating.
+  mutable std::vector<double> scratch;
+
+  // Returns the median of scratch, reordering it.
+  double scratch_median() const;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  // Scales a median absolute deviation to a normal standard deviation.
+  static constexpr double MAD_SCALE = 1.4826;
+
+  /**
+   * Flags splits more than threshold scaled deviations
+   * from the median of the last width splits.
+   * THROWS: if width is less than 3 or threshold is not positive.
+   */
+  explicit OutlierFilter(size_t width = 64, double threshold = 3.5);
+
+  /**
+   * Adds every split in the range.
+   * Accepts Stopwatch iterators.
+   */
+  template <typename Iter>
+  OutlierFilter(Iter first, Iter last, size_t width = 64,
+                double threshold = 3.5);
+
+  /**
+   * Adds a split. Returns whether or not it is an outlier.
+   */
+  bool add(typename Duration::rep dur);
+
+  /**
+   * Returns the median of the window.
+   * THROWS: if there are no added splits.
+   */
+  double median() const;
+
+  /**
+   * Returns the median absolute deviation of the window.
+   * THROWS: if there are no added splits.
+   */
+  double mad() const;
+
+  /**
+   * Returns the number of added and flagged splits.
+   */
+  uint64_t count() const noexcept;
+  uint64_t outliers() const noexcept;
+
+  /**
+   * Delete all added splits.
+   */
+  void clear() noexcept;
+};
+
+/**
+ * Detects shifts in the mean of splits with a two-sided
+ * CUSUM. The mean and deviation of the first warmup splits
+ * are the baseline. Each later split adds its distance from
+ * the baseline, in deviations minus slack, to an upper and
+ * a lower sum, and a sum above threshold is a change point.
+ * Each split moves a sum by at most half the threshold, so
+ * a single outlier is not mistaken for a change point.
+ * The baseline is then learned again from the splits after
+ * it. Uses constant memory apart from the change points.
+ */
+template <typename Duration = std::chrono::milliseconds>
+class ChangeDetector {
+ public:
+  /* --- MEMBER TYPES --- */
+
+  // A detected shift in the mean.
+  struct change {
+    // Index of the split where the shift began.
+    size_t start;
+    // Index of the split where the shift was detected.
+    size_t detected;
+    // Whether splits became slower, rather than faster.
+    bool slower;
+  };
+
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // Number of splits in each baseline.
+  size_t warmup;
+
+  // Allowed drift and alarm level, in deviations.
+  double slack;
+  double limit;
+
+  // The current baseline.
+  Statistics<Duration> baseline;
+
+  // Upper and lower sums, and where each last left zero.
+  double upper = 0;
+  double lower = 0;
+  size_t upper_start = 0;
+  size_t lower_start = 0;
+
+  // Index of the next split.
+  size_t index = 0;
+
+  // Every change point so far.
+  std::vector<change> found;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Learns each baseline from warmup splits, and detects
+   * shifts of more than slack deviations once their sum
+   * exceeds threshold deviations.
+   * THROWS: if warmup is less than 2, slack is negative,
+   * or threshold is not positive.
+   */
+  explicit ChangeDetector(size_t warmup = 32, double slack = 0.5,
+                          double threshold = 5);
+
+  /**
+   * Adds every split in the range.
+   * Accepts Stopwatch iterators.
+   */
+  template <typename Iter>
+  ChangeDetector(Iter first, Iter last, size_t warmup = 32,
+                 double slack = 0.5, double threshold = 5);
+
+  /**
+   * Adds a split. Returns whether or not it completes
+   * a change point.
+   */
+  bool add(typename Duration::rep dur);
+
+  /**
+   * Returns every change point, in order of detection.
+   */
+  const std::vector<change>& changes() const noexcept;
+
+  /**
+   * Delete all added splits and change points.
+   */
+  void clear() noexcept;
+};
+
+/**
+ * Result of a Mann-Whitney U test between two captures.
+ */
+struct rank_test {
+  // Pairs in which the first capture's split is larger,
+  // counting ties as half.
+  double u;
+  // Normal approximation of u, corrected for ties.
+  // Positive if the first capture tends to be slower.
+  double z;
+  // Two-sided probability of a z at least this extreme
+  // if both captures come from the same distribution.
+  double p_value;
+};
+
+/**
+ * Tests whether the splits of two captures come from the
+ * same distribution without assuming its shape.
+ * Accepts Stopwatch iterators.
+ * THROWS: if either range is empty.
+ */
+template <typename Iter1, typename Iter2>
+rank_test mann_whitney(Iter1 first1, Iter1 last1, Iter2 first2, Iter2 last2);
+
+/**
+ * A bootstrapped estimate and its confidence interval.
+ */
+struct confidence_interval {
+  double estimate;
+  double low;
+  double high;
+};
+
+/**
+ * Estimates the change in the pct percentile from the first
+ * capture to the second, such as the p99 regression of a
+ * canary, with a percentile bootstrap confidence interval.
+ * Resamples are spread over threads threads, or every
+ * hardware thread if 0, and each draws from its own seeded
+ * generator, so results do not depend on the thread count.
+ * Accepts Stopwatch iterators.
+ * THROWS: if either range is empty, pct is not in [0, 100],
+ * confidence is not in (0, 1), or resamples is zero.
+ */
+template <typename Iter1, typename Iter2>
+confidence_interval bootstrap_delta(Iter1 first1, Iter1 last1, Iter2 first2,
+                                    Iter2 last2, double pct,
+                                    size_t resamples = 1000,
+                                    double confidence = 0.95,
+                                    uint64_t seed = 2020, unsigned threads = 0);
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration>
+inline OutlierFilter<Duration>::OutlierFilter(size_t width_in,
+                                              double threshold)
+    : width(width_in), cutoff(threshold) {
+  if (width < 3) throw std::invalid_argument("Window must hold 3 splits.");
+  if (!(threshold > 0)) {
+    throw std::invalid_argument("Threshold must be positive.");
+  }
+  window.reserve(width);
+  scratch.reserve(width);
+}
+
+template <typename Duration>
+template <typename Iter>
+inline OutlierFilter<Duration>::OutlierFilter(Iter first, Iter last,
+                                              size_t width_in, double threshold)
+    : OutlierFilter(width_in, threshold) {
+  for (; first != last; ++first) add(*first);
+}
+
+template <typename Duration>
+double OutlierFilter<Duration>::scratch_median() const {
+  const auto n = scratch.size();
+  const auto mid = scratch.begin() + static_cast<ptrdiff_t>(n / 2);
+  std::nth_element(scratch.begin(), mid, scratch.end());
+  if (n % 2 == 1) return *mid;
+  // The other middle value is the largest of the lower half.
+  return (*mid + *std::max_element(scratch.begin(), mid)) / 2;
+}
+
+template <typename Duration>
+double OutlierFilter<Duration>::median() const {
+  if (window.empty()) throw std::out_of_range("No splits have been added.");
+  scratch.assign(window.begin(), window.end());
+  return scratch_median();
+}
+
+template <typename Duration>
+double OutlierFilter<Duration>::mad() const {
+  const auto center = median();
+  scratch.clear();
+  for (const auto dur : window) {
+    scratch.push_back(std::abs(static_cast<double>(dur) - center));
+  }
+  return scratch_median();
+}
+
+template <typename Duration>
+bool OutlierFilter<Duration>::add(typename Duration::rep dur) {
+  bool outlier = false;
+  if (window.size() == width) {
+    const auto center = median();
+    const auto spread = std::max(mad(), 1.0) * MAD_SCALE;
+    outlier = std::abs(static_cast<double>(dur) - center) > cutoff * spread;
+    window[next] = dur;
+    next = (next + 1) % window.size();
+  } else {
+    window.push_back(dur);
+  }
+  ++num;
+  flagged += outlier;
+  return outlier;
+}
+
+template <typename Duration>
+inline uint64_t OutlierFilter<Duration>::count() const noexcept {
+  return num;
+}
+
+template <typename Duration>
+inline uint64_t OutlierFilter<Duration>::outliers() const noexcept {
+  return flagged;
+}
+
+template <typename Duration>
+inline void OutlierFilter<Duration>::clear() noexcept {
+  window.clear();
+  next = 0;
+  num = flagged = 0;
+}
+
+template <typename Duration>
+inline ChangeDetector<Duration>::ChangeDetector(size_t warmup_in,
+                                                double slack_in,
+                                                double threshold)
+    : warmup(warmup_in), slack(slack_in), limit(threshold) {
+  if (warmup < 2) throw std::invalid_argument("Warmup must be 2 splits.");
+  if (slack < 0) throw std::invalid_argument("Slack cannot be negative.");
+  if (!(threshold > 0)) {
+    throw std::invalid_argument("Threshold must be positive.");
+  }
+}
+
+template <typename Duration>
+template <typename Iter>
+inline ChangeDetector<Duration>::ChangeDetector(Iter first, Iter last,
+                                                size_t warmup_in,
+                                                double slack_in,
+                                                double threshold)
+    : ChangeDetector(warmup_in, slack_in, threshold) {
+  for (; first != last; ++first) add(*first);
+}
+
+template <typename Duration>
+bool ChangeDetector<Duration>::add(typename Duration::rep dur) {
+  const auto at = index++;
+  if (baseline.count() < warmup) {
+    baseline.add(dur);
+    return false;
+  }
+  // As with outliers, the deviation is at least one unit. Capping
+  // each step at half the threshold keeps lone spikes from alarming.
+  const auto cap = limit / 2;
+  const auto z = std::clamp((static_cast<double>(dur) - baseline.mean()) /
+                                std::max(baseline.stddev(), 1.0),
+                            -cap, cap);
+  if (!(upper > 0)) upper_start = at;
+  if (!(lower > 0)) lower_start = at;
+  upper = std::max(0.0, upper + z - slack);
+  lower = std::max(0.0, lower - z - slack);
+  if (!(upper > limit) && !(lower > limit)) return false;
+  const bool slower = upper > limit;
+  found.push_back({slower ? upper_start : lower_start, at, slower});
+  baseline.clear();
+  upper = lower = 0;
+  return true;
+}
+
+template <typename Duration>
+inline const std::vector<typename ChangeDetector<Duration>::change>&
+ChangeDetector<Duration>::changes() const noexcept {
+  return found;
+}
+
+template <typename Duration>
+inline void ChangeDetector<Duration>::clear() noexcept {
+  baseline.clear();
+  upper = lower = 0;
+  index = 0;
+  found.clear();
+}
+
+template <typename Iter1, typename Iter2>
+rank_test mann_whitney(Iter1 first1, Iter1 last1, Iter2 first2, Iter2 last2) {
+  // Each split, and whether it belongs to the first capture.
+  std::vector<std::pair<double, bool>> pooled;
+  for (; first1 != last1; ++first1) {
+    pooled.emplace_back(static_cast<double>(*first1), true);
+  }
+  const auto n1 = static_cast<double>(pooled.size());
+  for (; first2 != last2; ++first2) {
+    pooled.emplace_back(static_cast<double>(*first2), false);
+  }
+  const auto n = static_cast<double>(pooled.size());
+  const auto n2 = n - n1;
+  if (!(n1 > 0) || !(n2 > 0)) {
+    throw std::invalid_argument("Both captures need splits.");
+  }
+  std::sort(pooled.begin(), pooled.end());
+
+  // Sum the ranks of the first capture, averaging over ties.
+  double rank_sum = 0, ties = 0;
+  for (size_t i = 0; i < pooled.size();) {
+    auto j = i;
+    size_t in_first = 0;
+    for (; j < pooled.size() && !(pooled[i].first < pooled[j].first); ++j) {
+      in_first += pooled[j].second;
+    }
+    const auto run = static_cast<double>(j - i);
+    const auto rank = static_cast<double>(i + j + 1) / 2;
+    rank_sum += rank * static_cast<double>(in_first);
+    ties += run * run * run - run;
+    i = j;
+  }
+  const auto u = rank_sum - n1 * (n1 + 1) / 2;
+  const auto variance =
+      n1 * n2 / 12 * ((n + 1) - (n > 1 ? ties / (n * (n - 1)) : 0));
+  if (!(variance > 0)) return {u, 0, 1};
+  const auto z = (u - n1 * n2 / 2) / std::sqrt(variance);
+  return {u, z, std::erfc(std::abs(z) / std::sqrt(2.0))};
+}
+
+template <typename Iter1, typename Iter2>
+confidence_interval bootstrap_delta(Iter1 first1, Iter1 last1, Iter2 first2,
+                                    Iter2 last2, double pct, size_t resamples,
+                                    double confidence, uint64_t seed,
+                                    unsigned threads) {
+  std::vector<double> before, after;
+  for (; first1 != last1; ++first1) {
+    before.push_back(static_cast<double>(*first1));
+  }
+  for (; first2 != last2; ++first2) {
+    after.push_back(static_cast<double>(*first2));
+  }
+  if (before.empty() || after.empty()) {
+    throw std::invalid_argument("Both captures need splits.");
+  }
+  if (!(pct >= 0 && pct <= 100)) {
+    throw std::invalid_argument("Percentile must be in [0, 100].");
+  }
+  if (!(confidence > 0) || !(confidence < 1)) {
+    throw std::invalid_argument("Confidence must be in (0, 1).");
+  }
+  if (resamples == 0) {
+    throw std::invalid_argument("Bootstrap needs at least one resample.");
+  }
+
+  // Selects the nearest ranked value, reordering values.
+  const auto percentile = [](std::vector<double>& values, double p) {
+    const auto rank = static_cast<size_t>(
+        std::lround(p / 100 * static_cast<double>(values.size() - 1)));
+    const auto nth = values.begin() + static_cast<ptrdiff_t>(rank);
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+  };
+  auto before_copy = before, after_copy = after;
+  const auto estimate =
+      percentile(after_copy, pct) - percentile(before_copy, pct);
+
+  std::vector<double> deltas(resamples);
+  const auto work = [&](size_t lo, size_t hi) {
+    std::vector<double> left(before.size()), right(after.size());
+    for (auto r = lo; r < hi; ++r) {
+      // Seeding by resample keeps results independent of threads.
+      uint64_t state = (seed ^ ((r + 1) * 0x9E3779B97F4A7C15u)) | 1;
+      for (auto& val : left) val = before[xorshift_next(state) % before.size()];
+      for (auto& val : right) val = after[xorshift_next(state) % after.size()];
+      deltas[r] = percentile(right, pct) - percentile(left, pct);
+    }
+  };
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  const auto chunks = std::min<size_t>(threads, resamples);
+  std::vector<std::thread> workers;
+  for (size_t c = 1; c < chunks; ++c) {
+    workers.emplace_back(work, resamples * c / chunks,
+                         resamples * (c + 1) / chunks);
+  }
+  work(0, resamples / chunks);
+  for (auto& worker : workers) worker.join();
+
+  const auto tail = (1 - confidence) / 2 * 100;
+  const auto low = percentile(deltas, tail);
+  const auto high = percentile(deltas, 100 - tail);
+  return {estimate, low, high};
+}
@@ -0,0 +1,340 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of binary stopwatch captures.
+*/
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "stopwatch.h"
+
+/**
+ * Fixed layout header at the start of every capture file.
+ * Followed by count raw time point ticks in native byte order.
+ */
+struct archive_header {
+  // Identifies the file format.
+  char magic[8];
+  // Format version.
+  uint32_t version;
+  // Identifies the clock, from clock_traits.
+  uint32_t clock;
+  // The clock's tick period.
+  int64_t num;
+  int64_t den;
+  // Nanoseconds per tick measured when the capture was saved.
+  double ns_per_tick;
+  // Number of time points that follow.
+  uint64_t count;
+  // Stopwatch mode when the capture was saved.
+  uint8_t mode;
+  // Size in bytes of each time point.
+  uint8_t tick_size;
+  uint8_t padding[14];
+};
+static_assert(sizeof(archive_header) == 64, "Header layout must be fixed.");
+
+/**
+ * A read-only view of time points in a memory mapped
+ * capture file. Does not copy the file. Move only.
+ * Compatible with Stopwatch, which cannot record into it.
+ */
+template <typename TimePoint>
+class mapped_buffer {
+ private:
+  // Start and length of the whole mapping.
+  void* region = nullptr;
+  size_t length = 0;
+
+  // Time points within the mapping.
+  const TimePoint* points = nullptr;
+  size_t count = 0;
+
+ public:
+  using value_type = TimePoint;
+  using size_type = size_t;
+  using const_iterator = const TimePoint*;
+  using iterator = const_iterator;
+
+  /**
+   * Basic default constructor with no time points.
+   */
+  mapped_buffer() = default;
+
+  /**
+   * Maps the file at path.
+   * THROWS: if the file cannot be mapped.
+   */
+  explicit mapped_buffer(const std::string& path);
+
+  mapped_buffer(const mapped_buffer&) = delete;
+  mapped_buffer& operator=(const mapped_buffer&) = delete;
+  mapped_buffer(mapped_buffer&& other) noexcept;
+  mapped_buffer& operator=(mapped_buffer&& other) noexcept;
+
+  /**
+   * Unmaps the file.
+   */
+  ~mapped_buffer();
+
+  /**
+   * Returns the capture header.
+   * REQUIRES: a file is mapped.
+   */
+  const archive_header& header() const noexcept;
+
+  /**
+   * Returns the number of time points.
+   */
+  size_t size() const noexcept { return count; }
+
+  /**
+   * Returns whether or not there are time points.
+   */
+  bool empty() const noexcept { return count == 0; }
+
+  /**
+   * Returns a pointer to the contiguous time points.
+   */
+  const TimePoint* data() const noexcept { return points; }
+
+  /**
+   * Unchecked access.
+   */
+  const TimePoint& operator[](size_t index) const noexcept {
+    return points[index];
+  }
+
+  /**
+   * Index-checked access.
+   */
+  const TimePoint& at(size_t index) const;
+
+  /**
+   * Returns the first time point.
+   */
+  const TimePoint& front() const noexcept { return points[0]; }
+
+  /**
+   * Returns the last time point.
+   */
+  const TimePoint& back() const noexcept { return points[count - 1]; }
+
+  // Iteration over the mapped time points.
+
+  const_iterator begin() const noexcept { return points; }
+  const_iterator end() const noexcept { return points + count; }
+};
+
+/**
+ * A read-only stopwatch over a memory mapped capture.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock>
+using MappedStopwatch =
+    Stopwatch<Duration, Clock, mapped_buffer<typename Clock::time_point>>;
+
+/**
+ * Saves the time points and mode of the stopwatch to a
+ * versioned binary capture at path. Contiguous storage
+ * is written directly with a single writev, without copying.
+ * THROWS: if the file cannot be written.
+ */
+template <typename Duration, typename Clock, typename Storage>
+void dump(const Stopwatch<Duration, Clock, Storage>& sw,
+          const std::string& path);
+
+/**
+ * Maps the capture at path into a read-only stopwatch
+ * in the saved mode. Does not copy or read the time points.
+ * Durations are converted with the local calibration, so
+ * the saved nanoseconds per tick must agree with it.
+ * THROWS: if the file cannot be mapped, is malformed, was
+ * saved from a different or unknown clock, or was saved
+ * with a calibration that differs by more than 0.1%.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock>
+MappedStopwatch<Duration, Clock> load(const std::string& path);
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+// Identifies capture files.
+inline constexpr char ARCHIVE_MAGIC[8] = {'S', 'T', 'O', 'P',
+                                          'W', 'A', 'T', 'C'};
+
+// Current capture format version.
+inline constexpr uint32_t ARCHIVE_VERSION = 1;
+
+// Largest relative difference between the saved and local calibration.
+inline constexpr double ARCHIVE_CALIBRATION_TOLERANCE = 1e-3;
+
+template <typename TimePoint>
+mapped_buffer<TimePoint>::mapped_buffer(const std::string& path) {
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Cannot open capture " + path);
+  struct stat info;
+  if (::fstat(fd, &info) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Cannot stat capture " + path);
+  }
+  length = static_cast<size_t>(info.st_size);
+  if (length < sizeof(archive_header)) {
+    ::close(fd);
+    throw std::runtime_error("Capture is too small: " + path);
+  }
+  region = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (region == MAP_FAILED) {
+    region = nullptr;
+    throw std::runtime_error("Cannot map capture " + path);
+  }
+  const auto& head = header();
+  const auto available =
+      (length - sizeof(archive_header)) / sizeof(TimePoint);
+  if (std::memcmp(head.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 ||
+      head.version != ARCHIVE_VERSION || head.tick_size != sizeof(TimePoint) ||
+      head.count > available) {
+    ::munmap(region, length);
+    region = nullptr;
+    throw std::runtime_error("Malformed capture " + path);
+  }
+  points = reinterpret_cast<const TimePoint*>(static_cast<const char*>(region) +
+                                              sizeof(archive_header));
+  count = static_cast<size_t>(head.count);
+}
+
+template <typename TimePoint>
+inline mapped_buffer<TimePoint>::mapped_buffer(mapped_buffer&& other) noexcept
+    : region(std::exchange(other.region, nullptr)),
+      length(std::exchange(other.length, 0)),
+      points(std::exchange(other.points, nullptr)),
+      count(std::exchange(other.count, 0)) {}
+
+template <typename TimePoint>
+inline mapped_buffer<TimePoint>& mapped_buffer<TimePoint>::operator=(
+    mapped_buffer&& other) noexcept {
+  std::swap(region, other.region);
+  std::swap(length, other.length);
+  std::swap(points, other.points);
+  std::swap(count, other.count);
+  return *this;
+}
+
+template <typename TimePoint>
+inline mapped_buffer<TimePoint>::~mapped_buffer() {
+  if (region) ::munmap(region, length);
+}
+
+template <typename TimePoint>
+inline const archive_header& mapped_buffer<TimePoint>::header()
+    const noexcept {
+  return *static_cast<const archive_header*>(region);
+}
+
+template <typename TimePoint>
+inline const TimePoint& mapped_buffer<TimePoint>::at(size_t index) const {
+  if (index >= count) {
+    throw std::out_of_range("Mapped buffer index out of range.");
+  }
+  return points[index];
+}
+
+template <typename Duration, typename Clock, typename Storage>
+void dump(const Stopwatch<Duration, Clock, Storage>& sw,
+          const std::string& path) {
+  using time_point = typename Clock::time_point;
+  using period = typename Clock::period;
+  using nano = std::chrono::duration<double, std::nano>;
+
+  archive_header head{};
+  std::memcpy(head.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+  head.version = ARCHIVE_VERSION;
+  head.clock = clock_traits<Clock>::id;
+  head.num = period::num;
+  head.den = period::den;
+  head.ns_per_tick = clock_traits<Clock>::template convert<nano>(
+                         typename Clock::duration(1))
+                         .count();
+  head.count = sw.data_size();
+  head.mode = sw.mode() ? 1 : 0;
+  head.tick_size = sizeof(time_point);
+
+  // Non-contiguous storage is flattened first.
+  std::vector<time_point> flat;
+  const time_point* points;
+  if constexpr (is_contiguous<Storage>::value) {
+    points = sw.data().data();
+  } else {
+    flat.assign(sw.data().begin(), sw.data().end());
+    points = flat.data();
+  }
+
+  const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw std::runtime_error("Cannot create capture " + path);
+  iovec parts[2];
+  parts[0].iov_base = &head;
+  parts[0].iov_len = sizeof(head);
+  parts[1].iov_base = const_cast<time_point*>(points);
+  parts[1].iov_len = sw.data_size() * sizeof(time_point);
+  // Resume after partial writes and signals, which are rare
+  // for regular files.
+  int first = 0;
+  while (first < 2) {
+    const auto written = ::writev(fd, parts + first, 2 - first);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot write capture " + path);
+    }
+    auto done = static_cast<size_t>(written);
+    while (first < 2 && done >= parts[first].iov_len) {
+      done -= parts[first].iov_len;
+      ++first;
+    }
+    if (first < 2) {
+      parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + done;
+      parts[first].iov_len -= done;
+    }
+  }
+  if (::close(fd) != 0) {
+    throw std::runtime_error("Cannot close capture " + path);
+  }
+}
+
+template <typename Duration, typename Clock>
+MappedStopwatch<Duration, Clock> load(const std::string& path) {
+  using period = typename Clock::period;
+  using nano = std::chrono::duration<double, std::nano>;
+  mapped_buffer<typename Clock::time_point> buffer(path);
+  const auto& head = buffer.header();
+  // Unknown clocks cannot be told apart, so they never match.
+  if (head.clock == 0 || head.clock != clock_traits<Clock>::id ||
+      head.num != period::num || head.den != period::den) {
+    throw std::runtime_error("Capture was saved from a different clock.");
+  }
+  const auto local = clock_traits<Clock>::template convert<nano>(
+                         typename Clock::duration(1))
+                         .count();
+  if (!(std::abs(head.ns_per_tick - local) <=
+        ARCHIVE_CALIBRATION_TOLERANCE * local)) {
+    throw std::runtime_error("Capture was saved with another calibration.");
+  }
+  const bool mode = head.mode != 0;
+  return MappedStopwatch<Duration, Clock>(std::move(buffer), mode);
+}
@@ -0,0 +1,284 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of asynchronously exported stopwatch.
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "stopwatch.h"
+
+/**
+ * A lock-free ring of N elements for exactly one
+ * producer thread and one consumer thread.
+ * REQUIRES: N is a power of two.
+ */
+template <typename T, size_t N>
+class spsc_ring {
+  static_assert(N >= 2 && (N & (N - 1)) == 0,
+                "Capacity must be a power of two.");
+
+ private:
+  // Assumed size of a cache line.
+  static constexpr size_t CACHE_LINE = 64;
+
+  // Producer position, and the consumer position it last saw.
+  alignas(CACHE_LINE) std::atomic<size_t> tail{0};
+  size_t cached_head = 0;
+
+  // Consumer position.
+  alignas(CACHE_LINE) std::atomic<size_t> head{0};
+
+  // Element storage.
+  alignas(CACHE_LINE) std::array<T, N> slots;
+
+ public:
+  /**
+   * Appends value unless the ring is full.
+   * Returns whether or not value was appended.
+   * REQUIRES: only called from the producer thread.
+   */
+  bool try_push(const T& value) noexcept;
+
+  /**
+   * Moves up to max of the oldest elements into out.
+   * Returns the number of elements moved.
+   * REQUIRES: only called from the consumer thread.
+   */
+  size_t pop(T* out, size_t max) noexcept;
+
+  /**
+   * Returns the number of elements ever appended.
+   */
+  size_t pushed() const noexcept;
+};
+
+/**
+ * A stopwatch that streams its splits out instead of
+ * storing them. record writes into a lock-free ring that
+ * a background flusher thread drains every interval. The
+ * flusher converts each batch into splits and hands them
+ * to every sink. If the ring is full, record drops the time
+ * point and counts the drop rather than blocking. The gap
+ * across dropped time points is not a split, so the flusher
+ * starts over from the next kept time point.
+ * Sinks run on the flusher thread and must not throw.
+ * REQUIRES: record is only called from one thread at a time.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock, size_t N = (1 << 16)>
+class AsyncStopwatch {
+ public:
+  /**
+   * Receives a batch of consecutive splits.
+   */
+  using export_sink =
+      std::function<void(const typename Duration::rep* splits, size_t count)>;
+
+ private:
+  /* --- MEMBER TYPES --- */
+
+  // A recorded time point, and whether points before it were dropped.
+  struct entry {
+    typename Clock::time_point point;
+    bool after_drop;
+  };
+
+  /* --- MEMBER VARIABLES --- */
+
+  // Largest number of time points exported at once.
+  static constexpr size_t BATCH = 4096;
+
+  // Time points waiting to be exported.
+  const std::unique_ptr<spsc_ring<entry, N>> ring;
+
+  // Time points dropped by record. Only written by the producer.
+  std::atomic<uint64_t> drops{0};
+
+  // Whether the last time point was dropped. Only used by the producer.
+  bool dropping = false;
+
+  // Time points handed to the sinks. Only written by the flusher.
+  std::atomic<uint64_t> delivered{0};
+
+  // Cleared to stop the flusher.
+  std::atomic<bool> running{true};
+
+  // Receivers of every batch.
+  const std::vector<export_sink> sinks;
+
+  // How long the flusher sleeps when the ring is empty.
+  const std::chrono::microseconds interval;
+
+  // Drains the ring until stopped.
+  std::thread flusher;
+
+  // Flusher loop.
+  void drain_loop();
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Starts the flusher thread, which wakes up every
+   * interval to export splits to the given sinks.
+   */
+  explicit AsyncStopwatch(
+      std::vector<export_sink> sinks_in,
+      std::chrono::microseconds interval_in = std::chrono::milliseconds(10));
+
+  // The flusher is tied to this instance.
+  AsyncStopwatch(const AsyncStopwatch&) = delete;
+  AsyncStopwatch& operator=(const AsyncStopwatch&) = delete;
+
+  /**
+   * Stops the flusher after exporting every recorded time point.
+   */
+  ~AsyncStopwatch();
+
+  /**
+   * Records the current time measurement into the ring,
+   * or counts a drop if the ring is full. Never blocks.
+   */
+  void record() noexcept;
+
+  /**
+   * Returns the number of time points dropped by record.
+   */
+  uint64_t dropped() const noexcept;
+
+  /**
+   * Returns the number of time points handed to the sinks.
+   */
+  uint64_t exported() const noexcept;
+
+  /**
+   * Blocks until every time point recorded so far
+   * has been handed to the sinks.
+   */
+  void flush() const noexcept;
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename T, size_t N>
+inline bool spsc_ring<T, N>::try_push(const T& value) noexcept {
+  const auto pos = tail.load(std::memory_order_relaxed);
+  if (pos - cached_head == N) {
+    // Only look at the consumer when the ring seems full.
+    cached_head = head.load(std::memory_order_acquire);
+    if (pos - cached_head == N) return false;
+  }
+  slots[pos & (N - 1)] = value;
+  tail.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+template <typename T, size_t N>
+inline size_t spsc_ring<T, N>::pop(T* out, size_t max) noexcept {
+  const auto pos = head.load(std::memory_order_relaxed);
+  const auto count =
+      std::min(tail.load(std::memory_order_acquire) - pos, max);
+  for (size_t i = 0; i < count; ++i) out[i] = slots[(pos + i) & (N - 1)];
+  head.store(pos + count, std::memory_order_release);
+  return count;
+}
+
+template <typename T, size_t N>
+inline size_t spsc_ring<T, N>::pushed() const noexcept {
+  return tail.load(std::memory_order_acquire);
+}
+
+template <typename Duration, typename Clock, size_t N>
+AsyncStopwatch<Duration, Clock, N>::AsyncStopwatch(
+    std::vector<export_sink> sinks_in, std::chrono::microseconds interval_in)
+    : ring(std::make_unique<spsc_ring<entry, N>>()),
+      sinks(std::move(sinks_in)),
+      interval(interval_in),
+      flusher(&AsyncStopwatch::drain_loop, this) {}
+
+template <typename Duration, typename Clock, size_t N>
+AsyncStopwatch<Duration, Clock, N>::~AsyncStopwatch() {
+  running.store(false, std::memory_order_release);
+  flusher.join();
+}
+
+template <typename Duration, typename Clock, size_t N>
+inline void AsyncStopwatch<Duration, Clock, N>::record() noexcept {
+  if (ring->try_push(entry{Clock::now(), dropping})) {
+    dropping = false;
+  } else {
+    dropping = true;
+    // Single writer, so this needs no read-modify-write.
+    drops.store(drops.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
+}
+
+template <typename Duration, typename Clock, size_t N>
+inline uint64_t AsyncStopwatch<Duration, Clock, N>::dropped() const noexcept {
+  return drops.load(std::memory_order_relaxed);
+}
+
+template <typename Duration, typename Clock, size_t N>
+inline uint64_t AsyncStopwatch<Duration, Clock, N>::exported()
+    const noexcept {
+  return delivered.load(std::memory_order_acquire);
+}
+
+template <typename Duration, typename Clock, size_t N>
+inline void AsyncStopwatch<Duration, Clock, N>::flush() const noexcept {
+  const auto target = ring->pushed();
+  while (delivered.load(std::memory_order_acquire) < target) {
+    std::this_thread::yield();
+  }
+}
+
+template <typename Duration, typename Clock, size_t N>
+void AsyncStopwatch<Duration, Clock, N>::drain_loop() {
+  std::vector<entry> points(BATCH);
+  std::vector<typename Duration::rep> splits;
+  splits.reserve(BATCH);
+  typename Clock::time_point last;
+  bool started = false;
+  // Hands the pending splits to every sink.
+  const auto send = [&] {
+    if (!splits.empty()) {
+      for (const auto& sink : sinks) sink(splits.data(), splits.size());
+    }
+    splits.clear();
+  };
+  // Exports one batch, returning the number of time points drained.
+  const auto drain = [&] {
+    const auto count = ring->pop(points.data(), BATCH);
+    for (size_t i = 0; i < count; ++i) {
+      // Batches only hold consecutive splits.
+      if (points[i].after_drop) send();
+      if (started && !points[i].after_drop) {
+        splits.push_back(clock_traits<Clock>::template convert<Duration>(
+                             points[i].point - last)
+                             .count());
+      }
+      last = points[i].point;
+      started = true;
+    }
+    send();
+    delivered.store(delivered.load(std::memory_order_relaxed) + count,
+                    std::memory_order_release);
+    return count;
+  };
+  while (running.load(std::memory_order_acquire)) {
+    if (drain() < BATCH) std::this_thread::sleep_for(interval);
+  }
+  while (drain() > 0) {
+  }
+}
@@ -0,0 +1,316 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Microbenchmarks for stopwatch overhead and throughput.
+*/
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#include "histogram.h"
+#include "instrument.h"
+#include "stopwatch.h"
+#include "tsc_clock.h"
+
+using std::cout;
+using std::ostream;
+using std::string;
+using std::vector;
+using std::chrono::high_resolution_clock;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+// Number of time points recorded by each run.
+static constexpr size_t POINTS = 1 << 20;
+
+// Number of timed runs per benchmark, after one warmup run.
+static constexpr unsigned REPEATS = 5;
+
+namespace Bench {
+/**
+ * A single named measurement.
+ */
+struct result {
+  string name;
+  string unit;
+  double value;
+};
+
+/**
+ * Prevents the compiler from discarding value.
+ */
+template <typename T>
+void keep(const T& value);
+
+/**
+ * Runs fn once to warm up, then REPEATS times.
+ * Returns the fastest run in nanoseconds per op.
+ */
+template <typename Func>
+double measure(Func fn, size_t ops);
+
+/**
+ * Pins the calling thread to the processor it is running on.
+ * Returns whether or not pinning succeeded.
+ */
+bool pin() noexcept;
+
+/**
+ * Writes the results as a JSON document.
+ */
+void write_json(ostream&, const vector<result>&, bool pinned);
+
+// Benchmark groups.
+template <typename Clock>
+void bench_record(vector<result>&, const string& clock);
+void bench_access(vector<result>&);
+void bench_interleave(vector<result>&);
+void bench_memory(vector<result>&);
+void bench_instrument(vector<result>&);
+}  // namespace Bench
+
+/**
+ * Usage: ./bench [output.json]
+ * Writes JSON to the given file, or stdout if none is given.
+ */
+int main(int argc, char** argv) {
+  const bool pinned = Bench::pin();
+  vector<Bench::result> results;
+  Bench::bench_record<steady_clock>(results, "steady_clock");
+  Bench::bench_record<system_clock>(results, "system_clock");
+  Bench::bench_record<high_resolution_clock>(results, "high_resolution_clock");
+  Bench::bench_record<tsc_clock>(results, "tsc_clock");
+  Bench::bench_access(results);
+  Bench::bench_interleave(results);
+  Bench::bench_memory(results);
+  Bench::bench_instrument(results);
+
+  if (argc > 1) {
+    std::ofstream file(argv[1]);
+    Bench::write_json(file, results, pinned);
+  } else {
+    Bench::write_json(cout, results, pinned);
+  }
+}
+
+template <typename T>
+inline void Bench::keep(const T& value) {
+#if defined(__GNUC__)
+  __asm__ __volatile__("" : : "r,m"(value) : "memory");
+#else
+  static const volatile T* sink;
+  sink = &value;
+#endif
+}
+
+template <typename Func>
+double Bench::measure(Func fn, size_t ops) {
+  fn();
+  auto best = std::numeric_limits<double>::max();
+  for (unsigned i = 0; i < REPEATS; ++i) {
+    const auto start = steady_clock::now();
+    fn();
+    const std::chrono::duration<double, std::nano> elapsed =
+        steady_clock::now() - start;
+    best = std::min(best, elapsed.count() / static_cast<double>(ops));
+  }
+  return best;
+}
+
+bool Bench::pin() noexcept {
+#if defined(__linux__)
+  const int cpu = sched_getcpu();
+  if (cpu < 0) return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+void Bench::write_json(ostream& os, const vector<result>& results,
+                       bool pinned) {
+  os << "{\n  \"context\": {\n"
+     << "    \"compiler\": \"" << __VERSION__ << "\",\n"
+     << "    \"points\": " << POINTS << ",\n"
+     << "    \"repeats\": " << REPEATS << ",\n"
+     << "    \"pinned\": " << (pinned ? "true" : "false") << "\n  },\n"
+     << "  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& res = results[i];
+    os << "    {\"name\": \"" << res.name << "\", \"unit\": \"" << res.unit
+       << "\", \"value\": " << res.value << '}'
+       << (i + 1 < results.size() ? ",\n" : "\n");
+  }
+  os << "  ]\n}\n";
+}
+
+template <typename Clock>
+void Bench::bench_record(vector<result>& results, const string& clock) {
+  const auto fresh = measure(
+      [] {
+        Stopwatch<nanoseconds, Clock> sw;
+        for (size_t i = 0; i < POINTS; ++i) sw.record();
+        keep(sw.data().back());
+      },
+      POINTS);
+  results.push_back({"record/" + clock + "/growing", "ns/call", fresh});
+
+  // Clearing keeps the reserved capacity between runs.
+  Stopwatch<nanoseconds, Clock> reserved(POINTS);
+  const auto warm = measure(
+      [&reserved] {
+        reserved.clear();
+        for (size_t i = 0; i < POINTS; ++i) reserved.record();
+        keep(reserved.data().back());
+      },
+      POINTS);
+  results.push_back({"record/" + clock + "/reserved", "ns/call", warm});
+
+  FixedStopwatch<4096, nanoseconds, Clock> fixed;
+  const auto ring = measure(
+      [&fixed] {
+        for (size_t i = 0; i < POINTS; ++i) fixed.record();
+        keep(fixed.data().back());
+      },
+      POINTS);
+  results.push_back({"record/" + clock + "/fixed", "ns/call", ring});
+}
+
+void Bench::bench_access(vector<result>& results) {
+  Stopwatch<nanoseconds> sw(POINTS);
+  for (size_t i = 0; i < POINTS; ++i) sw.record();
+  const auto count = sw.size();
+
+  const auto index = measure(
+      [&sw, count] {
+        nanoseconds::rep total = 0;
+        for (size_t i = 0; i < count; ++i) total += sw[i];
+        keep(total);
+      },
+      count);
+  results.push_back({"access/operator[]", "ns/element", index});
+
+  const auto iterate = measure(
+      [&sw] {
+        nanoseconds::rep total = 0;
+        for (const auto split : sw) total += split;
+        keep(total);
+      },
+      count);
+  results.push_back({"access/iterator", "ns/element", iterate});
+
+  vector<nanoseconds::rep> out(count);
+  const auto bulk = measure(
+      [&sw, &out] {
+        sw.splits_into(out.data());
+        keep(out.back());
+      },
+      count);
+  results.push_back({"access/splits_into", "ns/element", bulk});
+}
+
+void Bench::bench_interleave(vector<result>& results) {
+  for (const size_t k : {2, 8, 32}) {
+    for (const size_t each : {1 << 10, 1 << 16}) {
+      vector<Stopwatch<nanoseconds>> shards(k);
+      for (size_t i = 0; i < k * each; ++i) shards[i % k].record();
+      const auto suffix = "/" + std::to_string(k) + "x" + std::to_string(each);
+
+      const auto fold = measure(
+          [&shards] {
+            auto sum = shards.front();
+            for (size_t i = 1; i < shards.size(); ++i) sum += shards[i];
+            keep(sum.data().back());
+          },
+          k * each);
+      results.push_back({"interleave/fold" + suffix, "ns/point", fold});
+
+      const auto merge = measure(
+          [&shards] {
+            const auto sum =
+                Stopwatch<nanoseconds>::merge(shards.begin(), shards.end());
+            keep(sum.data().back());
+          },
+          k * each);
+      results.push_back({"interleave/merge" + suffix, "ns/point", merge});
+    }
+  }
+}
+
+void Bench::bench_memory(vector<result>& results) {
+  const auto per_point = [](size_t bytes) {
+    return static_cast<double>(bytes) / static_cast<double>(POINTS);
+  };
+
+  Stopwatch<nanoseconds> growing;
+  CompactStopwatch<nanoseconds> compact;
+  for (size_t i = 0; i < POINTS; ++i) {
+    growing.record();
+    compact.record();
+  }
+  const Histogram<nanoseconds> hist(growing.begin(), growing.end());
+
+  using time_point = steady_clock::time_point;
+  results.push_back(
+      {"memory/vector", "bytes/point",
+       per_point(growing.data().capacity() * sizeof(time_point))});
+  results.push_back(
+      {"memory/compact", "bytes/point", per_point(compact.data().footprint())});
+  results.push_back({"memory/fixed", "bytes/point",
+                     static_cast<double>(sizeof(FixedStopwatch<4096>)) / 4096});
+  results.push_back(
+      {"memory/histogram", "bytes/point", per_point(hist.footprint())});
+}
+
+namespace {
+// Sections timed by compiled out sites, which stays empty.
+Stopwatch<std::chrono::nanoseconds> compiled_out_sections;
+
+// The same work, without and with instrumentation sites.
+unsigned plain_work(unsigned x) { return x * 2654435761u >> 7; }
+
+unsigned compiled_out_work(unsigned x) {
+  STOPWATCH_SCOPE(STOPWATCH_LEVEL + 1, compiled_out_sections,
+                  "bench/compiled_out"_section);
+  STOPWATCH_RECORD(STOPWATCH_LEVEL + 1, STOPWATCH_NAMED("bench/compiled_out"));
+  return x * 2654435761u >> 7;
+}
+
+unsigned instrumented_work(unsigned x) {
+  STOPWATCH_RECORD(1, STOPWATCH_NAMED("bench/instrumented"));
+  return x * 2654435761u >> 7;
+}
+}  // namespace
+
+void Bench::bench_instrument(vector<result>& results) {
+  // Calls work through a pointer, so every variant costs one call.
+  const auto run = [](unsigned (*volatile work)(unsigned)) {
+    return measure(
+        [work] {
+          unsigned total = 0;
+          for (unsigned i = 0; i < POINTS; ++i) total += work(i);
+          keep(total);
+        },
+        POINTS);
+  };
+  results.push_back({"instrument/none", "ns/call", run(plain_work)});
+  results.push_back(
+      {"instrument/compiled_out", "ns/call", run(compiled_out_work)});
+  auto& named = stopwatch_registry::global().get("bench/instrumented");
+  named.enable(false);
+  results.push_back({"instrument/disabled", "ns/call", run(instrumented_work)});
+  named.enable(true);
+  results.push_back({"instrument/enabled", "ns/call", run(instrumented_work)});
+}
@@ -0,0 +1,147 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of clock domain alignment.
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include "simd.h"
+
+/**
+ * Describes how time points of one clock domain, such as
+ * the TSC of another socket or another process's epoch, map
+ * onto a shared reference domain. A time point t maps to
+ * t + offset + (t - anchor) * (rate * (1 + drift_ppm / 1e6) - 1).
+ * The default domain is the reference domain itself.
+ */
+template <typename Clock>
+struct clock_domain {
+  // Reference time minus domain time, measured at anchor.
+  typename Clock::duration offset{0};
+
+  // Reference ticks per domain tick.
+  double rate = 1;
+
+  // Additional rate error, in parts per million.
+  double drift_ppm = 0;
+
+  // Domain time at which offset was measured.
+  typename Clock::time_point anchor{};
+
+  /**
+   * Returns the reference ticks gained per domain tick.
+   */
+  double skew() const noexcept { return rate * (1 + drift_ppm * 1e-6) - 1; }
+
+  /**
+   * Returns whether or not this is the reference domain.
+   */
+  bool identity() const noexcept;
+
+  /**
+   * Maps n time points in place onto the reference domain.
+   */
+  void apply(typename Clock::time_point* points, size_t n) const noexcept;
+
+  /**
+   * Returns point mapped onto the reference domain.
+   */
+  typename Clock::time_point apply(typename Clock::time_point point) const
+      noexcept;
+};
+
+/**
+ * Reads time points by index from a range in some clock
+ * domain, mapped onto the reference domain. Maps a block
+ * at a time with the vectorized kernel, so merges can align
+ * as they read instead of in a separate pass. Blocks follow
+ * reads both forwards and backwards.
+ */
+template <typename Clock, typename Iter>
+class aligned_window {
+ private:
+  // Time points mapped at once.
+  static constexpr size_t BLOCK = 256;
+
+  Iter first;
+  size_t count;
+  const clock_domain<Clock>* domain;
+  bool identity;
+
+  // Mapped time points [lo, hi) of the range.
+  std::array<typename Clock::time_point, BLOCK> block;
+  size_t lo = 0, hi = 0;
+
+  // Maps the block containing index.
+  void refill(size_t index) noexcept;
+
+ public:
+  /**
+   * Reads [first_in, first_in + count_in) from domain_in.
+   */
+  aligned_window(Iter first_in, size_t count_in,
+                 const clock_domain<Clock>& domain_in) noexcept;
+
+  /**
+   * Returns the mapped time point at index.
+   * REQUIRES: index < count.
+   */
+  typename Clock::time_point operator[](size_t index) noexcept;
+
+  /**
+   * Returns the number of time points in the range.
+   */
+  size_t size() const noexcept { return count; }
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Clock>
+inline bool clock_domain<Clock>::identity() const noexcept {
+  const auto slope = skew();
+  return offset.count() == 0 && !(slope < 0) && !(slope > 0);
+}
+
+template <typename Clock>
+inline void clock_domain<Clock>::apply(typename Clock::time_point* points,
+                                       size_t n) const noexcept {
+  align_ticks(points, n, anchor.time_since_epoch().count(), offset.count(),
+              skew());
+}
+
+template <typename Clock>
+inline typename Clock::time_point clock_domain<Clock>::apply(
+    typename Clock::time_point point) const noexcept {
+  apply(&point, 1);
+  return point;
+}
+
+template <typename Clock, typename Iter>
+inline aligned_window<Clock, Iter>::aligned_window(
+    Iter first_in, size_t count_in,
+    const clock_domain<Clock>& domain_in) noexcept
+    : first(first_in),
+      count(count_in),
+      domain(&domain_in),
+      identity(domain_in.identity()) {}
+
+template <typename Clock, typename Iter>
+inline typename Clock::time_point aligned_window<Clock, Iter>::operator[](
+    size_t index) noexcept {
+  if (identity) return *std::next(first, static_cast<ptrdiff_t>(index));
+  if (index < lo || index >= hi) refill(index);
+  return block[index - lo];
+}
+
+template <typename Clock, typename Iter>
+void aligned_window<Clock, Iter>::refill(size_t index) noexcept {
+  // Reading backwards ends the block at index, otherwise it starts there.
+  lo = index < lo ? (index + 1 > BLOCK ? index + 1 - BLOCK : 0) : index;
+  hi = std::min(lo + BLOCK, count);
+  std::copy(std::next(first, static_cast<ptrdiff_t>(lo)),
+            std::next(first, static_cast<ptrdiff_t>(hi)), block.begin());
+  domain->apply(block.data(), hi - lo);
+}
@@ -0,0 +1,350 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of multi-threaded stopwatch.
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "stopwatch.h"
+#include "storage.h"
+
+/**
+ * A stopwatch that may be recorded from many threads
+ * at once. Each thread records into its own cache line
+ * aligned buffer, so record touches no shared atomics
+ * and takes no lock after a thread's first call. Buffers
+ * grow by adding chunks that never move, so readers see a
+ * merged view of all threads, or a snapshot of what each
+ * thread has published, without blocking recording.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock>
+class ConcurrentStopwatch {
+ private:
+  /* --- MEMBER TYPES --- */
+
+  using time_point = typename Clock::time_point;
+
+  // Assumed size of a cache line.
+  static constexpr size_t CACHE_LINE = 64;
+
+  // Entries in each thread's cache of recently used lanes.
+  static constexpr size_t CACHE_SLOTS = 16;
+
+  // Time points recorded by a single thread. Chunk k holds
+  // 2^(shift + k) time points and never moves once allocated.
+  struct alignas(CACHE_LINE) lane {
+    std::array<std::unique_ptr<time_point[]>, 64> chunks;
+    const unsigned shift;
+    // Only touched by the recording thread.
+    time_point* tail = nullptr;
+    time_point* tail_end = nullptr;
+    size_t next_chunk = 0;
+    size_t size = 0;
+    // Number of time points readers may see while recording.
+    std::atomic<size_t> published{0};
+
+    explicit lane(unsigned shift_in) : shift(shift_in) {}
+
+    // Moves the tail into the next chunk, allocating it if needed.
+    void grow();
+
+    // Returns the time point at index, which must be published.
+    const time_point& at(size_t index) const noexcept;
+  };
+
+  /* --- MEMBER VARIABLES --- */
+
+  // Unique across all instances, used to key thread local lookups.
+  const uint64_t id;
+
+  // Log of the number of time points in each lane's first chunk.
+  const unsigned chunk_shift;
+
+  // Guards lanes. Only taken on a thread's first record.
+  mutable std::mutex registry_lock;
+
+  // One buffer per thread that has recorded. Shared so that
+  // threads can tell when the instance of a lane is gone.
+  std::vector<std::shared_ptr<lane>> lanes;
+
+  // Finds or registers the lane for the calling thread.
+  lane& local();
+
+  // Finds the lane for the calling thread when it is not cached,
+  // registering a new one on the thread's first record.
+  lane& attach();
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * A read-only, random access view of the first count
+   * time points of one thread's buffer.
+   */
+  class points_view {
+    friend class ConcurrentStopwatch;
+
+   private:
+    const lane* src;
+    size_t count;
+
+    points_view(const lane& src_in, size_t count_in) noexcept
+        : src(&src_in), count(count_in) {}
+
+   public:
+    using value_type = time_point;
+    using const_iterator = index_iterator<points_view>;
+
+    size_t size() const noexcept { return count; }
+    bool empty() const noexcept { return count == 0; }
+    value_type operator[](size_t index) const noexcept {
+      return src->at(index);
+    }
+    const_iterator begin() const noexcept { return const_iterator(this, 0); }
+    const_iterator end() const noexcept {
+      return const_iterator(this, static_cast<ptrdiff_t>(count));
+    }
+  };
+
+  /**
+   * Optional argument to reserve the given number
+   * of durations in each thread's buffer.
+   */
+  explicit ConcurrentStopwatch(size_t res = 1);
+
+  // Thread buffers are tied to this instance.
+  ConcurrentStopwatch(const ConcurrentStopwatch&) = delete;
+  ConcurrentStopwatch& operator=(const ConcurrentStopwatch&) = delete;
+
+  /**
+   * Records the current time measurement
+   * into the calling thread's buffer.
+   */
+  void record();
+
+  /**
+   * Returns the number of threads that have recorded.
+   */
+  size_t threads() const;
+
+  /**
+   * Returns the number of time points across all threads.
+   * REQUIRES: no concurrent calls to record.
+   */
+  size_t data_size() const;
+
+  /**
+   * Returns a stopwatch of all time points recorded
+   * by all threads, produced by a k-way merge of
+   * the sorted thread buffers. Unlike interleaving,
+   * time points that are common between threads are
+   * all kept. Optional argument to specify the mode.
+   * REQUIRES: no concurrent calls to record.
+   */
+  Stopwatch<Duration, Clock> merged(
+      bool mode = Stopwatch<Duration, Clock>::SPLIT_MODE) const;
+
+  /**
+   * Calls visit(thread, points) with a points_view of the
+   * sorted time points recorded by each thread, numbering
+   * threads from zero in order of their first record.
+   * REQUIRES: no concurrent calls to record.
+   */
+  template <typename Visitor>
+  void for_each_thread(Visitor visit) const;
+
+  /**
+   * Calls visit(thread, first, last) with random access
+   * iterators over the time points each thread has published
+   * so far, numbering threads as for_each_thread. Safe while
+   * other threads record, which never wait on the visit.
+   * Only threads recording for the first time wait.
+   */
+  template <typename Visitor>
+  void for_each_published(Visitor visit) const;
+
+  /**
+   * Delete all recorded time points. Buffers keep
+   * their chunks for the next records.
+   * REQUIRES: no concurrent calls to record.
+   */
+  void clear();
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration, typename Clock>
+void ConcurrentStopwatch<Duration, Clock>::lane::grow() {
+  auto& chunk = chunks[next_chunk];
+  const auto length = size_t(1) << (shift + next_chunk);
+  if (!chunk) chunk.reset(new time_point[length]);
+  tail = chunk.get();
+  tail_end = tail + length;
+  ++next_chunk;
+}
+
+template <typename Duration, typename Clock>
+inline const typename Clock::time_point&
+ConcurrentStopwatch<Duration, Clock>::lane::at(size_t index) const noexcept {
+  // Chunk k starts at (2^k - 1) << shift.
+  const auto scaled = (index >> shift) + 1;
+  const auto k = static_cast<size_t>(63 - __builtin_clzll(scaled));
+  return chunks[k][index - (((size_t(1) << k) - 1) << shift)];
+}
+
+template <typename Duration, typename Clock>
+inline ConcurrentStopwatch<Duration, Clock>::ConcurrentStopwatch(size_t res)
+    : id([] {
+        // Zero marks an empty entry in the thread local cache.
+        static std::atomic<uint64_t> next_id(1);
+        return next_id++;
+      }()),
+      chunk_shift([res] {
+        unsigned shift = 0;
+        while ((size_t(1) << shift) < res + 1) ++shift;
+        return shift;
+      }()) {}
+
+template <typename Duration, typename Clock>
+inline typename ConcurrentStopwatch<Duration, Clock>::lane&
+ConcurrentStopwatch<Duration, Clock>::local() {
+  // Recently used lanes on this thread, mapped by instance. Ids
+  // are never reused, so a matching entry is always live.
+  thread_local std::array<std::pair<uint64_t, lane*>, CACHE_SLOTS> cache{};
+  auto& entry = cache[id % CACHE_SLOTS];
+  if (entry.first == id) return *entry.second;
+  auto& found = attach();
+  entry = {id, &found};
+  return found;
+}
+
+template <typename Duration, typename Clock>
+typename ConcurrentStopwatch<Duration, Clock>::lane&
+ConcurrentStopwatch<Duration, Clock>::attach() {
+  struct known_lane {
+    uint64_t id;
+    lane* ptr;
+    std::weak_ptr<lane> owner;
+  };
+  // Every lane this thread has used whose instance may be alive,
+  // so it holds at most one entry per live instance.
+  thread_local std::vector<known_lane> known;
+  const auto iter =
+      std::find_if(known.begin(), known.end(),
+                   [this](const known_lane& entry) { return entry.id == id; });
+  if (iter != known.end()) return *iter->ptr;
+
+  // Forget lanes of destroyed instances before adding one, so
+  // long-lived threads recording into short-lived instances
+  // do not pile them up.
+  known.erase(std::remove_if(known.begin(), known.end(),
+                             [](const known_lane& entry) {
+                               return entry.owner.expired();
+                             }),
+              known.end());
+  auto fresh = std::make_shared<lane>(chunk_shift);
+  auto* const ptr = fresh.get();
+  {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    lanes.push_back(fresh);
+  }
+  known.push_back({id, ptr, std::move(fresh)});
+  return *ptr;
+}
+
+template <typename Duration, typename Clock>
+inline void ConcurrentStopwatch<Duration, Clock>::record() {
+  const auto now = Clock::now();
+  auto& ln = local();
+  if (ln.tail == ln.tail_end) ln.grow();
+  *ln.tail++ = now;
+  ln.published.store(++ln.size, std::memory_order_release);
+}
+
+template <typename Duration, typename Clock>
+inline size_t ConcurrentStopwatch<Duration, Clock>::threads() const {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  return lanes.size();
+}
+
+template <typename Duration, typename Clock>
+size_t ConcurrentStopwatch<Duration, Clock>::data_size() const {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  size_t total = 0;
+  for (const auto& ln : lanes) total += ln->size;
+  return total;
+}
+
+template <typename Duration, typename Clock>
+Stopwatch<Duration, Clock> ConcurrentStopwatch<Duration, Clock>::merged(
+    bool mode) const {
+  // Time point, lane index, and index within the lane.
+  using cursor = std::tuple<time_point, size_t, size_t>;
+
+  std::lock_guard<std::mutex> guard(registry_lock);
+  size_t total = 0;
+  std::vector<cursor> heads;
+  heads.reserve(lanes.size());
+  for (size_t i = 0; i < lanes.size(); ++i) {
+    total += lanes[i]->size;
+    if (lanes[i]->size != 0) heads.emplace_back(lanes[i]->at(0), i, 0);
+  }
+
+  std::vector<time_point> out;
+  out.reserve(total);
+  std::priority_queue<cursor, std::vector<cursor>, std::greater<cursor>> heap(
+      std::greater<cursor>(), std::move(heads));
+  while (!heap.empty()) {
+    auto [point, ln, idx] = heap.top();
+    heap.pop();
+    out.push_back(point);
+    if (++idx < lanes[ln]->size) heap.emplace(lanes[ln]->at(idx), ln, idx);
+  }
+  return Stopwatch<Duration, Clock>(std::move(out), mode);
+}
+
+template <typename Duration, typename Clock>
+template <typename Visitor>
+void ConcurrentStopwatch<Duration, Clock>::for_each_thread(
+    Visitor visit) const {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  for (size_t i = 0; i < lanes.size(); ++i) {
+    const points_view points(*lanes[i], lanes[i]->size);
+    visit(i, points);
+  }
+}
+
+template <typename Duration, typename Clock>
+template <typename Visitor>
+void ConcurrentStopwatch<Duration, Clock>::for_each_published(
+    Visitor visit) const {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  for (size_t i = 0; i < lanes.size(); ++i) {
+    const auto& ln = *lanes[i];
+    const points_view points(ln, ln.published.load(std::memory_order_acquire));
+    visit(i, points.begin(), points.end());
+  }
+}
+
+template <typename Duration, typename Clock>
+void ConcurrentStopwatch<Duration, Clock>::clear() {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  for (auto& ln : lanes) {
+    ln->tail = ln->tail_end = nullptr;
+    ln->next_chunk = 0;
+    ln->size = 0;
+    ln->published.store(0, std::memory_order_release);
+  }
+}
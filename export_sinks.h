@@ -0,0 +1,298 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Sinks for asynchronously exported splits.
+*/
+#pragma once
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Appends every split to a file. Splits are written either
+ * as raw native reps, or compressed as zigzag LEB128 varints,
+ * which takes one or two bytes for most short splits.
+ * Copies append to the same file.
+ */
+template <typename Duration>
+class file_sink {
+  static_assert(std::is_integral_v<typename Duration::rep>,
+                "Splits must be integers.");
+
+ private:
+  std::shared_ptr<std::ofstream> file;
+  bool compressed;
+
+  // Reused between batches.
+  std::shared_ptr<std::string> buffer;
+
+ public:
+  /**
+   * Opens path for appending.
+   * THROWS: if the file cannot be opened.
+   */
+  explicit file_sink(const std::string& path, bool compress = false);
+
+  /**
+   * Appends the splits.
+   */
+  void operator()(const typename Duration::rep* splits, size_t count);
+};
+
+/**
+ * Reads back every split appended by file_sink.
+ * THROWS: if the file cannot be read or is truncated or corrupt.
+ */
+template <typename Duration>
+std::vector<typename Duration::rep> read_splits(const std::string& path,
+                                                bool compressed = false);
+
+/**
+ * Sends every split to a statsd server over UDP as a timer,
+ * "metric:value|ms", packing lines into datagrams of at most
+ * MAX_DATAGRAM bytes. Values are in Duration units, so use
+ * milliseconds for standard statsd timers. Best effort, so
+ * send failures are ignored. Copies share the socket.
+ */
+template <typename Duration>
+class statsd_sink {
+ public:
+  // Fits within a typical Ethernet MTU.
+  static constexpr size_t MAX_DATAGRAM = 1432;
+
+ private:
+  std::shared_ptr<int> socket_fd;
+  sockaddr_in address;
+  std::string metric;
+
+ public:
+  /**
+   * Sends to the IPv4 address and port.
+   * THROWS: if the address is invalid or no socket is available.
+   */
+  statsd_sink(const std::string& ipv4, uint16_t port, std::string name);
+
+  /**
+   * Sends the splits.
+   */
+  void operator()(const typename Duration::rep* splits, size_t count) const;
+};
+
+/**
+ * Accumulates splits into cumulative buckets with fixed upper
+ * bounds, and renders them in the Prometheus text exposition
+ * format for scraping. Safe to render while splits are added.
+ * Copies share the counts.
+ */
+template <typename Duration>
+class prometheus_histogram {
+ private:
+  struct state {
+    std::mutex lock;
+    std::vector<typename Duration::rep> bounds;
+    // One count per bound, then one for larger splits.
+    std::vector<uint64_t> counts;
+    typename Duration::rep sum = 0;
+    uint64_t count = 0;
+  };
+  std::shared_ptr<state> shared;
+
+ public:
+  /**
+   * Uses the given bucket upper bounds.
+   * THROWS: if the bounds are not strictly increasing.
+   */
+  explicit prometheus_histogram(std::vector<typename Duration::rep> bounds);
+
+  /**
+   * Adds the splits.
+   */
+  void operator()(const typename Duration::rep* splits, size_t count);
+
+  /**
+   * Returns the number of splits added.
+   */
+  uint64_t count() const;
+
+  /**
+   * Renders the buckets, sum, and count as metric name.
+   */
+  std::string exposition(const std::string& name) const;
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration>
+file_sink<Duration>::file_sink(const std::string& path, bool compress)
+    : file(std::make_shared<std::ofstream>(
+          path, std::ios::binary | std::ios::app)),
+      compressed(compress),
+      buffer(std::make_shared<std::string>()) {
+  if (!*file) throw std::runtime_error("Cannot open export file " + path);
+}
+
+template <typename Duration>
+void file_sink<Duration>::operator()(const typename Duration::rep* splits,
+                                     size_t count) {
+  if (!compressed) {
+    file->write(reinterpret_cast<const char*>(splits),
+                static_cast<std::streamsize>(count * sizeof(*splits)));
+    file->flush();
+    return;
+  }
+  auto& bytes = *buffer;
+  bytes.clear();
+  for (size_t i = 0; i < count; ++i) {
+    const auto value = static_cast<int64_t>(splits[i]);
+    auto zigzag = (static_cast<uint64_t>(value) << 1) ^
+                  static_cast<uint64_t>(value >> 63);
+    while (zigzag >= 0x80) {
+      bytes.push_back(static_cast<char>((zigzag & 0x7F) | 0x80));
+      zigzag >>= 7;
+    }
+    bytes.push_back(static_cast<char>(zigzag));
+  }
+  file->write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  file->flush();
+}
+
+template <typename Duration>
+std::vector<typename Duration::rep> read_splits(const std::string& path,
+                                                bool compressed) {
+  using rep = typename Duration::rep;
+  std::ifstream file(path, std::ios::binary);
+  if (!file) throw std::runtime_error("Cannot open export file " + path);
+  const std::string bytes((std::istreambuf_iterator<char>(file)),
+                          std::istreambuf_iterator<char>());
+  std::vector<rep> splits;
+  if (!compressed) {
+    if (bytes.size() % sizeof(rep) != 0) {
+      throw std::runtime_error("Truncated export file " + path);
+    }
+    splits.resize(bytes.size() / sizeof(rep));
+    std::copy(bytes.begin(), bytes.end(),
+              reinterpret_cast<char*>(splits.data()));
+    return splits;
+  }
+  uint64_t zigzag = 0;
+  unsigned shift = 0;
+  for (const char c : bytes) {
+    // A 64 bit varint has at most ten bytes.
+    if (shift >= 64) throw std::runtime_error("Corrupt export file " + path);
+    const auto byte = static_cast<unsigned char>(c);
+    zigzag |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    shift += 7;
+    if (byte & 0x80) continue;
+    const auto value = static_cast<int64_t>(zigzag >> 1) ^
+                       -static_cast<int64_t>(zigzag & 1);
+    splits.push_back(static_cast<rep>(value));
+    zigzag = 0;
+    shift = 0;
+  }
+  if (shift != 0) throw std::runtime_error("Truncated export file " + path);
+  return splits;
+}
+
+template <typename Duration>
+statsd_sink<Duration>::statsd_sink(const std::string& ipv4, uint16_t port,
+                                   std::string name)
+    : address{}, metric(std::move(name)) {
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  if (::inet_pton(AF_INET, ipv4.c_str(), &address.sin_addr) != 1) {
+    throw std::invalid_argument("Invalid statsd address " + ipv4);
+  }
+  const int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) throw std::runtime_error("Cannot create statsd socket.");
+  socket_fd = std::shared_ptr<int>(new int(fd), [](int* sock) {
+    ::close(*sock);
+    delete sock;
+  });
+}
+
+template <typename Duration>
+void statsd_sink<Duration>::operator()(const typename Duration::rep* splits,
+                                       size_t count) const {
+  std::string datagram;
+  datagram.reserve(MAX_DATAGRAM);
+  const auto send = [this, &datagram] {
+    if (datagram.empty()) return;
+    ::sendto(*socket_fd, datagram.data(), datagram.size(), 0,
+             reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    datagram.clear();
+  };
+  for (size_t i = 0; i < count; ++i) {
+    const auto line = metric + ':' + std::to_string(splits[i]) + "|ms";
+    if (datagram.size() + line.size() + 1 > MAX_DATAGRAM) send();
+    if (!datagram.empty()) datagram.push_back('\n');
+    datagram += line;
+  }
+  send();
+}
+
+template <typename Duration>
+prometheus_histogram<Duration>::prometheus_histogram(
+    std::vector<typename Duration::rep> bounds)
+    : shared(std::make_shared<state>()) {
+  if (std::adjacent_find(bounds.begin(), bounds.end(),
+                         [](auto a, auto b) { return a >= b; }) !=
+      bounds.end()) {
+    throw std::invalid_argument("Bucket bounds must be increasing.");
+  }
+  shared->counts.resize(bounds.size() + 1);
+  shared->bounds = std::move(bounds);
+}
+
+template <typename Duration>
+void prometheus_histogram<Duration>::operator()(
+    const typename Duration::rep* splits, size_t count) {
+  std::lock_guard<std::mutex> guard(shared->lock);
+  const auto& bounds = shared->bounds;
+  for (size_t i = 0; i < count; ++i) {
+    const auto bucket =
+        std::lower_bound(bounds.begin(), bounds.end(), splits[i]) -
+        bounds.begin();
+    ++shared->counts[static_cast<size_t>(bucket)];
+    shared->sum += splits[i];
+  }
+  shared->count += count;
+}
+
+template <typename Duration>
+uint64_t prometheus_histogram<Duration>::count() const {
+  std::lock_guard<std::mutex> guard(shared->lock);
+  return shared->count;
+}
+
+template <typename Duration>
+std::string prometheus_histogram<Duration>::exposition(
+    const std::string& name) const {
+  std::lock_guard<std::mutex> guard(shared->lock);
+  std::string text = "# TYPE " + name + " histogram\n";
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i <= shared->bounds.size(); ++i) {
+    cumulative += shared->counts[i];
+    const auto le = i < shared->bounds.size()
+                        ? std::to_string(shared->bounds[i])
+                        : std::string("+Inf");
+    text += name + "_bucket{le=\"" + le + "\"} " +
+            std::to_string(cumulative) + '\n';
+  }
+  text += name + "_sum " + std::to_string(shared->sum) + '\n';
+  text += name + "_count " + std::to_string(shared->count) + '\n';
+  return text;
+}
@@ -4,97 +4,268 @@ Copyright 2020. Siwei Wang.
 Implementation for unit testing framework.
 */
 #include "framework.h"
-using std::count_if;
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <thread>
+#include <vector>
+#include "histogram.h"
+#include "statistics.h"
+#include "stopwatch.h"
+using std::atomic;
 using std::exception;
 using std::function;
-using std::optional;
+using std::invalid_argument;
 using std::ostream;
 using std::out_of_range;
 using std::string;
+using std::string_view;
+using std::thread;
+using std::vector;
+using std::chrono::nanoseconds;
 
-size_t Framework::total_size() const noexcept { return tests.size(); }
+size_t Framework::total_size() const noexcept {
+  index();
+  return order.size();
+}
+
+size_t Framework::executed_size() const noexcept {
+  return num_passed + num_failed;
+}
+
+string_view Framework::name_of(const entry& test) const noexcept {
+  return string_view(names).substr(test.name_pos, test.name_len);
+}
+
+void Framework::index() const noexcept {
+  if (sorted == order.size()) return;
+  const auto by_name = [this](size_t a, size_t b) {
+    return name_of(tests[a]) < name_of(tests[b]);
+  };
+  const auto mid = order.begin() + static_cast<ptrdiff_t>(sorted);
+  // Stable, so a later registration follows an earlier one.
+  std::stable_sort(mid, order.end(), by_name);
+  auto out = mid;
+  for (auto iter = mid; iter != order.end(); ++iter) {
+    const auto next = std::next(iter);
+    if (next != order.end() && !by_name(*iter, *next)) continue;
+    *out++ = *iter;
+  }
+  order.erase(out, order.end());
+  std::inplace_merge(order.begin(), mid, order.end(), by_name);
+  sorted = order.size();
+}
+
+vector<size_t>::const_iterator Framework::locate(string_view name) const
+    noexcept {
+  index();
+  return std::lower_bound(order.begin(), order.end(), name,
+                          [this](size_t idx, string_view key) {
+                            return name_of(tests[idx]) < key;
+                          });
+}
 
-size_t Framework::executed_size() const noexcept { return results.size(); }
+size_t Framework::index_of(string_view name) const {
+  const auto iter = locate(name);
+  if (iter == order.end() || name_of(tests[*iter]) != name) {
+    throw out_of_range("Provided name is not registered.");
+  }
+  return *iter;
+}
+
+bool Framework::contains(string_view name) const noexcept {
+  const auto iter = locate(name);
+  return iter != order.end() && name_of(tests[*iter]) == name;
+}
+
+bool Framework::executed(string_view name) const noexcept {
+  return contains(name) && tests[index_of(name)].ran;
+}
+
+void Framework::add(string_view name, void (*plain)(), function<void()> func,
+                    bool policy, size_t iterations) {
+  // Only the sorted tests are searched. Repeats among the
+  // rest are resolved when they are sorted.
+  const auto last = order.begin() + static_cast<ptrdiff_t>(sorted);
+  const auto iter = std::lower_bound(order.begin(), last, name,
+                                     [this](size_t idx, string_view key) {
+                                       return name_of(tests[idx]) < key;
+                                     });
+  if (iter != last && name_of(tests[*iter]) == name) {
+    auto& test = tests[*iter];
+    if (test.ran) --(test.failure ? num_failed : num_passed);
+    test = entry(test.name_pos, test.name_len, plain, std::move(func), policy,
+                 iterations);
+    return;
+  }
+  tests.emplace_back(names.size(), name.size(), plain, std::move(func), policy,
+                     iterations);
+  names.append(name);
+  order.push_back(tests.size() - 1);
+}
 
-bool Framework::contains(const string& name) const noexcept {
-  return tests.find(name) != tests.end();
+void Framework::emplace(string_view name, void (*func)(), bool policy) {
+  add(name, func, function<void()>(), policy, 0);
 }
 
-bool Framework::executed(const string& name) const noexcept {
-  return results.find(name) != results.end();
+void Framework::emplace_bench(string_view name, function<void()> func,
+                              size_t iterations) {
+  if (iterations == 0) {
+    throw invalid_argument("Benchmarks need at least one iteration.");
+  }
+  add(name, nullptr, std::move(func), SERIAL, iterations);
 }
 
-void Framework::emplace(const string& name, const function<void()>& func) {
-  tests.emplace(name, func);
-  results.erase(name);
+Framework::bench_summary Framework::measure(const entry& bench) {
+  // Warm up caches and branch predictors on a tenth of the iterations.
+  for (size_t i = 0; i < bench.iterations / 10 + 1; ++i) bench.func();
+  Stopwatch<nanoseconds> sw(bench.iterations);
+  sw.correct_overhead();
+  sw.record();
+  for (size_t i = 0; i < bench.iterations; ++i) {
+    bench.func();
+    sw.record();
+  }
+  const Statistics<nanoseconds> stats(sw.begin(), sw.end());
+  const Histogram<nanoseconds> hist(sw.begin(), sw.end(), 3);
+  return {bench.iterations, nanoseconds(stats.min()),
+          nanoseconds(hist.percentile(50)), nanoseconds(hist.percentile(99)),
+          stats.stddev()};
 }
 
-void Framework::run(const string& name) {
-  if (!contains(name)) throw out_of_range("Provided name is not registered.");
-  if (executed(name)) return;
-  const auto& test = tests.at(name);
+void Framework::execute(entry& test) {
+  Stopwatch<nanoseconds> sw(static_cast<size_t>(2));
+  sw.record();
+  try {
+    if (test.iterations > 0) {
+      test.bench = measure(test);
+    } else if (test.plain) {
+      test.plain();
+    } else {
+      test.func();
+    }
+  } catch (...) {
+    test.failure = std::current_exception();
+  }
+  sw.record();
+  test.runtime = nanoseconds(sw[0]);
+  test.ran = true;
+  if (!test.failure) return;
+  // The exception owns the message, so it is not copied.
   try {
-    test();
+    std::rethrow_exception(test.failure);
   } catch (const exception& err) {
-    results.emplace(name, err.what());
-    return;
+    test.error = err.what();
   } catch (...) {
-    results.emplace(name, "Caught unknown exception.");
-    return;
+    test.error = "Caught unknown exception.";
   }
-  results.emplace(name, optional<string>());
 }
 
-void Framework::run_all() {
-  for (const auto& test : tests) run(test.first);
+void Framework::tally(const entry& test) noexcept {
+  ++(test.failure ? num_failed : num_passed);
 }
 
-bool Framework::passed(const string& name) const {
-  const auto& out = results.at(name);
-  return !out.has_value();
+void Framework::run(string_view name) {
+  auto& test = tests[index_of(name)];
+  if (test.ran) return;
+  execute(test);
+  tally(test);
 }
 
-bool Framework::failed(const string& name) const {
-  const auto& out = results.at(name);
-  return out.has_value();
+void Framework::run_all(unsigned threads) {
+  index();
+  if (threads <= 1) {
+    for (const auto idx : order) {
+      if (tests[idx].ran) continue;
+      execute(tests[idx]);
+      tally(tests[idx]);
+    }
+    return;
+  }
+  vector<size_t> pending;
+  for (const auto idx : order) {
+    if (!tests[idx].serial && !tests[idx].ran) pending.push_back(idx);
+  }
+  // Each worker claims the next pending test until none are left.
+  atomic<size_t> next{0};
+  const auto work = [&] {
+    for (auto i = next++; i < pending.size(); i = next++) {
+      execute(tests[pending[i]]);
+    }
+  };
+  vector<thread> pool;
+  for (unsigned t = 0; t < threads && t < pending.size(); ++t) {
+    pool.emplace_back(work);
+  }
+  for (auto& worker : pool) worker.join();
+  for (const auto idx : pending) tally(tests[idx]);
+  run_all(1);
 }
 
-size_t Framework::passed() const noexcept {
-  return count_if(results.begin(), results.end(),
-                  [](const auto& res) { return !res.second.has_value(); });
+bool Framework::passed(string_view name) const {
+  const auto& test = tests[index_of(name)];
+  if (!test.ran) throw out_of_range("Provided test has not been run.");
+  return !test.failure;
 }
 
-size_t Framework::failed() const noexcept {
-  return count_if(results.begin(), results.end(),
-                  [](const auto& res) { return res.second.has_value(); });
-}
+bool Framework::failed(string_view name) const { return !passed(name); }
+
+size_t Framework::passed() const noexcept { return num_passed; }
 
-void Framework::result(const string& name, ostream& os) const {
-  if (!contains(name)) throw out_of_range("Provided name is not registered.");
-  os << "Test " << name;
-  if (!executed(name)) {
+size_t Framework::failed() const noexcept { return num_failed; }
+
+void Framework::result(string_view name, ostream& os) const {
+  const auto& test = tests[index_of(name)];
+  os << (test.iterations > 0 ? "Bench " : "Test ") << name;
+  if (!test.ran) {
     os << " has not been executed.";
-  } else if (passed(name)) {
-    os << " passed.";
   } else {
-    os << " failed.\n";
-    os << "\tError: " << error_msg(name);
+    const auto micros =
+        std::chrono::duration_cast<std::chrono::microseconds>(test.runtime);
+    os << (test.failure ? " failed" : " passed") << " in " << micros.count()
+       << " us.";
+    if (test.failure) {
+      os << "\n\tError: " << test.error;
+    } else if (const auto& bench = test.bench) {
+      os << "\n\tmin " << bench->min.count() << " ns, median "
+         << bench->median.count() << " ns, p99 " << bench->p99.count()
+         << " ns, stddev " << bench->stddev_ns << " ns over "
+         << bench->iterations << " iterations.";
+    }
   }
   os << '\n';
 }
 
 ostream& operator<<(ostream& os, const Framework& fr) {
-  for (const auto& test : fr.tests) {
-    fr.result(test.first, os);
+  fr.index();
+  for (const auto idx : fr.order) {
+    fr.result(fr.name_of(fr.tests[idx]), os);
   }
   return os;
 }
 
-string Framework::error_msg(const string& name) const {
-  const auto& out = results.at(name);
-  return out.value();
+string_view Framework::error_msg(string_view name) const {
+  const auto& test = tests[index_of(name)];
+  if (!test.ran || !test.failure) {
+    throw out_of_range("Provided test has not failed.");
+  }
+  return test.error;
+}
+
+nanoseconds Framework::runtime(string_view name) const {
+  const auto& test = tests[index_of(name)];
+  if (!test.ran) throw out_of_range("Provided test has not been run.");
+  return test.runtime;
+}
+
+const Framework::bench_summary& Framework::summary(string_view name) const {
+  const auto& test = tests[index_of(name)];
+  if (!test.bench || test.failure) {
+    throw out_of_range("Provided name has no benchmark summary.");
+  }
+  return *test.bench;
 }
 
-test_error::test_error(const string& message) : msg(message) {}
+test_error::test_error(string_view message) : msg(message) {}
 
 const char* test_error::what() const throw() { return msg.c_str(); }
@@ -5,13 +5,15 @@ Interface for user-friendly testing framework.
 */
 #pragma once
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <functional>
 #include <iostream>
-#include <map>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 /* --- USER LEVEL ASSERTION STATEMENTS --- */
 
@@ -21,7 +23,7 @@ Interface for user-friendly testing framework.
  * Must be used in conjunction with the framework.
  */
 template <typename Pred>
-void assert_true(Pred, const std::string& = "Default assert_true message.");
+void assert_true(Pred, std::string_view = "Default assert_true message.");
 
 /**
  * Checks that Pred is true.
@@ -29,7 +31,7 @@ void assert_true(Pred, const std::string& = "Default assert_true message.");
  * Must be used in conjunction with the framework.
  */
 template <typename Pred>
-void assert_false(Pred, const std::string& = "Default assert_false message.");
+void assert_false(Pred, std::string_view = "Default assert_false message.");
 
 /**
  * Checks that Obj1 and Obj2 are equal.
@@ -37,7 +39,7 @@ void assert_false(Pred, const std::string& = "Default assert_false message.");
  * Must be used in conjunction with the framework.
  */
 template <typename Obj1, typename Obj2>
-void assert_eq(Obj1, Obj2, const std::string& = "Default assert_eq message.");
+void assert_eq(Obj1, Obj2, std::string_view = "Default assert_eq message.");
 
 /**
  * Checks that Obj1 and Obj2 are not equal.
@@ -45,7 +47,7 @@ void assert_eq(Obj1, Obj2, const std::string& = "Default assert_eq message.");
  * Must be used in conjunction with the framework.
  */
 template <typename Obj1, typename Obj2>
-void assert_neq(Obj1, Obj2, const std::string& = "Default assert_neq message.");
+void assert_neq(Obj1, Obj2, std::string_view = "Default assert_neq message.");
 
 /**
  * Checks that Obj1 is less than Obj2.
@@ -53,8 +55,7 @@ void assert_neq(Obj1, Obj2, const std::string& = "Default assert_neq message.");
  * Must be used in conjunction with the framework.
  */
 template <typename Obj1, typename Obj2>
-void assert_less(Obj1, Obj2,
-                 const std::string& = "Default assert_less message.");
+void assert_less(Obj1, Obj2, std::string_view = "Default assert_less message.");
 
 /**
  * Checks that Obj1 is less than or equal to Obj2.
@@ -62,7 +63,7 @@ void assert_less(Obj1, Obj2,
  * Must be used in conjunction with the framework.
  */
 template <typename Obj1, typename Obj2>
-void assert_leq(Obj1, Obj2, const std::string& = "Default assert_leq message.");
+void assert_leq(Obj1, Obj2, std::string_view = "Default assert_leq message.");
 
 /**
  * Checks that Obj1 is greater than Obj2.
@@ -71,7 +72,7 @@ void assert_leq(Obj1, Obj2, const std::string& = "Default assert_leq message.");
  */
 template <typename Obj1, typename Obj2>
 void assert_greater(Obj1, Obj2,
-                    const std::string& = "Default assert_greater message.");
+                    std::string_view = "Default assert_greater message.");
 
 /**
  * Checks that Obj1 is greater than or equal to Obj2.
@@ -79,7 +80,7 @@ void assert_greater(Obj1, Obj2,
  * Must be used in conjunction with the framework.
  */
 template <typename Obj1, typename Obj2>
-void assert_geq(Obj1, Obj2, const std::string& = "Default assert_geq message.");
+void assert_geq(Obj1, Obj2, std::string_view = "Default assert_geq message.");
 
 /**
  * A custom excpetion class used by the framework.
@@ -89,7 +90,7 @@ class test_error : public std::exception {
   const std::string msg;
 
  public:
-  explicit test_error(const std::string&);
+  explicit test_error(std::string_view);
   const char* what() const throw();
 };
 
@@ -99,17 +100,110 @@ class test_error : public std::exception {
  * Stores test functions and their names.
  * Executes tests on command.
  * Allows for querying of results.
- * Runs tests in alphabetic order by name.
+ * Runs tests in alphabetic order by name,
+ * optionally on several threads at once.
+ * Tests live in one flat array, so registering and
+ * running plain function tests does not allocate per test.
  */
 class Framework {
- private:
-  // Match function names to the corresponding unit test.
-  std::map<std::string, std::function<void()>> tests;
+ public:
+  /**
+   * Timing summary of the repetitions of a benchmark.
+   */
+  struct bench_summary {
+    size_t iterations;
+    std::chrono::nanoseconds min;
+    std::chrono::nanoseconds median;
+    std::chrono::nanoseconds p99;
+    double stddev_ns;
+  };
 
-  // If failed, associated test name with error message.
-  std::map<std::string, std::optional<std::string>> results;
+ private:
+  // A registered test and its outcome once run.
+  struct entry {
+    // Position and length of the name in names.
+    size_t name_pos;
+    size_t name_len;
+
+    // Plain function tests skip the std::function.
+    void (*plain)();
+    std::function<void()> func;
+
+    // Whether the test must run alone, and the number
+    // of timed repetitions if it is a benchmark.
+    bool serial;
+    size_t iterations;
+
+    // Whether the test has run, and the exception
+    // keeping its error message alive if it failed.
+    bool ran = false;
+    std::exception_ptr failure;
+    std::string_view error;
+
+    // The runtime of a test, and the summary of a benchmark.
+    std::chrono::nanoseconds runtime{0};
+    std::optional<bench_summary> bench;
+
+    entry(size_t pos, size_t len, void (*plain_in)(),
+          std::function<void()> func_in, bool serial_in, size_t iterations_in)
+        : name_pos(pos),
+          name_len(len),
+          plain(plain_in),
+          func(std::move(func_in)),
+          serial(serial_in),
+          iterations(iterations_in) {}
+  };
+
+  // Every name, back to back.
+  std::string names;
+
+  // Registered tests, in registration order.
+  std::vector<entry> tests;
+
+  // Indices into tests. The first sorted are in alphabetic
+  // order by name, followed by tests registered since the
+  // last lookup. Sorted lazily so registering n tests takes
+  // O(n log n) rather than an insertion each.
+  mutable std::vector<size_t> order;
+  mutable size_t sorted = 0;
+
+  // Number of executed tests that passed and failed.
+  size_t num_passed = 0;
+  size_t num_failed = 0;
+
+  // Returns the name of a test.
+  std::string_view name_of(const entry&) const noexcept;
+
+  // Sorts the tests registered since the last lookup into order.
+  // Of names registered more than once since, the last one wins.
+  void index() const noexcept;
+
+  // Returns the position in order where name is or would be.
+  std::vector<size_t>::const_iterator locate(std::string_view) const noexcept;
+
+  // Returns the index into tests of the given name.
+  // THROWS: if the name is not registered.
+  size_t index_of(std::string_view) const;
+
+  // Registers or overwrites a test.
+  void add(std::string_view, void (*)(), std::function<void()>, bool, size_t);
+
+  // Runs and times a test, then records its outcome.
+  static void execute(entry&);
+
+  // Counts the outcome of a test.
+  void tally(const entry&) noexcept;
+
+  // Warms up and times every repetition of a benchmark.
+  static bench_summary measure(const entry&);
 
  public:
+  // Test may run alongside other tests.
+  static inline constexpr bool PARALLEL = false;
+
+  // Test is timing sensitive and must run alone.
+  static inline constexpr bool SERIAL = true;
+
   /**
    * Returns the number of tests registered by the framework.
    */
@@ -124,49 +218,82 @@ class Framework {
    * Returns whether or not test name is
    * registered by the framework.
    */
-  bool contains(const std::string&) const noexcept;
+  bool contains(std::string_view) const noexcept;
 
   /**
    * Returns whether or not the test has been
    * executed by the framework.
    */
-  bool executed(const std::string&) const noexcept;
+  bool executed(std::string_view) const noexcept;
 
   /**
    * Associate the function name with the unit test.
+   * Optional argument to mark the test as SERIAL,
+   * so it never runs alongside other tests.
    * Note that this function will overwrite.
    */
-  void emplace(const std::string&, const std::function<void()>&);
+  void emplace(std::string_view, void (*)(), bool policy = PARALLEL);
+
+  /**
+   * Same as above, for any callable test.
+   */
+  template <typename Func>
+  void emplace(std::string_view, Func&&, bool policy = PARALLEL);
+
+  /**
+   * Associate the function name with a benchmark. When run, it
+   * is called for a warmup phase, then timed over the given
+   * number of iterations. Benchmarks always run alone.
+   * THROWS: if iterations is zero.
+   */
+  void emplace_bench(std::string_view, std::function<void()>,
+                     size_t iterations);
 
   /**
    * Execute the given function and record its result.
    * Does not execute if the test has already been run.
    */
-  void run(const std::string&);
+  void run(std::string_view);
 
   /**
    * Executes all tests registered by the framework.
-   * Skips tests that have already been run.
+   * Skips tests that have already been run. With more than
+   * one thread, PARALLEL tests run on a pool of that many
+   * threads, then SERIAL tests run one at a time.
    */
-  void run_all();
+  void run_all(unsigned threads = 1);
 
   /**
    * Returns the result associated with this name.
    * THROWS: if the test has not been run.
    */
-  bool passed(const std::string&) const;
+  bool passed(std::string_view) const;
 
   /**
    * Returns the result associated with this name.
    * THROWS: if the test has not been run.
    */
-  bool failed(const std::string&) const;
+  bool failed(std::string_view) const;
 
   /**
    * Returns the error message associated with this name.
+   * Valid until the test is overwritten.
    * THROWS: if the test has not been run or it passed.
    */
-  std::string error_msg(const std::string&) const;
+  std::string_view error_msg(std::string_view) const;
+
+  /**
+   * Returns how long the test took to run.
+   * THROWS: if the test has not been run.
+   */
+  std::chrono::nanoseconds runtime(std::string_view) const;
+
+  /**
+   * Returns the timing summary of the benchmark.
+   * THROWS: if the benchmark has not been run,
+   * or it failed, or the name is not a benchmark.
+   */
+  const bench_summary& summary(std::string_view) const;
 
   /**
    * Returns the number of tests that passed.
@@ -183,7 +310,7 @@ class Framework {
   /**
    * Formats the result of the given test to the ostream.
    */
-  void result(const std::string&, std::ostream&) const;
+  void result(std::string_view, std::ostream&) const;
 
   /**
    * Formats the result of all tests to the ostream.
@@ -193,42 +320,49 @@ class Framework {
 
 /* --- TEMPLATE FUNCTION IMPLEMENTATIONS --- */
 
+template <typename Func>
+inline void Framework::emplace(std::string_view name, Func&& func,
+                               bool policy) {
+  add(name, nullptr, std::function<void()>(std::forward<Func>(func)), policy,
+      0);
+}
+
 template <typename Pred>
-inline void assert_true(Pred p, const std::string& msg) {
+inline void assert_true(Pred p, std::string_view msg) {
   if (!p) throw test_error(msg);
 }
 
 template <typename Pred>
-inline void assert_false(Pred p, const std::string& msg) {
+inline void assert_false(Pred p, std::string_view msg) {
   if (p) throw test_error(msg);
 }
 
 template <typename Obj1, typename Obj2>
-inline void assert_eq(Obj1 X, Obj2 Y, const std::string& msg) {
+inline void assert_eq(Obj1 X, Obj2 Y, std::string_view msg) {
   if (!(X == Y)) throw test_error(msg);
 }
 
 template <typename Obj1, typename Obj2>
-inline void assert_neq(Obj1 X, Obj2 Y, const std::string& msg) {
+inline void assert_neq(Obj1 X, Obj2 Y, std::string_view msg) {
   if (!(X != Y)) throw test_error(msg);
 }
 
 template <typename Obj1, typename Obj2>
-inline void assert_less(Obj1 X, Obj2 Y, const std::string& msg) {
+inline void assert_less(Obj1 X, Obj2 Y, std::string_view msg) {
   if (!(X < Y)) throw test_error(msg);
 }
 
 template <typename Obj1, typename Obj2>
-inline void assert_leq(Obj1 X, Obj2 Y, const std::string& msg) {
+inline void assert_leq(Obj1 X, Obj2 Y, std::string_view msg) {
   if (!(X <= Y)) throw test_error(msg);
 }
 
 template <typename Obj1, typename Obj2>
-inline void assert_greater(Obj1 X, Obj2 Y, const std::string& msg) {
+inline void assert_greater(Obj1 X, Obj2 Y, std::string_view msg) {
   if (!(X > Y)) throw test_error(msg);
 }
 
 template <typename Obj1, typename Obj2>
-inline void assert_geq(Obj1 X, Obj2 Y, const std::string& msg) {
+inline void assert_geq(Obj1 X, Obj2 Y, std::string_view msg) {
   if (!(X >= Y)) throw test_error(msg);
 }
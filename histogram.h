@@ -0,0 +1,315 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of log bucketed duration histogram.
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/**
+ * A histogram of durations in the given unit with
+ * logarithmic buckets in the style of HdrHistogram.
+ * Every recorded duration is kept to the configured
+ * number of significant decimal digits, so the size
+ * only grows with the logarithm of the largest
+ * duration and percentile queries are linear in
+ * the number of buckets. Negative durations are
+ * recorded as zero.
+ */
+template <typename Duration = std::chrono::milliseconds>
+class Histogram {
+  static_assert(std::is_integral_v<typename Duration::rep>,
+                "Histogram requires an integer duration.");
+
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // Number of significant decimal digits.
+  int digits;
+
+  // Log base 2 of half the number of sub buckets per bucket.
+  unsigned half_magnitude;
+
+  // Half the number of sub buckets per bucket.
+  uint64_t sub_half;
+
+  // Mask for values that fall into the first bucket.
+  uint64_t sub_mask;
+
+  // Number of durations per sub bucket. Grows on demand.
+  std::vector<uint64_t> counts;
+
+  // Number of added durations.
+  uint64_t num = 0;
+
+  // Smallest and largest added durations.
+  typename Duration::rep low = 0;
+  typename Duration::rep high = 0;
+
+  // Exact sum of added durations.
+  double sum = 0.0;
+
+  // Returns the counts index of the value.
+  size_t index_of(uint64_t value) const noexcept;
+
+  // Returns the smallest value that maps to the index.
+  uint64_t lowest_at(size_t index) const noexcept;
+
+  // Returns the largest value that maps to the index.
+  uint64_t highest_at(size_t index) const noexcept;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Basic constructor. Optional argument to specify
+   * the number of significant digits between 1 and 5.
+   * THROWS: if digits is out of range.
+   */
+  explicit Histogram(int digits_in = 2);
+
+  /**
+   * Adds every duration in the range.
+   * Accepts Stopwatch iterators.
+   */
+  template <typename Iter>
+  Histogram(Iter first, Iter last, int digits_in = 2);
+
+  /**
+   * Adds the duration the given number of times.
+   */
+  void add(typename Duration::rep dur, uint64_t times = 1);
+
+  /**
+   * Returns whether or not there are added durations.
+   */
+  bool empty() const noexcept;
+
+  /**
+   * Returns the number of added durations.
+   */
+  uint64_t count() const noexcept;
+
+  /**
+   * Returns the number of significant digits.
+   */
+  int significant_digits() const noexcept;
+
+  /**
+   * Returns the smallest added duration.
+   * THROWS: if there are no added durations.
+   */
+  typename Duration::rep min() const;
+
+  /**
+   * Returns the largest added duration.
+   * THROWS: if there are no added durations.
+   */
+  typename Duration::rep max() const;
+
+  /**
+   * Returns the mean of the added durations.
+   * THROWS: if there are no added durations.
+   */
+  double mean() const;
+
+  /**
+   * Returns the duration at the given percentile in
+   * [0, 100], accurate to the significant digits.
+   * THROWS: if there are no added durations.
+   */
+  typename Duration::rep percentile(double pct) const;
+
+  /**
+   * Returns the number of bytes used by the buckets.
+   */
+  size_t footprint() const noexcept;
+
+  /**
+   * Delete all added durations.
+   */
+  void clear() noexcept;
+
+  /**
+   * Merges the durations of other into this.
+   */
+  Histogram& operator+=(const Histogram&);
+
+  /**
+   * Returns a new histogram with both sets of durations.
+   */
+  Histogram operator+(const Histogram&) const;
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration>
+Histogram<Duration>::Histogram(int digits_in) : digits(digits_in) {
+  if (digits < 1 || digits > 5) {
+    throw std::invalid_argument("Significant digits must be in [1, 5].");
+  }
+  // Enough sub buckets to distinguish 2 * 10^digits values.
+  uint64_t needed = 2;
+  for (int i = 0; i < digits; ++i) needed *= 10;
+  unsigned magnitude = 0;
+  while ((uint64_t(1) << magnitude) < needed) ++magnitude;
+  half_magnitude = magnitude - 1;
+  sub_half = uint64_t(1) << half_magnitude;
+  sub_mask = (sub_half << 1) - 1;
+  counts.resize(sub_half << 1);
+}
+
+template <typename Duration>
+template <typename Iter>
+inline Histogram<Duration>::Histogram(Iter first, Iter last, int digits_in)
+    : Histogram(digits_in) {
+  for (; first != last; ++first) add(*first);
+}
+
+template <typename Duration>
+inline size_t Histogram<Duration>::index_of(uint64_t value) const noexcept {
+  // Position of the highest set bit, minus the first bucket's width.
+  const auto top = 63 - __builtin_clzll(value | sub_mask);
+  const auto bucket =
+      static_cast<unsigned>(top - static_cast<int>(half_magnitude));
+  const auto sub = value >> bucket;
+  return static_cast<size_t>(((uint64_t(bucket) + 1) << half_magnitude) +
+                             (sub - sub_half));
+}
+
+template <typename Duration>
+inline uint64_t Histogram<Duration>::lowest_at(size_t index) const noexcept {
+  const auto major = static_cast<uint64_t>(index) >> half_magnitude;
+  const auto minor = static_cast<uint64_t>(index) & (sub_half - 1);
+  // The first two halves share bucket 0.
+  if (major == 0) return minor;
+  return (minor + sub_half) << (major - 1);
+}
+
+template <typename Duration>
+inline uint64_t Histogram<Duration>::highest_at(size_t index) const noexcept {
+  const auto major = static_cast<uint64_t>(index) >> half_magnitude;
+  const auto width = major == 0 ? 1 : uint64_t(1) << (major - 1);
+  return lowest_at(index) + width - 1;
+}
+
+template <typename Duration>
+inline void Histogram<Duration>::add(typename Duration::rep dur,
+                                     uint64_t times) {
+  if (times == 0) return;
+  if (dur < 0) dur = 0;
+  const auto idx = index_of(static_cast<uint64_t>(dur));
+  if (idx >= counts.size()) counts.resize(idx + 1);
+  counts[idx] += times;
+  if (num == 0) {
+    low = high = dur;
+  } else {
+    low = std::min(low, dur);
+    high = std::max(high, dur);
+  }
+  num += times;
+  sum += static_cast<double>(dur) * static_cast<double>(times);
+}
+
+template <typename Duration>
+inline bool Histogram<Duration>::empty() const noexcept {
+  return num == 0;
+}
+
+template <typename Duration>
+inline uint64_t Histogram<Duration>::count() const noexcept {
+  return num;
+}
+
+template <typename Duration>
+inline int Histogram<Duration>::significant_digits() const noexcept {
+  return digits;
+}
+
+template <typename Duration>
+inline typename Duration::rep Histogram<Duration>::min() const {
+  if (empty()) throw std::out_of_range("No durations have been added.");
+  return low;
+}
+
+template <typename Duration>
+inline typename Duration::rep Histogram<Duration>::max() const {
+  if (empty()) throw std::out_of_range("No durations have been added.");
+  return high;
+}
+
+template <typename Duration>
+inline double Histogram<Duration>::mean() const {
+  if (empty()) throw std::out_of_range("No durations have been added.");
+  return sum / static_cast<double>(num);
+}
+
+template <typename Duration>
+typename Duration::rep Histogram<Duration>::percentile(double pct) const {
+  if (empty()) throw std::out_of_range("No durations have been added.");
+  pct = std::min(std::max(pct, 0.0), 100.0);
+  const auto rank = std::ceil(pct / 100.0 * static_cast<double>(num));
+  const auto target = std::max(static_cast<uint64_t>(rank), uint64_t(1));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    seen += counts[i];
+    if (seen >= target) {
+      const auto val = static_cast<typename Duration::rep>(highest_at(i));
+      return std::max(std::min(val, high), low);
+    }
+  }
+  return high;
+}
+
+template <typename Duration>
+inline size_t Histogram<Duration>::footprint() const noexcept {
+  return counts.size() * sizeof(uint64_t);
+}
+
+template <typename Duration>
+inline void Histogram<Duration>::clear() noexcept {
+  std::fill(counts.begin(), counts.end(), 0);
+  num = 0;
+  low = high = 0;
+  sum = 0.0;
+}
+
+template <typename Duration>
+Histogram<Duration>& Histogram<Duration>::operator+=(
+    const Histogram<Duration>& other) {
+  if (other.empty()) return *this;
+  if (other.digits == digits) {
+    if (other.counts.size() > counts.size()) {
+      counts.resize(other.counts.size());
+    }
+    std::transform(other.counts.begin(), other.counts.end(), counts.begin(),
+                   counts.begin(), std::plus<uint64_t>());
+  } else {
+    // Re-bucket at this precision from each bucket's lowest value.
+    for (size_t i = 0; i < other.counts.size(); ++i) {
+      if (other.counts[i] == 0) continue;
+      const auto idx = index_of(other.lowest_at(i));
+      if (idx >= counts.size()) counts.resize(idx + 1);
+      counts[idx] += other.counts[i];
+    }
+  }
+  low = empty() ? other.low : std::min(low, other.low);
+  high = empty() ? other.high : std::max(high, other.high);
+  num += other.num;
+  sum += other.sum;
+  return *this;
+}
+
+template <typename Duration>
+inline Histogram<Duration> Histogram<Duration>::operator+(
+    const Histogram<Duration>& other) const {
+  auto temp(*this);
+  return temp += other;
+}
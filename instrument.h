@@ -0,0 +1,318 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Instrumentation macros and a global registry of named stopwatches.
+*/
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "concurrent_stopwatch.h"
+#include "histogram.h"
+#include "stopwatch.h"
+
+/**
+ * A ConcurrentStopwatch with a name and a runtime enable
+ * flag, kept by a stopwatch_registry. The flag sits on a
+ * cache line that is only written when the flag changes.
+ * Memory is bounded by what was recorded: each thread that
+ * records gets one buffer, which outlives the thread so its
+ * time points stay in snapshots, and holds 8 bytes per time
+ * point plus a 512 byte chunk table. Each such thread also
+ * caches one 32 byte entry per name it has recorded.
+ */
+class named_stopwatch {
+ private:
+  // Assumed size of a cache line.
+  static constexpr size_t CACHE_LINE = 64;
+
+  // Read by every site, and kept apart from written data.
+  alignas(CACHE_LINE) std::atomic<bool> on{true};
+
+  const std::string label;
+
+  alignas(CACHE_LINE) ConcurrentStopwatch<std::chrono::nanoseconds> watch;
+
+ public:
+  /**
+   * Creates an enabled stopwatch. Use stopwatch_registry::get instead.
+   */
+  explicit named_stopwatch(std::string_view name);
+
+  named_stopwatch(const named_stopwatch&) = delete;
+  named_stopwatch& operator=(const named_stopwatch&) = delete;
+
+  /**
+   * Returns whether or not record does anything.
+   */
+  bool enabled() const noexcept;
+
+  /**
+   * Turns recording on or off.
+   */
+  void enable(bool on_in) noexcept;
+
+  /**
+   * Records the current time measurement
+   * into the calling thread's buffer, if enabled.
+   */
+  void record();
+
+  /**
+   * Returns a histogram of the splits each thread has
+   * published so far. Safe while other threads record.
+   */
+  Histogram<std::chrono::nanoseconds> splits() const;
+
+  /**
+   * Deletes all recorded time points, keeping the buffers.
+   * REQUIRES: no concurrent calls to record.
+   */
+  void clear();
+
+  /**
+   * Returns the underlying stopwatch, to merge or export.
+   */
+  const ConcurrentStopwatch<std::chrono::nanoseconds>& stopwatch()
+      const noexcept;
+
+  /**
+   * Returns the name of the stopwatch.
+   */
+  const std::string& name() const noexcept;
+};
+
+/**
+ * The splits of a named stopwatch when it was summarized.
+ */
+struct stopwatch_summary {
+  std::string name;
+  bool enabled;
+  Histogram<std::chrono::nanoseconds> splits;
+};
+
+/**
+ * A registry of stopwatches by name. Stopwatches are never
+ * removed, so references to them last as long as the registry.
+ */
+class stopwatch_registry {
+ private:
+  // Guards stopwatches.
+  mutable std::mutex lock;
+  std::deque<named_stopwatch> stopwatches;
+
+ public:
+  /**
+   * Returns the registry used by STOPWATCH_NAMED.
+   */
+  static stopwatch_registry& global();
+
+  /**
+   * Returns the stopwatch with the given name,
+   * creating it if there is none.
+   */
+  named_stopwatch& get(std::string_view name);
+
+  /**
+   * Turns every stopwatch whose name starts with prefix on
+   * or off, such as "db/" for one component.
+   */
+  void enable(std::string_view prefix, bool on);
+
+  /**
+   * Returns a summary of every stopwatch, in order of
+   * creation, without stopping recording.
+   */
+  std::vector<stopwatch_summary> snapshot() const;
+
+  /**
+   * Writes a summary of every stopwatch as a JSON array.
+   */
+  void write_json(std::ostream& os) const;
+};
+
+/**
+ * The guard of a scope that is compiled out.
+ */
+struct stopwatch_scope_off {};
+
+/**
+ * Returns locate().scope(id) when On, or an empty guard
+ * without calling locate otherwise.
+ */
+template <bool On, typename Locate>
+auto stopwatch_scope(Locate locate, section_id id);
+
+/**
+ * Calls locate().record() when On, and compiles to
+ * nothing without calling locate otherwise.
+ */
+template <bool On, typename Locate>
+void stopwatch_record(Locate locate);
+
+#define STOPWATCH_CONCAT_IMPL(a, b) a##b
+#define STOPWATCH_CONCAT(a, b) STOPWATCH_CONCAT_IMPL(a, b)
+
+// Gives the stopwatch of the global registry with the given name.
+// It is found once, on first use. Every later use still tests the
+// static's guard, so a named site costs that branch plus the test
+// of the enable flag.
+// REQUIRES: name is a string literal.
+#define STOPWATCH_NAMED(name)                                     \
+  ([]() -> named_stopwatch& {                                     \
+    static auto& named = stopwatch_registry::global().get(name); \
+    return named;                                                 \
+  }())
+
+// Times the rest of the enclosing block with sw.scope(id). The
+// stopwatch expression is only evaluated if the site is compiled in.
+// REQUIRES: level is a constant.
+#define STOPWATCH_SCOPE(level, sw, id)                                  \
+  [[maybe_unused]] const auto STOPWATCH_CONCAT(stopwatch_scope_,        \
+                                               __COUNTER__) =           \
+      stopwatch_scope<((level) <= STOPWATCH_LEVEL)>(                    \
+          [&]() -> auto& { return (sw); }, id)
+
+// Calls sw.record(), where sw is a Stopwatch, a ConcurrentStopwatch,
+// or STOPWATCH_NAMED. The stopwatch expression is only evaluated if
+// the site is compiled in, so compiled out names never register.
+// REQUIRES: level is a constant.
+#define STOPWATCH_RECORD(level, sw)                  \
+  stopwatch_record<((level) <= STOPWATCH_LEVEL)>( \
+      [&]() -> auto& { return (sw); })
+
+/* --- IMPLEMENTATION --- */
+
+inline named_stopwatch::named_stopwatch(std::string_view name)
+    : label(name) {}
+
+inline bool named_stopwatch::enabled() const noexcept {
+  return on.load(std::memory_order_relaxed);
+}
+
+inline void named_stopwatch::enable(bool on_in) noexcept {
+  on.store(on_in, std::memory_order_relaxed);
+}
+
+inline void named_stopwatch::record() {
+  if (enabled()) watch.record();
+}
+
+inline Histogram<std::chrono::nanoseconds> named_stopwatch::splits() const {
+  Histogram<std::chrono::nanoseconds> hist;
+  watch.for_each_published([&hist](size_t, auto first, auto last) {
+    if (first == last) return;
+    for (auto prev = *first; ++first != last;) {
+      const auto point = *first;
+      hist.add(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(point - prev)
+              .count());
+      prev = point;
+    }
+  });
+  return hist;
+}
+
+inline void named_stopwatch::clear() { watch.clear(); }
+
+inline const ConcurrentStopwatch<std::chrono::nanoseconds>&
+named_stopwatch::stopwatch() const noexcept {
+  return watch;
+}
+
+inline const std::string& named_stopwatch::name() const noexcept {
+  return label;
+}
+
+inline stopwatch_registry& stopwatch_registry::global() {
+  static stopwatch_registry registry;
+  return registry;
+}
+
+inline named_stopwatch& stopwatch_registry::get(std::string_view name) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto& named : stopwatches) {
+    if (named.name() == name) return named;
+  }
+  return stopwatches.emplace_back(name);
+}
+
+inline void stopwatch_registry::enable(std::string_view prefix, bool on) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto& named : stopwatches) {
+    if (named.name().compare(0, prefix.size(), prefix) == 0) {
+      named.enable(on);
+    }
+  }
+}
+
+inline std::vector<stopwatch_summary> stopwatch_registry::snapshot() const {
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<stopwatch_summary> summaries;
+  summaries.reserve(stopwatches.size());
+  for (const auto& named : stopwatches) {
+    summaries.push_back({named.name(), named.enabled(), named.splits()});
+  }
+  return summaries;
+}
+
+inline void stopwatch_registry::write_json(std::ostream& os) const {
+  const auto summaries = snapshot();
+  // Escapes names like chrome_format, replacing control characters.
+  const auto quoted = [&os](std::string_view text) {
+    os << '"';
+    for (const char c : text) {
+      if (c == '"' || c == '\\') {
+        os << '\\' << c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        os << ' ';
+      } else {
+        os << c;
+      }
+    }
+    os << '"';
+  };
+  os << "[\n";
+  for (size_t i = 0; i < summaries.size(); ++i) {
+    const auto& summary = summaries[i];
+    const auto& hist = summary.splits;
+    os << "  {\"name\": ";
+    quoted(summary.name);
+    os << ", \"enabled\": " << (summary.enabled ? "true" : "false")
+       << ", \"count\": " << hist.count();
+    if (!hist.empty()) {
+      os << ", \"min_ns\": " << hist.min() << ", \"mean_ns\": " << hist.mean()
+         << ", \"p50_ns\": " << hist.percentile(50)
+         << ", \"p99_ns\": " << hist.percentile(99)
+         << ", \"max_ns\": " << hist.max();
+    }
+    os << '}' << (i + 1 < summaries.size() ? ",\n" : "\n");
+  }
+  os << "]\n";
+}
+
+template <bool On, typename Locate>
+inline auto stopwatch_scope(Locate locate, section_id id) {
+  if constexpr (On) {
+    return locate().scope(id);
+  } else {
+    static_cast<void>(locate);
+    static_cast<void>(id);
+    return stopwatch_scope_off();
+  }
+}
+
+template <bool On, typename Locate>
+inline void stopwatch_record(Locate locate) {
+  if constexpr (On) {
+    locate().record();
+  } else {
+    static_cast<void>(locate);
+  }
+}
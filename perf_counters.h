@@ -0,0 +1,414 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of hardware counter sampling.
+*/
+#pragma once
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "stopwatch.h"
+
+/**
+ * Hardware counters that can be sampled at each record.
+ */
+enum class counter : uint8_t {
+  cycles,
+  instructions,
+  llc_misses,
+  branch_misses
+};
+
+/**
+ * A group of hardware counters for the calling thread,
+ * opened through perf_event_open. Counts user space only.
+ * Reads with rdpmc from the mapped counter page where the
+ * kernel permits it, and with read(2) otherwise. If the
+ * kernel refuses the group, every counter reads as zero.
+ */
+class perf_group {
+ private:
+  // One counter of the group.
+  struct event {
+    int fd = -1;
+#if defined(__linux__)
+    perf_event_mmap_page* page = nullptr;
+#endif
+  };
+
+  std::vector<event> events;
+
+  // Whether or not every counter was opened.
+  bool opened = false;
+
+  // Reads one counter.
+  static uint64_t read(const event&) noexcept;
+
+ public:
+  /**
+   * Opens and starts the n given counters for the calling thread.
+   */
+  perf_group(const counter* which, size_t n);
+
+  perf_group(const perf_group&) = delete;
+  perf_group& operator=(const perf_group&) = delete;
+
+  /**
+   * Stops and closes the counters.
+   */
+  ~perf_group();
+
+  /**
+   * Returns whether or not the kernel opened the counters.
+   */
+  bool available() const noexcept { return opened; }
+
+  /**
+   * Writes the current value of every counter to out.
+   * Writes zeros if the counters are unavailable.
+   */
+  void read(uint64_t* out) const noexcept;
+};
+
+/**
+ * Returns Events, or cycles, instructions, LLC misses,
+ * and branch misses if no Events are given.
+ */
+template <counter... Events>
+constexpr auto sampled_counters() noexcept {
+  if constexpr (sizeof...(Events) == 0) {
+    return std::array<counter, 4>{counter::cycles, counter::instructions,
+                                  counter::llc_misses, counter::branch_misses};
+  } else {
+    return std::array<counter, sizeof...(Events)>{Events...};
+  }
+}
+
+/**
+ * Stores time points contiguously, and samples the
+ * hardware counters Events right after each is recorded.
+ * Samples the sampled_counters defaults if no Events are
+ * given. Copies share the group.
+ * Counters only count the thread that built the buffer.
+ * Cannot be interleaved, since counters from different
+ * groups cannot be merged meaningfully: see is_interleavable.
+ */
+template <typename TimePoint, counter... Events>
+class perf_buffer {
+ public:
+  // The sampled counters, in storage order.
+  static constexpr auto events = sampled_counters<Events...>();
+
+  // Number of sampled counters per time point.
+  static constexpr size_t COUNTERS = events.size();
+
+ private:
+  // Recorded time points.
+  std::vector<TimePoint> points;
+
+  // COUNTERS counter values per time point.
+  std::vector<uint64_t> values;
+
+  // The open counters, shared between copies.
+  std::shared_ptr<perf_group> group;
+
+ public:
+  using value_type = TimePoint;
+  using size_type = size_t;
+  using const_iterator = typename std::vector<TimePoint>::const_iterator;
+  using iterator = const_iterator;
+
+  /**
+   * Opens the counters for the calling thread.
+   */
+  perf_buffer();
+
+  /**
+   * Reserves room for res time points and their counters.
+   */
+  void reserve(size_t res);
+
+  /**
+   * Appends the time point, then samples the counters.
+   */
+  void emplace_back(const TimePoint& point);
+
+  size_t size() const noexcept { return points.size(); }
+  bool empty() const noexcept { return points.empty(); }
+
+  /**
+   * Returns the number of time points that fit, with their
+   * counters, without allocating.
+   */
+  size_t capacity() const noexcept {
+    return std::min(points.capacity(), values.capacity() / COUNTERS);
+  }
+  const TimePoint* data() const noexcept { return points.data(); }
+
+  /**
+   * Delete all time points and their counters.
+   */
+  void clear() noexcept;
+
+  /**
+   * Stably sorts the time points, moving each one's
+   * counter values with it.
+   */
+  void sort();
+
+  const TimePoint& operator[](size_t index) const noexcept {
+    return points[index];
+  }
+  const TimePoint& at(size_t index) const { return points.at(index); }
+  const TimePoint& front() const noexcept { return points.front(); }
+  const TimePoint& back() const noexcept { return points.back(); }
+
+  const_iterator begin() const noexcept { return points.begin(); }
+  const_iterator end() const noexcept { return points.end(); }
+
+  /**
+   * Swaps contents and counters with other.
+   */
+  void swap(perf_buffer& other) noexcept;
+
+  /**
+   * Returns whether or not the kernel opened the counters.
+   */
+  bool available() const noexcept { return group->available(); }
+
+  /**
+   * Returns the value of counter which sampled with
+   * the time point at index.
+   * THROWS: if the counter is not sampled.
+   */
+  uint64_t count(size_t index, counter which) const;
+};
+
+// Counters from different groups cannot be merged meaningfully.
+template <typename TimePoint, counter... Events>
+struct is_interleavable<perf_buffer<TimePoint, Events...>> : std::false_type {
+};
+
+/**
+ * A stopwatch that samples hardware counters at every record.
+ * Use iterator::counter_delta, ipc, and miss_rate for split-wise deltas.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock, counter... Events>
+using PerfStopwatch =
+    Stopwatch<Duration, Clock,
+              perf_buffer<typename Clock::time_point, Events...>>;
+
+/**
+ * Returns the instructions per cycle over the split pointed to by iter.
+ * Zero if no cycles were counted.
+ * THROWS: if cycles or instructions are not sampled.
+ */
+template <typename Iter>
+double ipc(const Iter& iter);
+
+/**
+ * Returns the LLC misses per thousand instructions over
+ * the split pointed to by iter. Zero if no instructions were counted.
+ * THROWS: if LLC misses or instructions are not sampled.
+ */
+template <typename Iter>
+double miss_rate(const Iter& iter);
+
+/* --- IMPLEMENTATION --- */
+
+inline perf_group::perf_group(const counter* which, size_t n) : events(n) {
+#if defined(__linux__)
+  int leader = -1;
+  opened = true;
+  for (size_t i = 0; i < n && opened; ++i) {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    switch (which[i]) {
+      case counter::cycles:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+      case counter::instructions:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+      case counter::llc_misses:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+      case counter::branch_misses:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+    // The group starts together once every counter is open.
+    if (leader < 0) attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    const auto fd = static_cast<int>(
+        ::syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+    if (fd < 0) {
+      opened = false;
+      break;
+    }
+    events[i].fd = fd;
+    if (leader < 0) leader = fd;
+    const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    void* page = ::mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (page != MAP_FAILED) {
+      events[i].page = static_cast<perf_event_mmap_page*>(page);
+    }
+  }
+  if (opened) {
+    ::ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ::ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#else
+  static_cast<void>(which);
+#endif
+}
+
+inline perf_group::~perf_group() {
+#if defined(__linux__)
+  const auto page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  for (const auto& ev : events) {
+    if (ev.page) ::munmap(ev.page, page_size);
+    if (ev.fd >= 0) ::close(ev.fd);
+  }
+#endif
+}
+
+inline uint64_t perf_group::read(const event& ev) noexcept {
+#if defined(__linux__)
+#if defined(__x86_64__) || defined(__i386__)
+  if (ev.page) {
+    // The kernel bumps lock around updates to the page.
+    const volatile perf_event_mmap_page* page = ev.page;
+    uint32_t seq;
+    uint64_t value;
+    bool direct;
+    do {
+      seq = page->lock;
+      __asm__ __volatile__("" ::: "memory");
+      const auto idx = page->index;
+      direct = page->cap_user_rdpmc && idx != 0;
+      value = static_cast<uint64_t>(page->offset);
+      if (direct) {
+        const auto shift = 64 - page->pmc_width;
+        auto raw = static_cast<int64_t>(__rdpmc(static_cast<int>(idx - 1)));
+        raw = static_cast<int64_t>(static_cast<uint64_t>(raw) << shift);
+        value += static_cast<uint64_t>(raw >> shift);
+      }
+      __asm__ __volatile__("" ::: "memory");
+    } while (page->lock != seq);
+    if (direct) return value;
+  }
+#endif
+  uint64_t value = 0;
+  if (::read(ev.fd, &value, sizeof(value)) != sizeof(value)) return 0;
+  return value;
+#else
+  static_cast<void>(ev);
+  return 0;
+#endif
+}
+
+inline void perf_group::read(uint64_t* out) const noexcept {
+  for (size_t i = 0; i < events.size(); ++i) {
+    out[i] = opened ? read(events[i]) : 0;
+  }
+}
+
+template <typename TimePoint, counter... Events>
+inline perf_buffer<TimePoint, Events...>::perf_buffer()
+    : group(std::make_shared<perf_group>(events.data(), COUNTERS)) {}
+
+template <typename TimePoint, counter... Events>
+inline void perf_buffer<TimePoint, Events...>::reserve(size_t res) {
+  points.reserve(res);
+  values.reserve(res * COUNTERS);
+}
+
+template <typename TimePoint, counter... Events>
+inline void perf_buffer<TimePoint, Events...>::emplace_back(
+    const TimePoint& point) {
+  points.push_back(point);
+  values.resize(values.size() + COUNTERS);
+  group->read(values.data() + values.size() - COUNTERS);
+}
+
+template <typename TimePoint, counter... Events>
+inline void perf_buffer<TimePoint, Events...>::clear() noexcept {
+  points.clear();
+  values.clear();
+}
+
+template <typename TimePoint, counter... Events>
+void perf_buffer<TimePoint, Events...>::sort() {
+  std::vector<size_t> order(points.size());
+  std::iota(order.begin(), order.end(), size_t(0));
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    return points[a] < points[b];
+  });
+  std::vector<TimePoint> sorted_points;
+  std::vector<uint64_t> sorted_values;
+  sorted_points.reserve(points.capacity());
+  sorted_values.reserve(values.capacity());
+  for (const auto index : order) {
+    sorted_points.push_back(points[index]);
+    const auto first =
+        values.begin() + static_cast<ptrdiff_t>(index * COUNTERS);
+    sorted_values.insert(sorted_values.end(), first, first + COUNTERS);
+  }
+  points.swap(sorted_points);
+  values.swap(sorted_values);
+}
+
+template <typename TimePoint, counter... Events>
+inline void perf_buffer<TimePoint, Events...>::swap(
+    perf_buffer& other) noexcept {
+  points.swap(other.points);
+  values.swap(other.values);
+  group.swap(other.group);
+}
+
+template <typename TimePoint, counter... Events>
+uint64_t perf_buffer<TimePoint, Events...>::count(size_t index,
+                                                  counter which) const {
+  for (size_t slot = 0; slot < COUNTERS; ++slot) {
+    if (events[slot] == which) return values.at(index * COUNTERS + slot);
+  }
+  throw std::invalid_argument("Counter is not sampled.");
+}
+
+template <typename Iter>
+double ipc(const Iter& iter) {
+  const auto cycles = iter.counter_delta(counter::cycles);
+  if (cycles == 0) return 0;
+  return static_cast<double>(iter.counter_delta(counter::instructions)) /
+         static_cast<double>(cycles);
+}
+
+template <typename Iter>
+double miss_rate(const Iter& iter) {
+  const auto instructions = iter.counter_delta(counter::instructions);
+  if (instructions == 0) return 0;
+  return 1000.0 * static_cast<double>(iter.counter_delta(counter::llc_misses)) /
+         static_cast<double>(instructions);
+}
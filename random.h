@@ -0,0 +1,23 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of a small pseudorandom generator.
+*/
+#pragma once
+#include <cstdint>
+
+/**
+ * Advances a xorshift64* generator and returns the next
+ * draw. Cheap enough for sampling and resampling splits.
+ * REQUIRES: state is not zero.
+ */
+uint64_t xorshift_next(uint64_t& state) noexcept;
+
+/* --- IMPLEMENTATION --- */
+
+inline uint64_t xorshift_next(uint64_t& state) noexcept {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 0x2545F4914F6CDD1Du;
+}
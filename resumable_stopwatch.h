@@ -0,0 +1,267 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of stopwatch for suspendable work.
+*/
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include "stopwatch.h"
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#endif
+
+/**
+ * A stopwatch for one logical request that suspends and
+ * resumes, possibly on other threads, such as a coroutine
+ * waiting on I/O. Time points alternate between resume and
+ * suspend, so time running (on CPU) and time suspended
+ * (off CPU) are reported separately. It belongs to the
+ * request, not to a thread, so it may be used from any
+ * thread the request runs on, but from one at a time.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock>
+class ResumableStopwatch {
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // Resume and suspend time points, in turn.
+  Stopwatch<Duration, Clock> points;
+
+  // The thread of the last resume.
+  std::thread::id last_thread;
+
+  // Number of resumes on another thread than the last.
+  size_t moves = 0;
+
+  // Sums running or suspended ticks, starting at first.
+  typename Clock::duration sum_from(size_t first) const noexcept;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Reserve for the given number of resumes and suspends.
+   */
+  explicit ResumableStopwatch(size_t res = 1);
+
+  /**
+   * Records that the request is running on this thread.
+   * Does nothing if it is already running.
+   */
+  void resume();
+
+  /**
+   * Records that the request stopped running.
+   * Does nothing if it is not running.
+   */
+  void suspend();
+
+  /**
+   * Returns whether or not the request is running.
+   */
+  bool running() const noexcept;
+
+  /**
+   * Returns the number of times the request ran.
+   */
+  size_t slices() const noexcept;
+
+  /**
+   * Returns the number of times the request resumed
+   * on another thread than it last ran on.
+   */
+  size_t migrations() const noexcept;
+
+  /**
+   * Returns the total time running, excluding the
+   * current slice if the request is running.
+   */
+  typename Duration::rep on_cpu() const noexcept;
+
+  /**
+   * Returns the total time suspended between slices.
+   */
+  typename Duration::rep off_cpu() const noexcept;
+
+  /**
+   * Returns the time from the first resume to the last
+   * record, which is on_cpu and off_cpu combined.
+   */
+  typename Duration::rep wall() const noexcept;
+
+  /**
+   * Returns the resume and suspend time points. Even
+   * splits are running slices and odd splits are waits.
+   */
+  const Stopwatch<Duration, Clock>& data() const noexcept;
+
+  /**
+   * Delete all recorded time points.
+   */
+  void clear() noexcept;
+};
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+/**
+ * Wraps an awaiter so that its coroutine's stopwatch is
+ * suspended when it suspends and resumed when it resumes.
+ * Awaiters that do not suspend are not recorded.
+ * REQUIRES: Awaitable is an awaiter, such as std::suspend_always.
+ */
+template <typename Awaitable, typename Timer>
+class timed_awaiter {
+ private:
+  Awaitable inner;
+  Timer* timer;
+
+ public:
+  timed_awaiter(Awaitable&& inner_in, Timer& timer_in)
+      : inner(std::forward<Awaitable>(inner_in)), timer(&timer_in) {}
+
+  bool await_ready() { return inner.await_ready(); }
+
+  template <typename Promise>
+  decltype(auto) await_suspend(std::coroutine_handle<Promise> handle) {
+    // Record first, since another thread may resume at once.
+    timer->suspend();
+    return inner.await_suspend(handle);
+  }
+
+  decltype(auto) await_resume() {
+    timer->resume();
+    return inner.await_resume();
+  }
+};
+
+/**
+ * Returns awaitable wrapped to suspend and resume timer.
+ * Use it to co_await within coroutines without timed_promise.
+ */
+template <typename Awaitable, typename Timer>
+timed_awaiter<Awaitable, Timer> timed(Awaitable&& awaitable, Timer& timer) {
+  return timed_awaiter<Awaitable, Timer>(std::forward<Awaitable>(awaitable),
+                                         timer);
+}
+
+/**
+ * A base for promise types that keeps a ResumableStopwatch
+ * in the coroutine frame. Every co_await in the body is
+ * timed through await_transform. The coroutine starts
+ * suspended, and the stopwatch starts on its first resume
+ * and stops at its final suspend. Read the stopwatch from
+ * the handle with promise().stopwatch() before destroy.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock>
+class timed_promise {
+ private:
+  ResumableStopwatch<Duration, Clock> sw;
+
+ public:
+  /**
+   * Returns the stopwatch of this coroutine.
+   */
+  const ResumableStopwatch<Duration, Clock>& stopwatch() const noexcept {
+    return sw;
+  }
+
+  auto initial_suspend() noexcept { return timed(std::suspend_always{}, sw); }
+
+  auto final_suspend() noexcept {
+    sw.suspend();
+    return std::suspend_always{};
+  }
+
+  template <typename Awaitable>
+  auto await_transform(Awaitable&& awaitable) {
+    return timed(std::forward<Awaitable>(awaitable), sw);
+  }
+};
+
+#endif
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration, typename Clock>
+inline ResumableStopwatch<Duration, Clock>::ResumableStopwatch(size_t res)
+    : points(2 * res) {}
+
+template <typename Duration, typename Clock>
+inline void ResumableStopwatch<Duration, Clock>::resume() {
+  if (running()) return;
+  const auto here = std::this_thread::get_id();
+  if (!points.data().empty() && here != last_thread) ++moves;
+  last_thread = here;
+  points.record();
+}
+
+template <typename Duration, typename Clock>
+inline void ResumableStopwatch<Duration, Clock>::suspend() {
+  if (running()) points.record();
+}
+
+template <typename Duration, typename Clock>
+inline bool ResumableStopwatch<Duration, Clock>::running() const noexcept {
+  return points.data().size() % 2 == 1;
+}
+
+template <typename Duration, typename Clock>
+inline size_t ResumableStopwatch<Duration, Clock>::slices() const noexcept {
+  return (points.data().size() + 1) / 2;
+}
+
+template <typename Duration, typename Clock>
+inline size_t ResumableStopwatch<Duration, Clock>::migrations()
+    const noexcept {
+  return moves;
+}
+
+template <typename Duration, typename Clock>
+typename Clock::duration ResumableStopwatch<Duration, Clock>::sum_from(
+    size_t first) const noexcept {
+  const auto& data = points.data();
+  typename Clock::duration total(0);
+  for (auto i = first; i + 1 < data.size(); i += 2) {
+    total += data[i + 1] - data[i];
+  }
+  return total;
+}
+
+template <typename Duration, typename Clock>
+inline typename Duration::rep ResumableStopwatch<Duration, Clock>::on_cpu()
+    const noexcept {
+  return clock_traits<Clock>::template convert<Duration>(sum_from(0)).count();
+}
+
+template <typename Duration, typename Clock>
+inline typename Duration::rep ResumableStopwatch<Duration, Clock>::off_cpu()
+    const noexcept {
+  return clock_traits<Clock>::template convert<Duration>(sum_from(1)).count();
+}
+
+template <typename Duration, typename Clock>
+inline typename Duration::rep ResumableStopwatch<Duration, Clock>::wall()
+    const noexcept {
+  const auto& data = points.data();
+  if (data.size() < 2) return 0;
+  return clock_traits<Clock>::template convert<Duration>(data.back() -
+                                                         data.front())
+      .count();
+}
+
+template <typename Duration, typename Clock>
+inline const Stopwatch<Duration, Clock>&
+ResumableStopwatch<Duration, Clock>::data() const noexcept {
+  return points;
+}
+
+template <typename Duration, typename Clock>
+inline void ResumableStopwatch<Duration, Clock>::clear() noexcept {
+  points.clear();
+  moves = 0;
+}
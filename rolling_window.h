@@ -0,0 +1,323 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of rolling window summaries.
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "concurrent_stopwatch.h"
+#include "histogram.h"
+#include "stopwatch.h"
+
+/**
+ * Summarizes the splits of the most recent span of time, or
+ * of the most recent number of splits. The span is cut into
+ * buckets, each with its own Sink, kept in a ring. A split
+ * lands in the bucket of its end time, or of its position,
+ * and reusing the oldest bucket clears it, so adding is
+ * constant time. Queries combine the live buckets, so they
+ * cost one Sink merge per bucket. The window slides one
+ * bucket at a time, covering between span minus one bucket
+ * and the full span. By default, the Sink is a Histogram,
+ * for percentiles such as the p99 of the last ten seconds.
+ * Sink requires add(Duration::rep), clear(), and operator+=.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock,
+          typename Sink = Histogram<Duration>>
+class RollingWindow {
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // Splits of one interval, or of one run of positions.
+  struct bucket {
+    int64_t epoch;
+    Sink sink;
+  };
+
+  // Marks a bucket that has never been used.
+  static constexpr int64_t UNUSED = std::numeric_limits<int64_t>::min();
+
+  // Buckets indexed by epoch modulo their number.
+  std::vector<bucket> ring;
+
+  // An empty sink to start summaries from.
+  Sink prototype;
+
+  // Clock ticks or splits per bucket.
+  int64_t width;
+
+  // Whether buckets count splits rather than time.
+  bool by_count;
+
+  // Number of splits ever added.
+  uint64_t total = 0;
+
+  // The last time point passed to record.
+  typename Clock::time_point last;
+  bool started = false;
+
+  // The latest time point drained from a source thread, and
+  // how many time points equal to it were already drained,
+  // so splits of zero length are not skipped.
+  struct mark_type {
+    typename Clock::time_point at = Clock::time_point::min();
+    size_t ties = 0;
+  };
+
+  // Drain mark of each source thread.
+  std::vector<mark_type> marks;
+
+  // Returns the epoch of a split ending at the time point.
+  int64_t epoch_of(typename Clock::time_point at) const noexcept;
+
+  // Adds the split to the bucket of epoch, if that is still live.
+  void add_at(typename Duration::rep split, int64_t epoch);
+
+  // Adds the splits of sorted points that were not drained at mark.
+  template <typename Iter>
+  void drain_points(Iter from, Iter to, mark_type& mark);
+
+  // Combines buckets whose epoch is in (newest - buckets, newest].
+  Sink combine(int64_t newest) const;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Summarizes the splits ending in the last span of time,
+   * cut into the given number of buckets.
+   * THROWS: if buckets is zero or span is shorter than buckets ticks.
+   */
+  RollingWindow(typename Clock::duration span, size_t buckets,
+                Sink sink = Sink());
+
+  /**
+   * Summarizes the last splits splits, cut into the given
+   * number of buckets of splits / buckets splits each.
+   * THROWS: if buckets is zero or splits is less than buckets.
+   */
+  RollingWindow(size_t splits, size_t buckets, Sink sink = Sink());
+
+  /**
+   * Records the current time measurement and
+   * adds the split since the previous one.
+   */
+  void record();
+
+  /**
+   * Adds a split that ended now, or at the given time point.
+   * Splits older than the window are discarded.
+   */
+  void add(typename Duration::rep split);
+  void add(typename Duration::rep split, typename Clock::time_point at);
+
+  /**
+   * Adds the splits of sw that were not drained yet, including
+   * zero length ones after the last drained time point. Works
+   * with ring buffers, as long as it is drained before a whole
+   * buffer is overwritten.
+   * REQUIRES: this drains no other source.
+   */
+  template <typename Storage>
+  void drain(const Stopwatch<Duration, Clock, Storage>& sw);
+
+  /**
+   * Same as drain, for the time points every thread of
+   * the recorder has published, tracking the last drained
+   * time point of each thread. Safe while threads record,
+   * so live dashboards may drain whenever they scrape.
+   * REQUIRES: this drains no other source.
+   */
+  void drain(const ConcurrentStopwatch<Duration, Clock>& sw);
+
+  /**
+   * Returns the summary of splits in the window ending now,
+   * or at the given time point. Windows of splits ignore it.
+   */
+  Sink window() const;
+  Sink window(typename Clock::time_point now) const;
+
+  /**
+   * Returns the number of buckets.
+   */
+  size_t buckets() const noexcept;
+
+  /**
+   * Delete all splits and drained time points.
+   */
+  void clear() noexcept;
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration, typename Clock, typename Sink>
+RollingWindow<Duration, Clock, Sink>::RollingWindow(
+    typename Clock::duration span, size_t buckets_in, Sink sink)
+    : ring(buckets_in, bucket{UNUSED, sink}),
+      prototype(std::move(sink)),
+      width(0),
+      by_count(false) {
+  if (buckets_in == 0) throw std::invalid_argument("Need at least 1 bucket.");
+  width = static_cast<int64_t>(span.count()) / static_cast<int64_t>(buckets_in);
+  if (width <= 0) {
+    throw std::invalid_argument("Buckets must span at least one tick.");
+  }
+}
+
+template <typename Duration, typename Clock, typename Sink>
+RollingWindow<Duration, Clock, Sink>::RollingWindow(size_t splits,
+                                                    size_t buckets_in,
+                                                    Sink sink)
+    : ring(buckets_in, bucket{UNUSED, sink}),
+      prototype(std::move(sink)),
+      width(0),
+      by_count(true) {
+  if (buckets_in == 0) throw std::invalid_argument("Need at least 1 bucket.");
+  if (splits < buckets_in) {
+    throw std::invalid_argument("Buckets must hold at least one split.");
+  }
+  width = static_cast<int64_t>(splits / buckets_in);
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline int64_t RollingWindow<Duration, Clock, Sink>::epoch_of(
+    typename Clock::time_point at) const noexcept {
+  const auto ticks = static_cast<int64_t>(at.time_since_epoch().count());
+  // Floor division, so time points before the epoch bucket correctly.
+  return ticks / width - (ticks % width < 0 ? 1 : 0);
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline void RollingWindow<Duration, Clock, Sink>::add_at(
+    typename Duration::rep split, int64_t epoch) {
+  const auto n = static_cast<int64_t>(ring.size());
+  auto& slot = ring[static_cast<size_t>((epoch % n + n) % n)];
+  if (slot.epoch != epoch) {
+    // The slot already holds a newer bucket, so the split is stale.
+    if (slot.epoch != UNUSED && slot.epoch > epoch) return;
+    slot.sink.clear();
+    slot.epoch = epoch;
+  }
+  slot.sink.add(split);
+  ++total;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline void RollingWindow<Duration, Clock, Sink>::record() {
+  const auto now = Clock::now();
+  if (started) {
+    add(clock_traits<Clock>::template convert<Duration>(now - last).count(),
+        now);
+  }
+  last = now;
+  started = true;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline void RollingWindow<Duration, Clock, Sink>::add(
+    typename Duration::rep split) {
+  if (by_count) {
+    add_at(split, static_cast<int64_t>(total) / width);
+  } else {
+    add_at(split, epoch_of(Clock::now()));
+  }
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline void RollingWindow<Duration, Clock, Sink>::add(
+    typename Duration::rep split, typename Clock::time_point at) {
+  add_at(split,
+         by_count ? static_cast<int64_t>(total) / width : epoch_of(at));
+}
+
+template <typename Duration, typename Clock, typename Sink>
+template <typename Iter>
+void RollingWindow<Duration, Clock, Sink>::drain_points(
+    Iter from, Iter to, mark_type& mark) {
+  // The first split to add is the one ending just after the
+  // time points drained so far, including ones equal to mark.
+  const auto equal = std::equal_range(from, to, mark.at);
+  const auto seen = std::min(
+      static_cast<ptrdiff_t>(mark.ties),
+      static_cast<ptrdiff_t>(std::distance(equal.first, equal.second)));
+  auto iter = std::next(equal.first, seen);
+  if (iter == from && iter != to) ++iter;
+  if (iter == to) return;
+  for (; iter != to; ++iter) {
+    const auto end = *iter;
+    const auto split = end - *std::prev(iter);
+    add(clock_traits<Clock>::template convert<Duration>(split).count(), end);
+  }
+  // Every time point up to the last has been drained.
+  mark.at = *std::prev(to);
+  const auto first_tie = std::lower_bound(from, to, mark.at);
+  mark.ties = static_cast<size_t>(std::distance(first_tie, to));
+}
+
+template <typename Duration, typename Clock, typename Sink>
+template <typename Storage>
+void RollingWindow<Duration, Clock, Sink>::drain(
+    const Stopwatch<Duration, Clock, Storage>& sw) {
+  if (marks.empty()) marks.resize(1);
+  drain_points(sw.data().begin(), sw.data().end(), marks.front());
+}
+
+template <typename Duration, typename Clock, typename Sink>
+void RollingWindow<Duration, Clock, Sink>::drain(
+    const ConcurrentStopwatch<Duration, Clock>& sw) {
+  sw.for_each_published([this](size_t thread, auto from, auto to) {
+    if (marks.size() <= thread) marks.resize(thread + 1);
+    drain_points(from, to, marks[thread]);
+  });
+}
+
+template <typename Duration, typename Clock, typename Sink>
+Sink RollingWindow<Duration, Clock, Sink>::combine(int64_t newest) const {
+  auto summary = prototype;
+  const auto oldest = newest - static_cast<int64_t>(ring.size());
+  for (const auto& slot : ring) {
+    if (slot.epoch != UNUSED && slot.epoch > oldest && slot.epoch <= newest) {
+      summary += slot.sink;
+    }
+  }
+  return summary;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline Sink RollingWindow<Duration, Clock, Sink>::window() const {
+  return by_count ? window(typename Clock::time_point())
+                  : window(Clock::now());
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline Sink RollingWindow<Duration, Clock, Sink>::window(
+    typename Clock::time_point now) const {
+  if (!by_count) return combine(epoch_of(now));
+  if (total == 0) return prototype;
+  return combine(static_cast<int64_t>(total - 1) / width);
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline size_t RollingWindow<Duration, Clock, Sink>::buckets() const noexcept {
+  return ring.size();
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline void RollingWindow<Duration, Clock, Sink>::clear() noexcept {
+  for (auto& slot : ring) {
+    slot.sink.clear();
+    slot.epoch = UNUSED;
+  }
+  total = 0;
+  started = false;
+  marks.clear();
+}
@@ -0,0 +1,328 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of sampling stopwatch.
+*/
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include "random.h"
+#include "stopwatch.h"
+
+/**
+ * Slots returned by samplers for events that are
+ * skipped, or appended after every other sample.
+ */
+inline constexpr size_t SAMPLE_SKIP = std::numeric_limits<size_t>::max();
+inline constexpr size_t SAMPLE_APPEND = SAMPLE_SKIP - 1;
+
+/**
+ * Samples exactly one event in every n, starting with the first.
+ */
+class every_nth {
+ private:
+  uint64_t period;
+  uint64_t countdown = 0;
+
+ public:
+  /**
+   * THROWS: if n is zero.
+   */
+  explicit every_nth(uint64_t n);
+
+  /**
+   * Returns SAMPLE_APPEND or SAMPLE_SKIP for the next event.
+   */
+  size_t admit() noexcept;
+
+  /**
+   * Starts over, sampling the next event.
+   */
+  void reset() noexcept;
+};
+
+/**
+ * Samples each event independently with probability p,
+ * using a xorshift64* generator and an integer threshold.
+ */
+class bernoulli {
+ private:
+  uint64_t seed;
+  uint64_t state;
+  uint64_t threshold;
+  bool always;
+
+ public:
+  /**
+   * THROWS: if p is not in [0, 1].
+   */
+  explicit bernoulli(double p, uint64_t seed = 0x9E3779B97F4A7C15u);
+
+  /**
+   * Returns SAMPLE_APPEND or SAMPLE_SKIP for the next event.
+   */
+  size_t admit() noexcept;
+
+  /**
+   * Starts over from the seed.
+   */
+  void reset() noexcept;
+};
+
+/**
+ * Keeps a uniform sample of at most capacity events out
+ * of all events seen, with reservoir sampling (algorithm R).
+ */
+class reservoir {
+ private:
+  uint64_t seed;
+  uint64_t state;
+  uint64_t seen = 0;
+  size_t slots;
+
+ public:
+  /**
+   * THROWS: if capacity is zero.
+   */
+  explicit reservoir(size_t capacity, uint64_t seed = 0x9E3779B97F4A7C15u);
+
+  /**
+   * Returns SAMPLE_APPEND until capacity events are seen,
+   * then the slot to overwrite with the next event, or
+   * SAMPLE_SKIP.
+   */
+  size_t admit() noexcept;
+
+  /**
+   * Forgets every event seen and starts over from the seed.
+   */
+  void reset() noexcept;
+};
+
+/**
+ * A stopwatch that times only a sample of events. Each
+ * event is a start and stop pair, timed by a scope guard,
+ * and the Sampler decides at start whether the whole pair
+ * is timed. Skipped events never read the clock. Stores the
+ * duration of each sampled event, in Duration. Sampler
+ * requires admit() and reset().
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock,
+          typename Sampler = every_nth>
+class SampledStopwatch {
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // Decides which events are timed.
+  Sampler sampler;
+
+  // Durations of sampled events, in order of entry.
+  std::vector<typename Duration::rep> samples;
+
+  // Number of events started, sampled or not.
+  uint64_t total = 0;
+
+  // Stores the duration of a sampled event in its slot,
+  // which was reserved when the event started. Slots past
+  // the stored samples are dropped, which only happens if
+  // the stopwatch was cleared while the event was open.
+  void store(size_t slot, typename Clock::time_point start) noexcept;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  using const_iterator =
+      typename std::vector<typename Duration::rep>::const_iterator;
+
+  /**
+   * Samples with the given sampler.
+   */
+  explicit SampledStopwatch(Sampler sampler_in);
+
+  /**
+   * An RAII guard that times the enclosing scope as one
+   * event, if the sampler selects it. Guards may nest.
+   * An appended event takes its slot on entry, reading as
+   * zero until it exits, so exit never allocates.
+   */
+  class scope_guard {
+    friend class SampledStopwatch;
+
+   private:
+    SampledStopwatch* sw;
+    size_t slot;
+    typename Clock::time_point start;
+
+    explicit scope_guard(SampledStopwatch&);
+
+   public:
+    scope_guard(const scope_guard&) = delete;
+    scope_guard& operator=(const scope_guard&) = delete;
+
+    // Stores the duration if the event is sampled.
+    ~scope_guard();
+
+    // Returns whether or not this event is sampled.
+    bool sampled() const noexcept { return slot != SAMPLE_SKIP; }
+  };
+
+  /**
+   * Returns a guard that times the enclosing scope if sampled.
+   */
+  [[nodiscard]] scope_guard scope();
+
+  /**
+   * Returns the number of sampled events.
+   */
+  size_t size() const noexcept { return samples.size(); }
+
+  /**
+   * Returns the number of events, sampled or not.
+   */
+  uint64_t events() const noexcept { return total; }
+
+  /**
+   * Returns the number of events represented by each
+   * sample. Multiply sample counts by this to estimate
+   * event counts. Zero if there are no samples.
+   */
+  double ratio() const noexcept;
+
+  /**
+   * Index-checked access into sampled durations.
+   */
+  typename Duration::rep operator[](size_t index) const;
+
+  /**
+   * Iteration over sampled durations. Accepted by
+   * Statistics and Histogram.
+   */
+  const_iterator begin() const noexcept { return samples.begin(); }
+  const_iterator end() const noexcept { return samples.end(); }
+
+  /**
+   * Delete all samples, forget all events, and reset
+   * the sampler.
+   */
+  void clear() noexcept;
+};
+
+/* --- IMPLEMENTATION --- */
+
+inline every_nth::every_nth(uint64_t n) : period(n) {
+  if (n == 0) throw std::invalid_argument("Sampling period must be positive.");
+}
+
+inline size_t every_nth::admit() noexcept {
+  if (countdown != 0) {
+    --countdown;
+    return SAMPLE_SKIP;
+  }
+  countdown = period - 1;
+  return SAMPLE_APPEND;
+}
+
+inline void every_nth::reset() noexcept { countdown = 0; }
+
+inline bernoulli::bernoulli(double p, uint64_t seed_in)
+    : seed(seed_in | 1), state(seed), threshold(0), always(p >= 1) {
+  if (!(p >= 0 && p <= 1)) {
+    throw std::invalid_argument("Sampling probability must be in [0, 1].");
+  }
+  // 2^64, so a draw is below threshold with probability p.
+  constexpr auto RANGE = 18446744073709551616.0;
+  if (!always) {
+    const auto scaled = p * RANGE;
+    threshold = scaled < RANGE ? static_cast<uint64_t>(scaled)
+                               : std::numeric_limits<uint64_t>::max();
+  }
+}
+
+inline size_t bernoulli::admit() noexcept {
+  const auto draw = xorshift_next(state);
+  return always || draw < threshold ? SAMPLE_APPEND : SAMPLE_SKIP;
+}
+
+inline void bernoulli::reset() noexcept { state = seed; }
+
+inline reservoir::reservoir(size_t capacity, uint64_t seed_in)
+    : seed(seed_in | 1), state(seed), slots(capacity) {
+  if (capacity == 0) {
+    throw std::invalid_argument("Reservoir capacity must be positive.");
+  }
+}
+
+inline size_t reservoir::admit() noexcept {
+  ++seen;
+  // Nested events may stop out of order, so fill by appending.
+  if (seen <= slots) return SAMPLE_APPEND;
+  const auto pick = xorshift_next(state) % seen;
+  return pick < slots ? static_cast<size_t>(pick) : SAMPLE_SKIP;
+}
+
+inline void reservoir::reset() noexcept {
+  state = seed;
+  seen = 0;
+}
+
+template <typename Duration, typename Clock, typename Sampler>
+inline SampledStopwatch<Duration, Clock, Sampler>::SampledStopwatch(
+    Sampler sampler_in)
+    : sampler(std::move(sampler_in)) {}
+
+template <typename Duration, typename Clock, typename Sampler>
+inline SampledStopwatch<Duration, Clock, Sampler>::scope_guard::scope_guard(
+    SampledStopwatch& sw_in)
+    : sw(&sw_in), slot(sw_in.sampler.admit()) {
+  if (slot == SAMPLE_APPEND) {
+    sw->samples.push_back(0);
+    slot = sw->samples.size() - 1;
+  }
+  ++sw->total;
+  if (slot != SAMPLE_SKIP) start = Clock::now();
+}
+
+template <typename Duration, typename Clock, typename Sampler>
+inline SampledStopwatch<Duration, Clock, Sampler>::scope_guard::~scope_guard() {
+  if (slot != SAMPLE_SKIP) sw->store(slot, start);
+}
+
+template <typename Duration, typename Clock, typename Sampler>
+inline typename SampledStopwatch<Duration, Clock, Sampler>::scope_guard
+SampledStopwatch<Duration, Clock, Sampler>::scope() {
+  return scope_guard(*this);
+}
+
+template <typename Duration, typename Clock, typename Sampler>
+void SampledStopwatch<Duration, Clock, Sampler>::store(
+    size_t slot, typename Clock::time_point start) noexcept {
+  const auto dur = clock_traits<Clock>::template convert<Duration>(
+                       Clock::now() - start)
+                       .count();
+  if (slot < samples.size()) samples[slot] = dur;
+}
+
+template <typename Duration, typename Clock, typename Sampler>
+inline double SampledStopwatch<Duration, Clock, Sampler>::ratio()
+    const noexcept {
+  if (samples.empty()) return 0;
+  return static_cast<double>(total) / static_cast<double>(samples.size());
+}
+
+template <typename Duration, typename Clock, typename Sampler>
+inline typename Duration::rep
+SampledStopwatch<Duration, Clock, Sampler>::operator[](size_t index) const {
+  return samples.at(index);
+}
+
+template <typename Duration, typename Clock, typename Sampler>
+inline void SampledStopwatch<Duration, Clock, Sampler>::clear() noexcept {
+  samples.clear();
+  total = 0;
+  sampler.reset();
+}
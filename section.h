@@ -0,0 +1,47 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Compile-time section identifiers for scoped stopwatch timing.
+*/
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * Identifies a timed section. Computed from the
+ * section name at compile time, so only the integer
+ * is ever stored.
+ */
+using section_id = uint32_t;
+
+/**
+ * Returns the 32-bit FNV-1a hash of the section name.
+ * Usable in constant expressions.
+ */
+constexpr section_id section_hash(std::string_view name) noexcept {
+  section_id hash = 2166136261u;
+  for (const char c : name) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Interns the section name at compile time: "parse"_section.
+ */
+constexpr section_id operator""_section(const char* name,
+                                        size_t len) noexcept {
+  return section_hash(std::string_view(name, len));
+}
+
+/**
+ * The indices of the time points that a scope
+ * recorded on entry and exit, and its section.
+ */
+struct section_span {
+  size_t begin;
+  size_t end;
+  section_id id;
+};
@@ -0,0 +1,313 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Vectorized kernels for bulk duration extraction.
+*/
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// x86 kernels are compiled for their instruction set with target
+// attributes, so they are built without -march, and chosen at runtime.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define STOPWATCH_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define STOPWATCH_X86_KERNELS 0
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#endif
+
+/**
+ * Instruction sets the kernels can run with, narrowest first.
+ * avx512 requires the F, VL, and DQ extensions.
+ */
+enum class simd_level : uint8_t { scalar, neon, avx2, avx512 };
+
+/**
+ * Returns the widest level the host supports.
+ * Checked once, on the first call.
+ */
+simd_level simd_host_level() noexcept;
+
+/**
+ * Whether contiguous time points of this type can be
+ * processed as packed 64-bit integers by the kernels.
+ */
+template <typename TimePoint>
+inline constexpr bool simd_compatible =
+    std::is_same_v<typename TimePoint::rep, int64_t> &&
+    sizeof(TimePoint) == sizeof(int64_t);
+
+// Every kernel below runs with the given level, or the widest
+// the host supports if that is narrower, and falls back to a
+// scalar loop for the remainder or when no kernel applies.
+
+/**
+ * Writes the n tick differences in[i + 1] - in[i] to out.
+ * REQUIRES: in holds n + 1 time points, out holds n reps.
+ */
+template <typename TimePoint>
+void split_ticks(const TimePoint* in, size_t n, typename TimePoint::rep* out,
+                 simd_level level = simd_host_level()) noexcept;
+
+/**
+ * Writes the n tick differences in[i + 1] - in[0] to out.
+ * REQUIRES: in holds n + 1 time points, out holds n reps.
+ */
+template <typename TimePoint>
+void elapse_ticks(const TimePoint* in, size_t n, typename TimePoint::rep* out,
+                  simd_level level = simd_host_level()) noexcept;
+
+/**
+ * Writes the tick differences in[i + 1] - in[i], for the
+ * i < n where keys[i] == key, to out in order. Returns the
+ * number of differences written. Only avx512 has a kernel.
+ * REQUIRES: in holds n + 1 time points, keys holds n keys,
+ * out holds n reps.
+ */
+template <typename TimePoint>
+size_t filter_split_ticks(const TimePoint* in, const uint32_t* keys, size_t n,
+                          uint32_t key, typename TimePoint::rep* out,
+                          simd_level level = simd_host_level()) noexcept;
+
+/**
+ * Maps the n time points at data in place onto another clock
+ * domain, adding offset + round((data[i] - anchor) * skew) ticks.
+ * Only avx512 has a kernel.
+ */
+template <typename TimePoint>
+void align_ticks(TimePoint* data, size_t n, typename TimePoint::rep anchor,
+                 typename TimePoint::rep offset, double skew,
+                 simd_level level = simd_host_level()) noexcept;
+
+/* --- IMPLEMENTATION --- */
+
+inline simd_level simd_host_level() noexcept {
+  static const simd_level level = [] {
+#if STOPWATCH_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512dq")) {
+      return simd_level::avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+    return simd_level::scalar;
+#elif defined(__ARM_NEON)
+    return simd_level::neon;
+#else
+    return simd_level::scalar;
+#endif
+  }();
+  return level;
+}
+
+// Kernels over packed 64-bit ticks. Each returns how many
+// elements it handled, leaving the rest to the caller.
+namespace simd_kernel {
+#if STOPWATCH_X86_KERNELS
+__attribute__((target("avx512f"))) inline size_t split_avx512(
+    const int64_t* in, size_t n, int64_t* out) noexcept {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const auto lo = _mm512_loadu_si512(in + i);
+    const auto hi = _mm512_loadu_si512(in + i + 1);
+    _mm512_storeu_si512(out + i, _mm512_sub_epi64(hi, lo));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) inline size_t split_avx2(
+    const int64_t* in, size_t n, int64_t* out) noexcept {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const auto* lo = reinterpret_cast<const __m256i*>(in + i);
+    const auto* hi = reinterpret_cast<const __m256i*>(in + i + 1);
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(out + i),
+        _mm256_sub_epi64(_mm256_loadu_si256(hi), _mm256_loadu_si256(lo)));
+  }
+  return i;
+}
+
+__attribute__((target("avx512f"))) inline size_t elapse_avx512(
+    const int64_t* in, size_t n, int64_t* out) noexcept {
+  const auto base = _mm512_set1_epi64(in[0]);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const auto hi = _mm512_loadu_si512(in + i + 1);
+    _mm512_storeu_si512(out + i, _mm512_sub_epi64(hi, base));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) inline size_t elapse_avx2(
+    const int64_t* in, size_t n, int64_t* out) noexcept {
+  const auto base = _mm256_set1_epi64x(in[0]);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const auto* hi = reinterpret_cast<const __m256i*>(in + i + 1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_sub_epi64(_mm256_loadu_si256(hi), base));
+  }
+  return i;
+}
+
+// Also returns the number of differences written through count.
+__attribute__((target("avx512f,avx512vl"))) inline size_t filter_avx512(
+    const int64_t* in, const uint32_t* keys, size_t n, uint32_t key,
+    int64_t* out, size_t& count) noexcept {
+  const auto target = _mm256_set1_epi32(static_cast<int>(key));
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const auto match = _mm256_cmpeq_epi32_mask(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)),
+        target);
+    if (!match) continue;
+    const auto lo = _mm512_loadu_si512(in + i);
+    const auto hi = _mm512_loadu_si512(in + i + 1);
+    _mm512_mask_compressstoreu_epi64(out + count, match,
+                                     _mm512_sub_epi64(hi, lo));
+    count += static_cast<size_t>(__builtin_popcount(match));
+  }
+  return i;
+}
+
+__attribute__((target("avx512f,avx512dq"))) inline size_t align_avx512(
+    int64_t* data, size_t n, int64_t anchor, int64_t offset,
+    double skew) noexcept {
+  const auto base = _mm512_set1_epi64(anchor);
+  const auto shift = _mm512_set1_epi64(offset);
+  const auto slope = _mm512_set1_pd(skew);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const auto ticks = _mm512_loadu_si512(data + i);
+    // Rounds to nearest even, like nearbyint in the scalar loop.
+    const auto error = _mm512_cvtpd_epi64(_mm512_mul_pd(
+        _mm512_cvtepi64_pd(_mm512_sub_epi64(ticks, base)), slope));
+    _mm512_storeu_si512(
+        data + i, _mm512_add_epi64(ticks, _mm512_add_epi64(shift, error)));
+  }
+  return i;
+}
+#elif defined(__ARM_NEON)
+inline size_t split_neon(const int64_t* in, size_t n, int64_t* out) noexcept {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    vst1q_s64(out + i, vsubq_s64(vld1q_s64(in + i + 1), vld1q_s64(in + i)));
+  }
+  return i;
+}
+
+inline size_t elapse_neon(const int64_t* in, size_t n, int64_t* out) noexcept {
+  const auto base = vdupq_n_s64(in[0]);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    vst1q_s64(out + i, vsubq_s64(vld1q_s64(in + i + 1), base));
+  }
+  return i;
+}
+#endif
+}  // namespace simd_kernel
+
+template <typename TimePoint>
+inline void split_ticks(const TimePoint* in, size_t n,
+                        typename TimePoint::rep* out,
+                        simd_level level) noexcept {
+  size_t i = 0;
+  if constexpr (simd_compatible<TimePoint>) {
+    const auto* raw = reinterpret_cast<const int64_t*>(in);
+    level = std::min(level, simd_host_level());
+#if STOPWATCH_X86_KERNELS
+    if (level == simd_level::avx512) {
+      i = simd_kernel::split_avx512(raw, n, out);
+    } else if (level == simd_level::avx2) {
+      i = simd_kernel::split_avx2(raw, n, out);
+    }
+#elif defined(__ARM_NEON)
+    if (level == simd_level::neon) i = simd_kernel::split_neon(raw, n, out);
+#else
+    static_cast<void>(raw);
+#endif
+  }
+  // Remainder, or the whole range when no kernel applies.
+  for (; i < n; ++i) out[i] = (in[i + 1] - in[i]).count();
+}
+
+template <typename TimePoint>
+inline void elapse_ticks(const TimePoint* in, size_t n,
+                         typename TimePoint::rep* out,
+                         simd_level level) noexcept {
+  size_t i = 0;
+  if constexpr (simd_compatible<TimePoint>) {
+    const auto* raw = reinterpret_cast<const int64_t*>(in);
+    level = std::min(level, simd_host_level());
+#if STOPWATCH_X86_KERNELS
+    if (level == simd_level::avx512) {
+      i = simd_kernel::elapse_avx512(raw, n, out);
+    } else if (level == simd_level::avx2) {
+      i = simd_kernel::elapse_avx2(raw, n, out);
+    }
+#elif defined(__ARM_NEON)
+    if (level == simd_level::neon) i = simd_kernel::elapse_neon(raw, n, out);
+#else
+    static_cast<void>(raw);
+#endif
+  }
+  for (; i < n; ++i) out[i] = (in[i + 1] - in[0]).count();
+}
+
+template <typename TimePoint>
+inline size_t filter_split_ticks(const TimePoint* in, const uint32_t* keys,
+                                 size_t n, uint32_t key,
+                                 typename TimePoint::rep* out,
+                                 simd_level level) noexcept {
+  size_t i = 0, count = 0;
+  if constexpr (simd_compatible<TimePoint>) {
+#if STOPWATCH_X86_KERNELS
+    if (std::min(level, simd_host_level()) == simd_level::avx512) {
+      i = simd_kernel::filter_avx512(reinterpret_cast<const int64_t*>(in),
+                                     keys, n, key, out, count);
+    }
+#else
+    static_cast<void>(level);
+#endif
+  }
+  // Always writes, but only keeps matches, so there is no branch.
+  for (; i < n; ++i) {
+    out[count] = (in[i + 1] - in[i]).count();
+    count += keys[i] == key;
+  }
+  return count;
+}
+
+template <typename TimePoint>
+inline void align_ticks(TimePoint* data, size_t n,
+                        typename TimePoint::rep anchor,
+                        typename TimePoint::rep offset, double skew,
+                        simd_level level) noexcept {
+  using rep = typename TimePoint::rep;
+  size_t i = 0;
+  if constexpr (simd_compatible<TimePoint>) {
+#if STOPWATCH_X86_KERNELS
+    if (std::min(level, simd_host_level()) == simd_level::avx512) {
+      i = simd_kernel::align_avx512(reinterpret_cast<int64_t*>(data), n,
+                                    anchor, offset, skew);
+    }
+#else
+    static_cast<void>(level);
+#endif
+  }
+  for (; i < n; ++i) {
+    const auto ticks = data[i].time_since_epoch().count();
+    auto error = static_cast<double>(ticks - anchor) * skew;
+    if constexpr (std::is_integral_v<rep>) error = std::nearbyint(error);
+    data[i] = TimePoint(typename TimePoint::duration(
+        static_cast<rep>(ticks + offset + static_cast<rep>(error))));
+  }
+}
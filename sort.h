@@ -0,0 +1,134 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Parallel sorting of time points recorded out of order.
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Sorts the n time points at data in place, using scratch
+ * as a buffer. Integer tick counts are sorted with an LSD
+ * radix sort over their bytes, skipping bytes every time
+ * point shares. Other tick counts fall back to std::sort.
+ * REQUIRES: scratch holds n time points.
+ */
+template <typename TimePoint>
+void radix_sort(TimePoint* data, size_t n, TimePoint* scratch);
+
+/**
+ * Sorts the n time points at data in place. Large inputs
+ * are cut into one chunk per hardware thread, each radix
+ * sorted on its own thread, then merged pairwise in parallel.
+ * Uses at most threads threads, or every hardware thread if 0.
+ */
+template <typename TimePoint>
+void parallel_sort(TimePoint* data, size_t n, unsigned threads = 0);
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename TimePoint>
+void radix_sort(TimePoint* data, size_t n, TimePoint* scratch) {
+  using rep = typename TimePoint::rep;
+  if constexpr (!std::is_integral_v<rep>) {
+    static_cast<void>(scratch);
+    std::sort(data, data + n);
+  } else {
+    using key = std::make_unsigned_t<rep>;
+    constexpr size_t BYTES = sizeof(rep);
+    constexpr size_t RADIX = 256;
+    // Flipping the sign bit orders signed ticks as unsigned keys.
+    constexpr auto BIAS = std::is_signed_v<rep>
+                              ? static_cast<key>(key(1) << (8 * BYTES - 1))
+                              : key(0);
+    const auto key_of = [](const TimePoint& point) {
+      return static_cast<key>(
+          static_cast<key>(point.time_since_epoch().count()) ^ BIAS);
+    };
+
+    // Count every byte in one pass over the input.
+    std::vector<std::array<size_t, RADIX>> counts(BYTES);
+    for (size_t i = 0; i < n; ++i) {
+      const auto k = key_of(data[i]);
+      for (size_t b = 0; b < BYTES; ++b) ++counts[b][(k >> (8 * b)) & 0xFF];
+    }
+
+    auto* in = data;
+    auto* out = scratch;
+    for (size_t b = 0; b < BYTES; ++b) {
+      auto& count = counts[b];
+      // Every time point shares this byte, so the pass is a no-op.
+      if (std::find(count.begin(), count.end(), n) != count.end()) continue;
+      size_t offset = 0;
+      for (auto& c : count) {
+        const auto bucket = c;
+        c = offset;
+        offset += bucket;
+      }
+      for (size_t i = 0; i < n; ++i) {
+        out[count[(key_of(in[i]) >> (8 * b)) & 0xFF]++] = in[i];
+      }
+      std::swap(in, out);
+    }
+    if (in != data) std::copy(in, in + n, data);
+  }
+}
+
+template <typename TimePoint>
+void parallel_sort(TimePoint* data, size_t n, unsigned threads) {
+  // Smallest chunk worth a thread of its own.
+  constexpr size_t MIN_CHUNK = 1 << 16;
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  const auto chunks = static_cast<size_t>(
+      std::min<size_t>(threads, std::max<size_t>(1, n / MIN_CHUNK)));
+  std::vector<TimePoint> scratch(n);
+  if (chunks == 1) {
+    radix_sort(data, n, scratch.data());
+    return;
+  }
+
+  // Boundaries of each sorted run.
+  std::vector<size_t> bounds(chunks + 1);
+  for (size_t c = 0; c <= chunks; ++c) bounds[c] = n * c / chunks;
+  std::vector<std::thread> workers;
+  workers.reserve(chunks);
+  for (size_t c = 0; c < chunks; ++c) {
+    workers.emplace_back([&, c] {
+      radix_sort(data + bounds[c], bounds[c + 1] - bounds[c],
+                 scratch.data() + bounds[c]);
+    });
+  }
+  for (auto& worker : workers) worker.join();
+
+  // Merge adjacent runs until one is left.
+  auto* in = data;
+  auto* out = scratch.data();
+  while (bounds.size() > 2) {
+    std::vector<size_t> merged;
+    workers.clear();
+    for (size_t r = 0; r + 1 < bounds.size(); r += 2) {
+      merged.push_back(bounds[r]);
+      const auto first = bounds[r];
+      if (r + 2 < bounds.size()) {
+        const auto mid = bounds[r + 1], last = bounds[r + 2];
+        workers.emplace_back([=] {
+          std::merge(in + first, in + mid, in + mid, in + last, out + first);
+        });
+      } else {
+        // An odd run out is carried over as is.
+        std::copy(in + first, in + bounds[r + 1], out + first);
+      }
+    }
+    merged.push_back(n);
+    for (auto& worker : workers) worker.join();
+    bounds.swap(merged);
+    std::swap(in, out);
+  }
+  if (in != data) std::copy(in, in + n, data);
+}
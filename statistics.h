@@ -0,0 +1,203 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of running split statistics.
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+/**
+ * Running count, min, max, mean, and variance of
+ * durations in the given unit. Uses constant memory
+ * regardless of how many durations are added.
+ * Variance is computed with Welford's algorithm.
+ */
+template <typename Duration = std::chrono::milliseconds>
+class Statistics {
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // Number of added durations.
+  uint64_t num = 0;
+
+  // Smallest and largest added durations.
+  typename Duration::rep low = 0;
+  typename Duration::rep high = 0;
+
+  // Running mean of added durations.
+  double avg = 0.0;
+
+  // Running sum of squared differences from the mean.
+  double m2 = 0.0;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Basic default constructor with no durations.
+   */
+  Statistics() = default;
+
+  /**
+   * Adds every duration in the range.
+   * Accepts Stopwatch iterators.
+   */
+  template <typename Iter>
+  Statistics(Iter first, Iter last);
+
+  /**
+   * Adds a duration to the statistics.
+   */
+  void add(typename Duration::rep dur) noexcept;
+
+  /**
+   * Returns whether or not there are added durations.
+   */
+  bool empty() const noexcept;
+
+  /**
+   * Returns the number of added durations.
+   */
+  uint64_t count() const noexcept;
+
+  /**
+   * Returns the smallest added duration.
+   * THROWS: if there are no added durations.
+   */
+  typename Duration::rep min() const;
+
+  /**
+   * Returns the largest added duration.
+   * THROWS: if there are no added durations.
+   */
+  typename Duration::rep max() const;
+
+  /**
+   * Returns the mean of the added durations.
+   * THROWS: if there are no added durations.
+   */
+  double mean() const;
+
+  /**
+   * Returns the sample variance of the added durations.
+   * Zero if fewer than two durations have been added.
+   */
+  double variance() const noexcept;
+
+  /**
+   * Returns the sample standard deviation.
+   */
+  double stddev() const noexcept;
+
+  /**
+   * Delete all added durations.
+   */
+  void clear() noexcept;
+
+  /**
+   * Combines the durations of other into this.
+   */
+  Statistics& operator+=(const Statistics&) noexcept;
+
+  /**
+   * Returns new statistics that combine both durations.
+   */
+  Statistics operator+(const Statistics&) const noexcept;
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration>
+template <typename Iter>
+inline Statistics<Duration>::Statistics(Iter first, Iter last) {
+  for (; first != last; ++first) add(*first);
+}
+
+template <typename Duration>
+inline void Statistics<Duration>::add(typename Duration::rep dur) noexcept {
+  if (num == 0) {
+    low = high = dur;
+  } else {
+    low = std::min(low, dur);
+    high = std::max(high, dur);
+  }
+  ++num;
+  const auto val = static_cast<double>(dur);
+  const auto delta = val - avg;
+  avg += delta / static_cast<double>(num);
+  m2 += delta * (val - avg);
+}
+
+template <typename Duration>
+inline bool Statistics<Duration>::empty() const noexcept {
+  return num == 0;
+}
+
+template <typename Duration>
+inline uint64_t Statistics<Duration>::count() const noexcept {
+  return num;
+}
+
+template <typename Duration>
+inline typename Duration::rep Statistics<Duration>::min() const {
+  if (empty()) throw std::out_of_range("No durations have been added.");
+  return low;
+}
+
+template <typename Duration>
+inline typename Duration::rep Statistics<Duration>::max() const {
+  if (empty()) throw std::out_of_range("No durations have been added.");
+  return high;
+}
+
+template <typename Duration>
+inline double Statistics<Duration>::mean() const {
+  if (empty()) throw std::out_of_range("No durations have been added.");
+  return avg;
+}
+
+template <typename Duration>
+inline double Statistics<Duration>::variance() const noexcept {
+  return num > 1 ? m2 / static_cast<double>(num - 1) : 0.0;
+}
+
+template <typename Duration>
+inline double Statistics<Duration>::stddev() const noexcept {
+  return std::sqrt(variance());
+}
+
+template <typename Duration>
+inline void Statistics<Duration>::clear() noexcept {
+  *this = Statistics();
+}
+
+template <typename Duration>
+Statistics<Duration>& Statistics<Duration>::operator+=(
+    const Statistics<Duration>& other) noexcept {
+  if (other.empty()) return *this;
+  if (empty()) return *this = other;
+  // Chan et al. parallel combination of Welford accumulators.
+  const auto total = num + other.num;
+  const auto delta = other.avg - avg;
+  const auto n_a = static_cast<double>(num);
+  const auto n_b = static_cast<double>(other.num);
+  const auto n = static_cast<double>(total);
+  avg += delta * n_b / n;
+  m2 += other.m2 + delta * delta * n_a * n_b / n;
+  low = std::min(low, other.low);
+  high = std::max(high, other.high);
+  num = total;
+  return *this;
+}
+
+template <typename Duration>
+inline Statistics<Duration> Statistics<Duration>::operator+(
+    const Statistics<Duration>& other) const noexcept {
+  auto temp(*this);
+  return temp += other;
+}
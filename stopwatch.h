@@ -6,28 +6,160 @@ Interface and implementation of stopwatch.
 #pragma once
 #include <algorithm>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iterator>
+#include <memory_resource>
+#include <queue>
+#include <ratio>
 #include <stdexcept>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 #include <vector>
+#include "clock_domain.h"
+#include "section.h"
+#include "simd.h"
+#include "sort.h"
+#include "storage.h"
+
+/**
+ * Equivalent to duration_cast, with the conversion chosen
+ * at compile time. Identical periods return the raw count,
+ * integer multiples multiply, and integer fractions (such as
+ * powers of ten) divide unsigned magnitudes by a constant,
+ * which compiles to a reciprocal multiply and shift.
+ */
+template <typename To, typename Rep, typename Period>
+constexpr To convert_duration(std::chrono::duration<Rep, Period> dur) {
+  using ratio = std::ratio_divide<Period, typename To::period>;
+  using to_rep = typename To::rep;
+  using wide = std::common_type_t<Rep, to_rep, intmax_t>;
+  if constexpr (!std::is_integral_v<Rep> || !std::is_integral_v<to_rep>) {
+    return std::chrono::duration_cast<To>(dur);
+  } else if constexpr (ratio::num == 1 && ratio::den == 1) {
+    return To(static_cast<to_rep>(dur.count()));
+  } else if constexpr (ratio::den == 1) {
+    return To(static_cast<to_rep>(static_cast<wide>(dur.count()) *
+                                  static_cast<wide>(ratio::num)));
+  } else if constexpr (ratio::num == 1) {
+    using unsigned_wide = std::make_unsigned_t<wide>;
+    const auto count = static_cast<wide>(dur.count());
+    const auto den = static_cast<unsigned_wide>(ratio::den);
+    if constexpr (std::is_signed_v<wide>) {
+      // Both round toward zero, matching duration_cast.
+      if (count < 0) {
+        return To(-static_cast<to_rep>(
+            (unsigned_wide(0) - static_cast<unsigned_wide>(count)) / den));
+      }
+    }
+    return To(static_cast<to_rep>(static_cast<unsigned_wide>(count) / den));
+  } else {
+    return std::chrono::duration_cast<To>(dur);
+  }
+}
+
+/**
+ * Customization point for converting a duration
+ * measured by Clock into the reporting Duration.
+ * Specialize for clocks whose tick period is only
+ * known at runtime.
+ */
+template <typename Clock>
+struct clock_traits {
+  // Identifies the clock in saved captures. Zero if unknown.
+  static constexpr uint32_t id =
+      std::is_same_v<Clock, std::chrono::steady_clock>   ? 1
+      : std::is_same_v<Clock, std::chrono::system_clock> ? 2
+                                                         : 0;
+
+  template <typename Duration>
+  static constexpr Duration convert(typename Clock::duration dur) {
+    return convert_duration<Duration>(dur);
+  }
+};
+
+// Instrumentation sites above this level compile to nothing. Levels
+// are 1 for coarse, 2 for fine, and 3 for verbose sites, and 0 also
+// compiles every scope guard to nothing.
+#if !defined(STOPWATCH_LEVEL)
+#define STOPWATCH_LEVEL 2
+#endif
+inline constexpr bool STOPWATCH_SCOPES = STOPWATCH_LEVEL > 0;
 
 /**
  * A stopwatch that is template parameterized
- * by the unit of time to use in measuring and
- * the underlying clock.
+ * by the unit of time to use in measuring,
+ * the underlying clock, and the container
+ * that stores recorded time points.
  */
 template <typename Duration = std::chrono::milliseconds,
-          typename Clock = std::chrono::steady_clock>
+          typename Clock = std::chrono::steady_clock,
+          typename Storage = std::vector<typename Clock::time_point>>
 class Stopwatch {
  private:
   /* --- MEMBER VARIABLES --- */
 
   // A list of recorded time point measurements.
-  std::vector<typename Clock::time_point> measurements;
+  Storage measurements;
 
   // Determines iterator mode created by begin and end.
   bool sw_mode;
 
+  // Subtracted from every split. Zero unless correction is enabled.
+  typename Clock::duration cost;
+
+  // Maps time points onto the reference domain when interleaving.
+  clock_domain<Clock> sw_domain;
+
+  // Prefix sums of converted splits, starting at zero, up to the
+  // last call to build_prefix.
+  std::vector<typename Duration::rep> prefix;
+  // The first time point when prefix was started, to detect overwrites.
+  typename Clock::time_point prefix_front;
+
+  // Spans recorded by scope guards, in order of exit.
+  std::vector<section_span> sections;
+
+  // Number of scope guards that have not exited yet.
+  size_t open_scopes = 0;
+
+  // Reserves the exit time point and span of every open
+  // scope, so that no scope guard allocates on exit.
+  void reserve_exits();
+
+  // Time points and section of a span, independent of indices.
+  using tagged_span = std::tuple<typename Clock::time_point,
+                                 typename Clock::time_point, section_id>;
+
+  // Appends the spans of a stopwatch as tagged spans.
+  static void tag_sections(const Stopwatch&, std::vector<tagged_span>&);
+
+  // Replaces sections by locating tagged spans in the measurements.
+  void retag_sections(const std::vector<tagged_span>&);
+
+  // Calls visit with the time points as a sorted range,
+  // sorting a copy first if they were recorded out of order.
+  template <typename Visitor>
+  static void visit_sorted(const Storage&, Visitor visit);
+
+  // Implements splits_into and elapsed_into.
+  void extract_into(typename Duration::rep* out, bool mode_in) const;
+
+  // Returns whether prefix still indexes the current splits.
+  bool prefix_fresh() const noexcept;
+
+  // Returns split index converted as the prefix index sums it.
+  typename Duration::rep indexed_split(size_t index) const;
+
+  // Subtracts the cost of each split in dur, clamped at zero.
+  // Durations that are already negative are returned as is.
+  static typename Clock::duration correct(typename Clock::duration dur,
+                                          typename Clock::duration cost_in,
+                                          size_t splits) noexcept;
+
  public:
   /* --- PUBLIC INTERFACE --- */
 
@@ -53,6 +185,25 @@ class Stopwatch {
    */
   explicit Stopwatch(size_t res, bool = SPLIT_MODE);
 
+  /**
+   * Adopt the given time points as measurements.
+   * REQUIRES: time points are sorted, or sort is called.
+   * Optional argument to specify the stopwatch
+   * mode. Defaults to split mode.
+   */
+  explicit Stopwatch(Storage data_in, bool = SPLIT_MODE);
+
+  /**
+   * Draw memory from alloc, such as a memory resource for
+   * PmrStopwatch, and reserve the internal buffer to the
+   * given number of durations. Only for storage with an
+   * allocator_type that alloc converts to.
+   */
+  template <typename Alloc, typename S = Storage,
+            typename = std::enable_if_t<std::is_convertible_v<
+                const Alloc&, typename S::allocator_type>>>
+  explicit Stopwatch(const Alloc& alloc, size_t res = 1, bool = SPLIT_MODE);
+
   /**
    * Returns whether or not there are recorded
    * durations. This is not the same as the
@@ -77,6 +228,18 @@ class Stopwatch {
    */
   void mode(bool mode_in) noexcept;
 
+  /**
+   * Returns the clock domain of the time points.
+   */
+  const clock_domain<Clock>& domain() const noexcept;
+
+  /**
+   * Sets the clock domain of the time points. Splits are
+   * unaffected, but interleaving maps every time point onto
+   * the reference domain, which the result is then in.
+   */
+  void domain(const clock_domain<Clock>& domain_in) noexcept;
+
   /**
    * Records the current time measurement.
    * Note that there is no distinction between
@@ -86,11 +249,93 @@ class Stopwatch {
   void record();
 
   /**
-   * Delete all recorded time points.
+   * Delete all recorded time points and sections. Keeps the
+   * capacity of every buffer, the mode, the overhead
+   * correction, and the clock domain, so recording again does
+   * not allocate until the old capacity is exceeded.
    * WARNING: invalidates iterators and data reference.
    */
   void clear() noexcept;
 
+  /**
+   * Same as clear, but also returns to the reference clock
+   * domain, undoing any call to domain. That is the only
+   * difference between the two.
+   * WARNING: invalidates iterators and data reference.
+   */
+  void reset() noexcept;
+
+  /**
+   * Sorts time points recorded out of order, such as captures
+   * from several hosts or a system clock that jumped, with a
+   * parallel radix sort. Sections keep their time points.
+   * Does nothing if the time points are already sorted.
+   * WARNING: invalidates iterators and data reference.
+   */
+  void sort();
+
+  /**
+   * An RAII guard that records on construction and on
+   * destruction, then tags the pair with its section.
+   * Compiles to nothing if STOPWATCH_LEVEL is 0.
+   */
+  class scope_guard {
+    friend class Stopwatch;
+
+   private:
+    // The stopwatch being recorded into.
+    Stopwatch* sw;
+    // Index of the time point recorded on entry.
+    size_t start;
+    // Section of this scope.
+    section_id id;
+
+    // Records the entry time point.
+    scope_guard(Stopwatch&, section_id);
+
+   public:
+    scope_guard(const scope_guard&) = delete;
+    scope_guard& operator=(const scope_guard&) = delete;
+
+    // Records the exit time point and tags the span.
+    ~scope_guard();
+  };
+
+  /**
+   * Returns a guard that times the enclosing scope
+   * as the given section, e.g. scope("parse"_section).
+   * Entry reserves room for the exit, so the guard never
+   * allocates or throws when it is destroyed.
+   * REQUIRES: storage that keeps every time point and reports
+   * its capacity, checked at compile time.
+   * WARNING: entry and exit invalidate iterators and data reference.
+   */
+  [[nodiscard]] scope_guard scope(section_id id);
+
+  /**
+   * Returns every span recorded by a scope guard.
+   */
+  const std::vector<section_span>& section_spans() const noexcept;
+
+  /**
+   * Returns the number of times the section was timed.
+   */
+  size_t section_count(section_id id) const noexcept;
+
+  /**
+   * Returns the total duration spent in the section.
+   * Each span is overhead corrected for its splits.
+   */
+  typename Duration::rep section_total(section_id id) const;
+
+  /**
+   * Adds the duration of every span of the section to
+   * the sink and returns it, overhead corrected like
+   * section_total. Accepts Statistics and Histogram.
+   */
+  template <typename Sink>
+  Sink section(section_id id, Sink sink = Sink()) const;
+
   /**
    * Index-checked access into durations.
    * Based on stopwatch mode, determines either
@@ -99,12 +344,64 @@ class Stopwatch {
   template <typename Integer>
   typename Duration::rep operator[](Integer index) const;
 
+  /**
+   * Same as operator[], but in raw clock ticks, so that
+   * conversion can be deferred until reporting time.
+   */
+  template <typename Integer>
+  typename Clock::rep raw(Integer index) const;
+
+  /**
+   * Converts raw clock ticks into Duration.
+   */
+  static typename Duration::rep convert(typename Clock::rep ticks);
+
+  /**
+   * Extends the prefix index used by range queries over
+   * every split, rebuilding it if it is stale.
+   */
+  void build_prefix();
+
+  /**
+   * Returns the sum of splits [first, last). Constant time
+   * over splits indexed by build_prefix, and linear over
+   * the rest. Never modifies the index, so concurrent
+   * queries on a const stopwatch are safe.
+   * THROWS: if first > last or last > size().
+   */
+  typename Duration::rep range_sum(size_t first, size_t last) const;
+
+  /**
+   * Returns the mean of splits [first, last), like range_sum.
+   * THROWS: if the range is empty or out of bounds.
+   */
+  double range_mean(size_t first, size_t last) const;
+
+  /**
+   * Returns the median cost of one back-to-back record
+   * for this Clock and Storage. Measured on the first call.
+   */
+  static typename Clock::duration record_overhead();
+
+  /**
+   * Enables or disables overhead correction. When enabled,
+   * indexing, iteration, bulk extraction, and section views
+   * subtract the record_overhead of every split, clamped at zero.
+   */
+  void correct_overhead(bool enable = true);
+
+  /**
+   * Returns the overhead subtracted from every split.
+   * Zero if correction is disabled.
+   */
+  typename Clock::duration overhead() const noexcept;
+
   /**
    * Yields a const reference to the underlying
    * time_point measurements made by the stopwatch.
    * WARNING: Reference is invalidated and record and clear.
    */
-  const std::vector<typename Clock::time_point>& data() const noexcept;
+  const Storage& data() const noexcept;
 
   /**
    * Index-checked access into the
@@ -118,28 +415,52 @@ class Stopwatch {
    */
   size_t data_size() const noexcept;
 
+  /**
+   * Writes every split to out in one pass, without per
+   * element bounds checks. Matches split mode iteration.
+   * Vectorized for contiguous storage of 64-bit ticks.
+   * REQUIRES: out has room for size() durations.
+   */
+  void splits_into(typename Duration::rep* out) const;
+
+  /**
+   * Writes every elapsed time to out in one pass, without
+   * per element bounds checks. Matches elapse mode iteration.
+   * Vectorized for contiguous storage of 64-bit ticks.
+   * REQUIRES: out has room for size() durations.
+   */
+  void elapsed_into(typename Duration::rep* out) const;
+
   /**
    * A random access const iterator type that
    * gives indexed access into time splits.
    * Can be toggled between split and elapse modes.
    */
-  class iterator
-      : public std::iterator<
-            std::random_access_iterator_tag, typename Duration::rep, ptrdiff_t,
-            const typename Duration::rep*, const typename Duration::rep&> {
+  class iterator {
     friend class Stopwatch;
 
+   public:
+    // Standard iterator traits.
+
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = typename Duration::rep;
+    using difference_type = ptrdiff_t;
+    using pointer = const typename Duration::rep*;
+    using reference = const typename Duration::rep&;
+
    private:
-    // Tracks the initial time point of the underlying container.
-    const typename Clock::time_point* base;
-    // Tracks the underlying time point of this iterator.
-    const typename Clock::time_point* ptr;
+    // Tracks the underlying time point container.
+    const Storage* base;
+    // Tracks the index of the split pointed to by this iterator.
+    ptrdiff_t pos;
     // The mode of this iterator, determines whether it uses split or elapse.
     bool iter_mode;
+    // Subtracted from every split.
+    typename Clock::duration cost;
 
     // Constructor that gives the iterator all its member variables.
-    explicit iterator(const typename Clock::time_point* const,
-                      const typename Clock::time_point* const, bool) noexcept;
+    explicit iterator(const Storage* const, ptrdiff_t, bool,
+                      typename Clock::duration) noexcept;
 
    public:
     // Should not be able to default construct stopwatch iterators.
@@ -160,9 +481,16 @@ class Stopwatch {
 
     // Gives the split pointed to by this iterator.
     typename Duration::rep operator*() const;
+    // Gives the split pointed to by this iterator in raw clock ticks.
+    typename Clock::rep raw() const;
     typename Duration::rep operator[](ptrdiff_t dist) const;
     // This iterator has no arrow operator.
 
+    // Change in a sampled hardware counter over the split or elapsed time.
+    // REQUIRES: Storage samples counters, as in PerfStopwatch.
+    template <typename Counter>
+    uint64_t counter_delta(Counter which) const;
+
     // Comparison operators.
 
     bool operator==(const iterator& other) const noexcept;
@@ -200,255 +528,838 @@ class Stopwatch {
 
   /**
    * Addition operator interleaves the result of other into this.
+   * Merges in place when the storage is a resizable array.
+   * Either side is sorted first if recorded out of order.
+   * REQUIRES: is_interleavable<Storage>, checked at compile time.
    */
   Stopwatch& operator+=(const Stopwatch&);
 
   /**
    * Returns a new Stopwatch with the iterleaving of times.
+   * Overloads for temporaries reuse the temporary's buffer.
    */
-  Stopwatch operator+(const Stopwatch&);
+  Stopwatch operator+(const Stopwatch&) const&;
+  Stopwatch operator+(const Stopwatch&) &&;
+  Stopwatch operator+(Stopwatch&&) const&;
+  Stopwatch operator+(Stopwatch&&) &&;
+
+  /**
+   * Returns a new Stopwatch with the interleaving of times
+   * of every stopwatch in the range, in the given mode.
+   * Equivalent to folding with operator+, but uses a
+   * single k-way merge into one allocation. Sorts copies
+   * of any stopwatch recorded out of order.
+   * REQUIRES: is_interleavable<Storage>, checked at compile time.
+   */
+  template <typename Iter>
+  static Stopwatch merge(Iter first, Iter last, bool mode_in = SPLIT_MODE);
 };
 
+/**
+ * A stopwatch that records into N inline time points
+ * and never allocates. When full, overwrites the oldest
+ * time point or drops new ones based on Policy.
+ */
+template <size_t N, typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock,
+          overflow Policy = overflow::ring>
+using FixedStopwatch = Stopwatch<
+    Duration, Clock, fixed_buffer<typename Clock::time_point, N, Policy>>;
+
+/**
+ * A stopwatch that delta encodes its time points
+ * in blocks, using about sizeof(Delta) bytes per
+ * time point instead of sizeof(Clock::time_point).
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock,
+          typename Delta = uint32_t>
+using CompactStopwatch =
+    Stopwatch<Duration, Clock, delta_buffer<typename Clock::time_point, Delta>>;
+
+/**
+ * A stopwatch whose time points come from a memory
+ * resource, such as a per-request monotonic arena or
+ * the free lists of thread_pool(). Copies use the default
+ * resource, as with any std::pmr container.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock>
+using PmrStopwatch =
+    Stopwatch<Duration, Clock, std::pmr::vector<typename Clock::time_point>>;
+
 /* --- TEMPLATE IMPLEMENTATION --- */
 
-template <typename Duration, typename Clock>
-inline Stopwatch<Duration, Clock>::Stopwatch(bool mode_in) : sw_mode(mode_in) {
+template <typename Duration, typename Clock, typename Storage>
+inline Stopwatch<Duration, Clock, Storage>::Stopwatch(bool mode_in)
+    : sw_mode(mode_in), cost(0) {
   measurements.reserve(2);
 }
 
-template <typename Duration, typename Clock>
-inline Stopwatch<Duration, Clock>::Stopwatch(size_t res, bool mode_in)
-    : sw_mode(mode_in) {
+template <typename Duration, typename Clock, typename Storage>
+inline Stopwatch<Duration, Clock, Storage>::Stopwatch(size_t res, bool mode_in)
+    : sw_mode(mode_in), cost(0) {
+  measurements.reserve(res + 1);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline Stopwatch<Duration, Clock, Storage>::Stopwatch(Storage data_in,
+                                                      bool mode_in)
+    : measurements(std::move(data_in)), sw_mode(mode_in), cost(0) {}
+
+template <typename Duration, typename Clock, typename Storage>
+template <typename Alloc, typename S, typename>
+inline Stopwatch<Duration, Clock, Storage>::Stopwatch(const Alloc& alloc,
+                                                      size_t res, bool mode_in)
+    : measurements(typename S::allocator_type(alloc)),
+      sw_mode(mode_in),
+      cost(0) {
   measurements.reserve(res + 1);
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::empty() const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::empty() const noexcept {
   return measurements.size() < 2;
 }
 
-template <typename Duration, typename Clock>
-inline size_t Stopwatch<Duration, Clock>::size() const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline size_t Stopwatch<Duration, Clock, Storage>::size() const noexcept {
   const auto sz = measurements.size();
   // Elapsed durations is one less than measurements.
   return sz > 1 ? sz - 1 : 0;
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::mode() const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::mode() const noexcept {
   return sw_mode;
 }
 
-template <typename Duration, typename Clock>
-inline void Stopwatch<Duration, Clock>::mode(bool mode) noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline const clock_domain<Clock>& Stopwatch<Duration, Clock, Storage>::domain()
+    const noexcept {
+  return sw_domain;
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::domain(
+    const clock_domain<Clock>& domain_in) noexcept {
+  sw_domain = domain_in;
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::mode(bool mode) noexcept {
   sw_mode = mode;
 }
 
-template <typename Duration, typename Clock>
-inline void Stopwatch<Duration, Clock>::record() {
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::record() {
   measurements.emplace_back(Clock::now());
+  if constexpr (has_capacity<Storage>::value) {
+    // Keep the room reserved for the exits of open scopes.
+    if (open_scopes != 0) reserve_exits();
+  }
 }
 
-template <typename Duration, typename Clock>
-inline void Stopwatch<Duration, Clock>::clear() noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::clear() noexcept {
   measurements.clear();
+  sections.clear();
+  prefix.clear();
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::reset() noexcept {
+  // Containers keep their capacity when cleared.
+  clear();
+  sw_domain = clock_domain<Clock>();
+}
+
+template <typename Duration, typename Clock, typename Storage>
+void Stopwatch<Duration, Clock, Storage>::sort() {
+  if (std::is_sorted(measurements.begin(), measurements.end())) return;
+  prefix.clear();
+  std::vector<tagged_span> tagged;
+  tag_sections(*this, tagged);
+  if constexpr (has_sort<Storage>::value) {
+    measurements.sort();
+  } else if constexpr (is_contiguous<Storage>::value &&
+                       is_resizable<Storage>::value) {
+    parallel_sort(measurements.data(), measurements.size());
+  } else {
+    std::vector<typename Clock::time_point> points(measurements.begin(),
+                                                   measurements.end());
+    parallel_sort(points.data(), points.size());
+    auto sorted = empty_like(measurements);
+    sorted.reserve(points.size());
+    for (const auto& point : points) sorted.emplace_back(point);
+    measurements.swap(sorted);
+  }
+  if (!tagged.empty()) retag_sections(tagged);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+template <typename Visitor>
+void Stopwatch<Duration, Clock, Storage>::visit_sorted(const Storage& points,
+                                                       Visitor visit) {
+  if (std::is_sorted(points.begin(), points.end())) {
+    visit(points.begin(), points.end());
+    return;
+  }
+  std::vector<typename Clock::time_point> copy(points.begin(), points.end());
+  parallel_sort(copy.data(), copy.size());
+  visit(copy.cbegin(), copy.cend());
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline Stopwatch<Duration, Clock, Storage>::scope_guard::scope_guard(
+    Stopwatch& sw_in, section_id id_in)
+    : sw(&sw_in), start(0), id(id_in) {
+  if constexpr (STOPWATCH_SCOPES) {
+    sw->record();
+    start = sw->measurements.size() - 1;
+    ++sw->open_scopes;
+    try {
+      sw->reserve_exits();
+    } catch (...) {
+      --sw->open_scopes;
+      throw;
+    }
+  }
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline Stopwatch<Duration, Clock, Storage>::scope_guard::~scope_guard() {
+  if constexpr (STOPWATCH_SCOPES) {
+    // Both appends fit in the room reserved on entry.
+    --sw->open_scopes;
+    sw->record();
+    sw->sections.push_back({start, sw->measurements.size() - 1, id});
+  }
+}
+
+template <typename Duration, typename Clock, typename Storage>
+void Stopwatch<Duration, Clock, Storage>::reserve_exits() {
+  // Grow geometrically, so entering scopes stays amortized constant.
+  const auto grow = [this](auto& container) {
+    const auto need = container.size() + open_scopes;
+    if (container.capacity() < need) {
+      container.reserve(std::max(need, 2 * container.capacity()));
+    }
+  };
+  grow(measurements);
+  grow(sections);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::scope_guard
+Stopwatch<Duration, Clock, Storage>::scope(section_id id) {
+  static_assert(keeps_every_point<Storage>::value &&
+                    has_capacity<Storage>::value,
+                "Scopes need storage that keeps every time point and "
+                "reports its capacity.");
+  return scope_guard(*this, id);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline const std::vector<section_span>&
+Stopwatch<Duration, Clock, Storage>::section_spans() const noexcept {
+  return sections;
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline size_t Stopwatch<Duration, Clock, Storage>::section_count(
+    section_id id) const noexcept {
+  return static_cast<size_t>(
+      std::count_if(sections.begin(), sections.end(),
+                    [id](const section_span& span) { return span.id == id; }));
+}
+
+template <typename Duration, typename Clock, typename Storage>
+typename Duration::rep Stopwatch<Duration, Clock, Storage>::section_total(
+    section_id id) const {
+  typename Clock::duration total(0);
+  for (const auto& span : sections) {
+    if (span.id != id) continue;
+    total += correct(measurements[span.end] - measurements[span.begin], cost,
+                     span.end - span.begin);
+  }
+  return clock_traits<Clock>::template convert<Duration>(total).count();
+}
+
+template <typename Duration, typename Clock, typename Storage>
+template <typename Sink>
+Sink Stopwatch<Duration, Clock, Storage>::section(section_id id,
+                                                  Sink sink) const {
+  for (const auto& span : sections) {
+    if (span.id != id) continue;
+    const auto dur = correct(measurements[span.end] - measurements[span.begin],
+                             cost, span.end - span.begin);
+    sink.add(clock_traits<Clock>::template convert<Duration>(dur).count());
+  }
+  return sink;
+}
+
+template <typename Duration, typename Clock, typename Storage>
+void Stopwatch<Duration, Clock, Storage>::tag_sections(
+    const Stopwatch& sw, std::vector<tagged_span>& out) {
+  for (const auto& span : sw.sections) {
+    out.emplace_back(sw.sw_domain.apply(sw.measurements[span.begin]),
+                     sw.sw_domain.apply(sw.measurements[span.end]), span.id);
+  }
+}
+
+template <typename Duration, typename Clock, typename Storage>
+void Stopwatch<Duration, Clock, Storage>::retag_sections(
+    const std::vector<tagged_span>& tagged) {
+  const auto index_of = [this](const typename Clock::time_point& point) {
+    const auto iter =
+        std::lower_bound(measurements.begin(), measurements.end(), point);
+    return static_cast<size_t>(iter - measurements.begin());
+  };
+  sections.clear();
+  for (const auto& [begin, end, id] : tagged) {
+    sections.push_back({index_of(begin), index_of(end), id});
+  }
+  std::sort(sections.begin(), sections.end(),
+            [](const section_span& a, const section_span& b) {
+              return a.end < b.end;
+            });
+}
+
+template <typename Duration, typename Clock, typename Storage>
+template <typename Integer>
+inline typename Duration::rep Stopwatch<Duration, Clock, Storage>::operator[](
+    Integer index) const {
+  return convert(raw(index));
 }
 
-template <typename Duration, typename Clock>
+template <typename Duration, typename Clock, typename Storage>
 template <typename Integer>
-typename Duration::rep Stopwatch<Duration, Clock>::operator[](
+typename Clock::rep Stopwatch<Duration, Clock, Storage>::raw(
     Integer index) const {
   static_assert(std::is_integral_v<Integer>, "Parameter must be integer type.");
   const auto end = measurements.at(index + 1);
   const auto begin =
       (sw_mode == SPLIT_MODE) ? measurements[index] : measurements.front();
-  auto dur = std::chrono::duration_cast<Duration>(end - begin);
-  return dur.count();
+  const auto splits =
+      (sw_mode == SPLIT_MODE) ? 1 : static_cast<size_t>(index) + 1;
+  return correct(end - begin, cost, splits).count();
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline typename Duration::rep Stopwatch<Duration, Clock, Storage>::convert(
+    typename Clock::rep ticks) {
+  return clock_traits<Clock>::template convert<Duration>(
+             typename Clock::duration(ticks))
+      .count();
+}
+
+template <typename Duration, typename Clock, typename Storage>
+typename Clock::duration
+Stopwatch<Duration, Clock, Storage>::record_overhead() {
+  static const auto median = [] {
+    // Pairs of records, so that fixed capacity storage never wraps.
+    constexpr size_t TRIALS = 1001;
+    std::vector<typename Clock::duration> costs(TRIALS);
+    Stopwatch probe;
+    for (auto& trial : costs) {
+      probe.clear();
+      probe.record();
+      probe.record();
+      trial = probe.measurements.back() - probe.measurements.front();
+    }
+    const auto mid = costs.begin() + TRIALS / 2;
+    std::nth_element(costs.begin(), mid, costs.end());
+    return *mid;
+  }();
+  return median;
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::correct_overhead(
+    bool enable) {
+  cost = enable ? record_overhead() : typename Clock::duration(0);
+  prefix.clear();
+}
+
+template <typename Duration, typename Clock, typename Storage>
+typename Duration::rep Stopwatch<Duration, Clock, Storage>::range_sum(
+    size_t first, size_t last) const {
+  if (first > last || last > size()) {
+    throw std::out_of_range("Split range out of bounds.");
+  }
+  // Splits past the index, or every split if it is stale, are summed.
+  const auto indexed = prefix_fresh() ? prefix.size() - 1 : 0;
+  const auto begin = std::min(first, indexed);
+  const auto end = std::min(last, indexed);
+  auto total = indexed > 0 ? prefix[end] - prefix[begin]
+                           : typename Duration::rep(0);
+  for (auto i = std::max(first, indexed); i < last; ++i) {
+    total += indexed_split(i);
+  }
+  return total;
+}
+
+template <typename Duration, typename Clock, typename Storage>
+double Stopwatch<Duration, Clock, Storage>::range_mean(size_t first,
+                                                       size_t last) const {
+  if (first == last) throw std::out_of_range("Split range is empty.");
+  return static_cast<double>(range_sum(first, last)) /
+         static_cast<double>(last - first);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::prefix_fresh()
+    const noexcept {
+  const auto n = size();
+  // Ring storage shifts indices by overwriting its oldest time point.
+  return !prefix.empty() && prefix.size() <= n + 1 &&
+         (prefix.size() == 1 || measurements.front() == prefix_front);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline typename Duration::rep
+Stopwatch<Duration, Clock, Storage>::indexed_split(size_t index) const {
+  const auto split =
+      correct(measurements[index + 1] - measurements[index], cost, 1);
+  return clock_traits<Clock>::template convert<Duration>(split).count();
+}
+
+template <typename Duration, typename Clock, typename Storage>
+void Stopwatch<Duration, Clock, Storage>::build_prefix() {
+  const auto n = size();
+  if (!prefix_fresh()) prefix.clear();
+  if (prefix.empty()) prefix.push_back(0);
+  // The front is only known once a split is indexed.
+  if (prefix.size() == 1 && n > 0) prefix_front = measurements.front();
+  prefix.reserve(n + 1);
+  for (auto i = prefix.size() - 1; i < n; ++i) {
+    prefix.push_back(prefix.back() + indexed_split(i));
+  }
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline typename Clock::duration
+Stopwatch<Duration, Clock, Storage>::overhead() const noexcept {
+  return cost;
 }
 
-template <typename Duration, typename Clock>
-inline const std::vector<typename Clock::time_point>&
-Stopwatch<Duration, Clock>::data() const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline typename Clock::duration Stopwatch<Duration, Clock, Storage>::correct(
+    typename Clock::duration dur, typename Clock::duration cost_in,
+    size_t splits) noexcept {
+  using rep = typename Clock::duration::rep;
+  const auto total = cost_in * static_cast<rep>(splits);
+  if (dur > total) return dur - total;
+  // Out of order time points give negative splits, which are kept.
+  return std::min(dur, typename Clock::duration(0));
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline const Storage& Stopwatch<Duration, Clock, Storage>::data()
+    const noexcept {
   return measurements;
 }
 
-template <typename Duration, typename Clock>
+template <typename Duration, typename Clock, typename Storage>
 template <typename Integer>
-inline typename Clock::time_point Stopwatch<Duration, Clock>::data(
+inline typename Clock::time_point Stopwatch<Duration, Clock, Storage>::data(
     Integer index) const {
   static_assert(std::is_integral_v<Integer>, "Parameter must be integer type.");
   return measurements.at(index);
 }
 
-template <typename Duration, typename Clock>
-inline size_t Stopwatch<Duration, Clock>::data_size() const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline size_t Stopwatch<Duration, Clock, Storage>::data_size() const noexcept {
   return measurements.size();
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator
-Stopwatch<Duration, Clock>::begin() const noexcept {
-  const auto base = measurements.data();
-  return iterator(base, base, sw_mode);
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::splits_into(
+    typename Duration::rep* out) const {
+  extract_into(out, SPLIT_MODE);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::elapsed_into(
+    typename Duration::rep* out) const {
+  extract_into(out, ELAPSE_MODE);
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator
-Stopwatch<Duration, Clock>::end() const noexcept {
-  const auto base = measurements.data();
-  const auto fin = measurements.empty() ? measurements.begin()
-                                        : std::prev(measurements.end());
-  return iterator(base, &(*fin), sw_mode);
+template <typename Duration, typename Clock, typename Storage>
+void Stopwatch<Duration, Clock, Storage>::extract_into(
+    typename Duration::rep* out, bool mode_in) const {
+  using clock_duration = typename Clock::duration;
+  const auto n = size();
+  if (n == 0) return;
+  if constexpr (is_contiguous<Storage>::value &&
+                std::is_same_v<typename Duration::rep,
+                               typename clock_duration::rep>) {
+    // Subtract raw ticks in place, then convert in a second pass.
+    const auto* points = measurements.data();
+    if (mode_in == SPLIT_MODE) {
+      split_ticks(points, n, out);
+    } else {
+      elapse_ticks(points, n, out);
+    }
+    if (cost != clock_duration(0)) {
+      for (size_t i = 0; i < n; ++i) {
+        const auto splits = (mode_in == SPLIT_MODE) ? 1 : i + 1;
+        out[i] = correct(clock_duration(out[i]), cost, splits).count();
+      }
+    }
+    if constexpr (!std::is_same_v<Duration, clock_duration>) {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = clock_traits<Clock>::template convert<Duration>(
+                     clock_duration(out[i]))
+                     .count();
+      }
+    }
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      const auto begin =
+          (mode_in == SPLIT_MODE) ? measurements[i] : measurements.front();
+      const auto splits = (mode_in == SPLIT_MODE) ? 1 : i + 1;
+      const auto dur = correct(measurements[i + 1] - begin, cost, splits);
+      out[i] = clock_traits<Clock>::template convert<Duration>(dur).count();
+    }
+  }
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator
+Stopwatch<Duration, Clock, Storage>::begin() const noexcept {
+  return iterator(&measurements, 0, sw_mode, cost);
 }
 
-template <typename Duration, typename Clock>
-Stopwatch<Duration, Clock>& Stopwatch<Duration, Clock>::operator+=(
-    const Stopwatch<Duration, Clock>& other) {
-  decltype(measurements) new_measures;
-  new_measures.reserve(measurements.size() + other.measurements.size());
-  std::set_union(measurements.begin(), measurements.end(),
-                 other.measurements.begin(), other.measurements.end(),
-                 std::back_inserter(new_measures));
-  measurements.swap(new_measures);
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator
+Stopwatch<Duration, Clock, Storage>::end() const noexcept {
+  return iterator(&measurements, static_cast<ptrdiff_t>(size()), sw_mode,
+                  cost);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+Stopwatch<Duration, Clock, Storage>&
+Stopwatch<Duration, Clock, Storage>::operator+=(
+    const Stopwatch<Duration, Clock, Storage>& other) {
+  static_assert(is_interleavable<Storage>::value,
+                "Storage cannot be interleaved.");
+  if (this == &other) return *this;
+  prefix.clear();
+  std::vector<tagged_span> tagged;
+  tag_sections(*this, tagged);
+  tag_sections(other, tagged);
+  sort();
+  visit_sorted(other.measurements, [this, &other](auto first, auto last) {
+    const auto m = static_cast<size_t>(std::distance(first, last));
+    aligned_window<Clock, decltype(first)> in(first, m, other.sw_domain);
+    if constexpr (is_contiguous<Storage>::value &&
+                  is_resizable<Storage>::value) {
+      // Set union from the back, so nothing unread is overwritten.
+      const auto n = measurements.size();
+      measurements.resize(n + m);
+      auto* const out = measurements.data();
+      aligned_window<Clock, decltype(out)> own(out, n, sw_domain);
+      size_t i = n, j = m, w = n + m;
+      while (i > 0 && j > 0) {
+        const auto mine = own[i - 1], theirs = in[j - 1];
+        if (theirs < mine) {
+          out[--w] = mine;
+          --i;
+        } else if (mine < theirs) {
+          out[--w] = theirs;
+          --j;
+        } else {
+          out[--w] = mine;
+          --i;
+          --j;
+        }
+      }
+      while (j > 0) out[--w] = in[--j];
+      // Close the gap left by common time points.
+      // The remaining time points of this are not mapped yet.
+      if (!sw_domain.identity()) sw_domain.apply(out, i);
+      std::move(out + w, out + n + m, out + i);
+      measurements.resize(i + n + m - w);
+    } else {
+      auto new_measures = empty_like(measurements);
+      new_measures.reserve(measurements.size() + m);
+      const auto& points = measurements;
+      aligned_window<Clock, decltype(points.begin())> own(
+          points.begin(), points.size(), sw_domain);
+      size_t i = 0, j = 0;
+      while (i < own.size() && j < m) {
+        const auto mine = own[i], theirs = in[j];
+        if (!(theirs < mine)) ++i;
+        if (!(mine < theirs)) ++j;
+        new_measures.emplace_back(mine < theirs ? mine : theirs);
+      }
+      for (; i < own.size(); ++i) new_measures.emplace_back(own[i]);
+      for (; j < m; ++j) new_measures.emplace_back(in[j]);
+      measurements.swap(new_measures);
+    }
+  });
+  sw_domain = clock_domain<Clock>();
+  if (!tagged.empty()) retag_sections(tagged);
   return *this;
 }
 
-template <typename Duration, typename Clock>
-Stopwatch<Duration, Clock> Stopwatch<Duration, Clock>::operator+(
-    const Stopwatch<Duration, Clock>& other) {
+template <typename Duration, typename Clock, typename Storage>
+Stopwatch<Duration, Clock, Storage>
+Stopwatch<Duration, Clock, Storage>::operator+(
+    const Stopwatch<Duration, Clock, Storage>& other) const& {
   auto temp(*this);
   return temp += other;
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::iterator::mode() const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+Stopwatch<Duration, Clock, Storage>
+Stopwatch<Duration, Clock, Storage>::operator+(
+    const Stopwatch<Duration, Clock, Storage>& other) && {
+  *this += other;
+  return std::move(*this);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+Stopwatch<Duration, Clock, Storage>
+Stopwatch<Duration, Clock, Storage>::operator+(
+    Stopwatch<Duration, Clock, Storage>&& other) const& {
+  // Interleaving is commutative, so grow the temporary instead.
+  other += *this;
+  other.sw_mode = sw_mode;
+  other.cost = cost;
+  return std::move(other);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+Stopwatch<Duration, Clock, Storage>
+Stopwatch<Duration, Clock, Storage>::operator+(
+    Stopwatch<Duration, Clock, Storage>&& other) && {
+  *this += other;
+  return std::move(*this);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+template <typename Iter>
+Stopwatch<Duration, Clock, Storage> Stopwatch<Duration, Clock, Storage>::merge(
+    Iter first, Iter last, bool mode_in) {
+  static_assert(is_interleavable<Storage>::value,
+                "Storage cannot be interleaved.");
+  using time_point = typename Clock::time_point;
+  // Head time point, source index, and index within the source.
+  using cursor = std::tuple<time_point, size_t, size_t>;
+  // Reads a source mapped onto the reference domain.
+  using window =
+      aligned_window<Clock, decltype(std::declval<const Storage&>().begin())>;
+
+  std::vector<window> sources;
+  std::vector<cursor> heads;
+  std::vector<tagged_span> tagged;
+  // Sorted copies of stopwatches recorded out of order.
+  std::deque<Stopwatch> sorted;
+  size_t total = 0;
+  const Storage* first_storage = nullptr;
+  for (; first != last; ++first) {
+    tag_sections(*first, tagged);
+    if (!first_storage) first_storage = &first->measurements;
+    const Storage* source = &first->measurements;
+    if (!std::is_sorted(source->begin(), source->end())) {
+      sorted.push_back(*first);
+      sorted.back().sort();
+      source = &sorted.back().measurements;
+    }
+    sources.emplace_back(source->begin(), source->size(), first->sw_domain);
+    total += source->size();
+    if (source->size() > 0) {
+      heads.emplace_back(sources.back()[0], sources.size() - 1, 0);
+    }
+  }
+
+  // Allocate like the first source, such as from its arena.
+  auto out = first_storage ? empty_like(*first_storage) : Storage();
+  out.reserve(total);
+  std::priority_queue<cursor, std::vector<cursor>, std::greater<cursor>> heap(
+      std::greater<cursor>(), std::move(heads));
+  while (!heap.empty()) {
+    // Like set_union, keep the most copies any one source has.
+    const auto value = std::get<0>(heap.top());
+    size_t most = 0;
+    while (!heap.empty() && std::get<0>(heap.top()) == value) {
+      auto [point, src, idx] = heap.top();
+      heap.pop();
+      auto& points = sources[src];
+      size_t run = 0;
+      for (; idx < points.size() && points[idx] == point; ++idx) ++run;
+      most = std::max(most, run);
+      if (idx < points.size()) heap.emplace(points[idx], src, idx);
+    }
+    for (size_t k = 0; k < most; ++k) out.push_back(value);
+  }
+  Stopwatch result(std::move(out), mode_in);
+  if (!tagged.empty()) result.retag_sections(tagged);
+  return result;
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::iterator::mode()
+    const noexcept {
   return iter_mode;
 }
 
-template <typename Duration, typename Clock>
-inline void Stopwatch<Duration, Clock>::iterator::mode(bool mode) noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline void Stopwatch<Duration, Clock, Storage>::iterator::mode(
+    bool mode) noexcept {
   iter_mode = mode;
 }
 
-template <typename Duration, typename Clock>
-inline Stopwatch<Duration, Clock>::iterator::iterator(
-    const typename Clock::time_point* const base_in,
-    const typename Clock::time_point* const ptr_in, bool mode_in) noexcept
-    : base(base_in), ptr(ptr_in), iter_mode(mode_in) {}
+template <typename Duration, typename Clock, typename Storage>
+inline Stopwatch<Duration, Clock, Storage>::iterator::iterator(
+    const Storage* const base_in, ptrdiff_t pos_in, bool mode_in,
+    typename Clock::duration cost_in) noexcept
+    : base(base_in), pos(pos_in), iter_mode(mode_in), cost(cost_in) {}
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator&
-Stopwatch<Duration, Clock>::iterator::operator++() noexcept {
-  ++ptr;
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator&
+Stopwatch<Duration, Clock, Storage>::iterator::operator++() noexcept {
+  ++pos;
   return *this;
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator
-Stopwatch<Duration, Clock>::iterator::operator++(int) noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator
+Stopwatch<Duration, Clock, Storage>::iterator::operator++(int) noexcept {
   auto temp(*this);
-  ++ptr;
+  ++pos;
   return temp;
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator&
-Stopwatch<Duration, Clock>::iterator::operator--() noexcept {
-  --ptr;
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator&
+Stopwatch<Duration, Clock, Storage>::iterator::operator--() noexcept {
+  --pos;
   return *this;
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator
-Stopwatch<Duration, Clock>::iterator::operator--(int) noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator
+Stopwatch<Duration, Clock, Storage>::iterator::operator--(int) noexcept {
   auto temp(*this);
-  --ptr;
+  --pos;
   return temp;
 }
 
-template <typename Duration, typename Clock>
-typename Duration::rep Stopwatch<Duration, Clock>::iterator::operator*() const {
-  const auto end = *std::next(ptr);
-  const auto begin = (iter_mode == SPLIT_MODE) ? *ptr : *base;
-  auto dur = std::chrono::duration_cast<Duration>(end - begin);
-  return dur.count();
+template <typename Duration, typename Clock, typename Storage>
+inline typename Duration::rep
+Stopwatch<Duration, Clock, Storage>::iterator::operator*() const {
+  return convert(raw());
+}
+
+template <typename Duration, typename Clock, typename Storage>
+typename Clock::rep Stopwatch<Duration, Clock, Storage>::iterator::raw()
+    const {
+  const auto idx = static_cast<size_t>(pos);
+  const auto end = (*base)[idx + 1];
+  const auto begin = (iter_mode == SPLIT_MODE) ? (*base)[idx] : base->front();
+  const auto splits = (iter_mode == SPLIT_MODE) ? 1 : idx + 1;
+  return correct(end - begin, cost, splits).count();
 }
 
-template <typename Duration, typename Clock>
-inline typename Duration::rep Stopwatch<Duration, Clock>::iterator::operator[](
+template <typename Duration, typename Clock, typename Storage>
+inline typename Duration::rep
+Stopwatch<Duration, Clock, Storage>::iterator::operator[](
     ptrdiff_t dist) const {
   return *(*this + dist);
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::iterator::operator==(
-    const typename Stopwatch<Duration, Clock>::iterator& other) const noexcept {
-  return ptr == other.ptr && base == other.base;
+template <typename Duration, typename Clock, typename Storage>
+template <typename Counter>
+inline uint64_t Stopwatch<Duration, Clock, Storage>::iterator::counter_delta(
+    Counter which) const {
+  const auto idx = static_cast<size_t>(pos);
+  const auto begin = (iter_mode == SPLIT_MODE) ? idx : 0;
+  return base->count(idx + 1, which) - base->count(begin, which);
+}
+
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::iterator::operator==(
+    const typename Stopwatch<Duration, Clock, Storage>::iterator& other)
+    const noexcept {
+  return pos == other.pos && base == other.base;
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::iterator::operator!=(
-    const typename Stopwatch<Duration, Clock>::iterator& other) const noexcept {
-  return ptr != other.ptr || base != other.base;
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::iterator::operator!=(
+    const typename Stopwatch<Duration, Clock, Storage>::iterator& other)
+    const noexcept {
+  return pos != other.pos || base != other.base;
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::iterator::operator<(
-    const typename Stopwatch<Duration, Clock>::iterator& other) const noexcept {
-  return other.ptr - ptr > 0 && base == other.base;
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::iterator::operator<(
+    const typename Stopwatch<Duration, Clock, Storage>::iterator& other)
+    const noexcept {
+  return other.pos - pos > 0 && base == other.base;
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::iterator::operator<=(
-    const typename Stopwatch<Duration, Clock>::iterator& other) const noexcept {
-  return other.ptr - ptr >= 0 && base == other.base;
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::iterator::operator<=(
+    const typename Stopwatch<Duration, Clock, Storage>::iterator& other)
+    const noexcept {
+  return other.pos - pos >= 0 && base == other.base;
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::iterator::operator>(
-    const typename Stopwatch<Duration, Clock>::iterator& other) const noexcept {
-  return ptr - other.ptr > 0 && base == other.base;
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::iterator::operator>(
+    const typename Stopwatch<Duration, Clock, Storage>::iterator& other)
+    const noexcept {
+  return pos - other.pos > 0 && base == other.base;
 }
 
-template <typename Duration, typename Clock>
-inline bool Stopwatch<Duration, Clock>::iterator::operator>=(
-    const typename Stopwatch<Duration, Clock>::iterator& other) const noexcept {
-  return ptr - other.base >= 0 && base == other.base;
+template <typename Duration, typename Clock, typename Storage>
+inline bool Stopwatch<Duration, Clock, Storage>::iterator::operator>=(
+    const typename Stopwatch<Duration, Clock, Storage>::iterator& other)
+    const noexcept {
+  return pos - other.pos >= 0 && base == other.base;
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator&
-Stopwatch<Duration, Clock>::iterator::operator+=(ptrdiff_t dist) noexcept {
-  ptr += dist;
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator&
+Stopwatch<Duration, Clock, Storage>::iterator::operator+=(
+    ptrdiff_t dist) noexcept {
+  pos += dist;
   return (*this);
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator&
-Stopwatch<Duration, Clock>::iterator::operator-=(ptrdiff_t dist) noexcept {
-  ptr -= dist;
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator&
+Stopwatch<Duration, Clock, Storage>::iterator::operator-=(
+    ptrdiff_t dist) noexcept {
+  pos -= dist;
   return (*this);
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator
-Stopwatch<Duration, Clock>::iterator::operator+(ptrdiff_t dist) const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator
+Stopwatch<Duration, Clock, Storage>::iterator::operator+(
+    ptrdiff_t dist) const noexcept {
   auto temp(*this);
   return temp += dist;
 }
 
-template <typename Duration, typename Clock>
-inline typename Stopwatch<Duration, Clock>::iterator
-Stopwatch<Duration, Clock>::iterator::operator-(ptrdiff_t dist) const noexcept {
+template <typename Duration, typename Clock, typename Storage>
+inline typename Stopwatch<Duration, Clock, Storage>::iterator
+Stopwatch<Duration, Clock, Storage>::iterator::operator-(
+    ptrdiff_t dist) const noexcept {
   auto temp(*this);
   return temp -= dist;
 }
 
-template <typename Duration, typename Clock>
-inline ptrdiff_t Stopwatch<Duration, Clock>::iterator::operator-(
-    const typename Stopwatch<Duration, Clock>::iterator& other) const {
+template <typename Duration, typename Clock, typename Storage>
+inline ptrdiff_t Stopwatch<Duration, Clock, Storage>::iterator::operator-(
+    const typename Stopwatch<Duration, Clock, Storage>::iterator& other) const {
   if (base != other.base) {
     throw std::runtime_error("Iterator base mismatch.");
   }
-  return ptr - other.ptr;
+  return pos - other.pos;
 }
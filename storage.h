@@ -0,0 +1,563 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of stopwatch storage containers.
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Whether Storage exposes its elements as one contiguous
+ * array through a data() member, like std::vector.
+ */
+template <typename Storage, typename = void>
+struct is_contiguous : std::false_type {};
+
+template <typename Storage>
+struct is_contiguous<
+    Storage, std::void_t<decltype(std::declval<const Storage&>().data())>>
+    : std::is_pointer<decltype(std::declval<const Storage&>().data())> {};
+
+/**
+ * Whether Storage draws its memory from an allocator,
+ * like std::vector and std::pmr::vector.
+ */
+template <typename Storage, typename = void>
+struct is_allocator_aware : std::false_type {};
+
+template <typename Storage>
+struct is_allocator_aware<Storage,
+                          std::void_t<typename Storage::allocator_type>>
+    : std::true_type {};
+
+/**
+ * Returns empty storage that allocates the way other does.
+ * Unlike copying, this keeps a memory resource or arena.
+ */
+template <typename Storage>
+Storage empty_like(const Storage& other);
+
+/**
+ * Returns a pool of free lists owned by the calling thread,
+ * for stopwatches created and destroyed at a high rate.
+ * Memory returned to it is reused, not freed, until the
+ * thread exits. Blocks must be released on the same thread.
+ */
+std::pmr::memory_resource* thread_pool() noexcept;
+
+/**
+ * Whether Storage can be resized in place, like std::vector.
+ */
+template <typename Storage, typename = void>
+struct is_resizable : std::false_type {};
+
+template <typename Storage>
+struct is_resizable<
+    Storage, std::void_t<decltype(std::declval<Storage&>().resize(size_t()))>>
+    : std::true_type {};
+
+/**
+ * Whether Storage reports the capacity it can fill
+ * without allocating, like std::vector.
+ */
+template <typename Storage, typename = void>
+struct has_capacity : std::false_type {};
+
+template <typename Storage>
+struct has_capacity<
+    Storage, std::void_t<decltype(std::declval<const Storage&>().capacity())>>
+    : std::true_type {};
+
+/**
+ * Whether Storage keeps every time point it is given at a
+ * stable index. Storage that overwrites or drops time points
+ * specializes this to false.
+ */
+template <typename Storage>
+struct keeps_every_point : std::true_type {};
+
+/**
+ * Whether the time points of two Storage can be interleaved.
+ * Storage that samples data at each record, which a merge
+ * could not carry over, specializes this to false.
+ */
+template <typename Storage>
+struct is_interleavable : std::true_type {};
+
+/**
+ * Whether Storage sorts its own time points with a sort()
+ * member, keeping data stored alongside each one in step.
+ */
+template <typename Storage, typename = void>
+struct has_sort : std::false_type {};
+
+template <typename Storage>
+struct has_sort<Storage,
+                std::void_t<decltype(std::declval<Storage&>().sort())>>
+    : std::true_type {};
+
+/**
+ * A random access const iterator over any container
+ * that supports indexed access by value. Used by
+ * storage containers that are not contiguous.
+ */
+template <typename Container>
+class index_iterator {
+ public:
+  // Standard iterator traits.
+
+  using iterator_category = std::random_access_iterator_tag;
+  using value_type = typename Container::value_type;
+  using difference_type = ptrdiff_t;
+  using pointer = const value_type*;
+  using reference = value_type;
+
+ private:
+  // Tracks the underlying container.
+  const Container* base;
+  // Tracks the index of the element pointed to by this iterator.
+  ptrdiff_t pos;
+
+ public:
+  // Constructor that gives the iterator all its member variables.
+  index_iterator(const Container* base_in, ptrdiff_t pos_in) noexcept
+      : base(base_in), pos(pos_in) {}
+
+  // Increment and decrement operators.
+
+  index_iterator& operator++() noexcept {
+    ++pos;
+    return *this;
+  }
+  index_iterator operator++(int) noexcept {
+    auto temp(*this);
+    ++pos;
+    return temp;
+  }
+  index_iterator& operator--() noexcept {
+    --pos;
+    return *this;
+  }
+  index_iterator operator--(int) noexcept {
+    auto temp(*this);
+    --pos;
+    return temp;
+  }
+
+  // Gives the element pointed to by this iterator.
+  value_type operator*() const { return (*base)[static_cast<size_t>(pos)]; }
+  value_type operator[](ptrdiff_t dist) const { return *(*this + dist); }
+
+  // Comparison operators.
+
+  bool operator==(const index_iterator& other) const noexcept {
+    return pos == other.pos && base == other.base;
+  }
+  bool operator!=(const index_iterator& other) const noexcept {
+    return pos != other.pos || base != other.base;
+  }
+  bool operator<(const index_iterator& other) const noexcept {
+    return pos < other.pos;
+  }
+  bool operator<=(const index_iterator& other) const noexcept {
+    return pos <= other.pos;
+  }
+  bool operator>(const index_iterator& other) const noexcept {
+    return pos > other.pos;
+  }
+  bool operator>=(const index_iterator& other) const noexcept {
+    return pos >= other.pos;
+  }
+
+  // Arithmetic operators.
+
+  index_iterator& operator+=(ptrdiff_t dist) noexcept {
+    pos += dist;
+    return *this;
+  }
+  index_iterator& operator-=(ptrdiff_t dist) noexcept {
+    pos -= dist;
+    return *this;
+  }
+  index_iterator operator+(ptrdiff_t dist) const noexcept {
+    auto temp(*this);
+    return temp += dist;
+  }
+  index_iterator operator-(ptrdiff_t dist) const noexcept {
+    auto temp(*this);
+    return temp -= dist;
+  }
+  ptrdiff_t operator-(const index_iterator& other) const noexcept {
+    return pos - other.pos;
+  }
+};
+
+/**
+ * What a fixed capacity buffer does with a new
+ * element when it is already full.
+ */
+enum class overflow {
+  // Overwrite the oldest element.
+  ring,
+  // Discard the new element.
+  drop
+};
+
+/**
+ * A fixed capacity container of N elements stored
+ * inline. Never allocates. When full, either acts
+ * as a ring buffer or drops new elements depending
+ * on the overflow policy. Compatible with Stopwatch.
+ */
+template <typename T, size_t N, overflow Policy = overflow::ring>
+class fixed_buffer {
+  static_assert(N >= 2, "Capacity must hold at least one duration.");
+
+ private:
+  // Inline element storage.
+  std::array<T, N> buffer;
+
+  // Physical index of the oldest element.
+  size_t head = 0;
+
+  // Number of stored elements.
+  size_t count = 0;
+
+ public:
+  using value_type = T;
+  using size_type = size_t;
+  using const_iterator = index_iterator<fixed_buffer>;
+  using iterator = const_iterator;
+
+  /**
+   * Storage is inline, so this is a no-op.
+   */
+  void reserve(size_t) noexcept {}
+
+  /**
+   * Returns the number of stored elements.
+   */
+  size_t size() const noexcept { return count; }
+
+  /**
+   * Returns whether or not there are stored elements.
+   */
+  bool empty() const noexcept { return count == 0; }
+
+  /**
+   * Returns the fixed capacity N.
+   */
+  static constexpr size_t capacity() noexcept { return N; }
+
+  /**
+   * Appends the element, applying the overflow
+   * policy if the buffer is full.
+   */
+  void emplace_back(const T& val) noexcept;
+
+  /**
+   * Alias for emplace_back.
+   */
+  void push_back(const T& val) noexcept { emplace_back(val); }
+
+  /**
+   * Delete all stored elements.
+   */
+  void clear() noexcept { head = count = 0; }
+
+  /**
+   * Unchecked access, oldest element first.
+   */
+  const T& operator[](size_t index) const noexcept;
+
+  /**
+   * Index-checked access, oldest element first.
+   */
+  const T& at(size_t index) const;
+
+  /**
+   * Returns the oldest element.
+   */
+  const T& front() const noexcept { return buffer[head]; }
+
+  /**
+   * Returns the newest element.
+   */
+  const T& back() const noexcept { return (*this)[count - 1]; }
+
+  // Iteration from oldest to newest element.
+
+  const_iterator begin() const noexcept { return const_iterator(this, 0); }
+  const_iterator end() const noexcept {
+    return const_iterator(this, static_cast<ptrdiff_t>(count));
+  }
+
+  /**
+   * Exchange contents with other.
+   */
+  void swap(fixed_buffer& other) noexcept;
+};
+
+// Full buffers overwrite or drop time points.
+template <typename T, size_t N, overflow Policy>
+struct keeps_every_point<fixed_buffer<T, N, Policy>> : std::false_type {};
+
+/**
+ * A container of time points that stores the first
+ * time point of every Block in full and the rest as
+ * fixed width Delta offsets from their block's base,
+ * so random access stays constant time. A time point
+ * whose offset does not fit in Delta, including a
+ * negative one from a clock that is not steady, is
+ * kept in full and rebases the rest of its block.
+ * Access into a rebased block is logarithmic in the
+ * number of rebases. Compatible with Stopwatch.
+ */
+template <typename TimePoint, typename Delta = uint32_t, size_t Block = 64>
+class delta_buffer {
+  static_assert(std::is_unsigned_v<Delta>, "Delta must be unsigned.");
+  static_assert(Block > 0 && (Block & (Block - 1)) == 0,
+                "Block must be a power of two.");
+
+ private:
+  using rep = typename TimePoint::rep;
+
+  // Marks a time point that is stored in outliers.
+  static constexpr Delta ESCAPE = std::numeric_limits<Delta>::max();
+
+  // Full tick count of the first time point in each block.
+  std::vector<rep> bases;
+
+  // Whether or not each block contains an outlier.
+  std::vector<bool> rebased;
+
+  // Offset of each time point from its block base or latest outlier.
+  std::vector<Delta> deltas;
+
+  // Index and full tick count of time points that did not fit.
+  std::vector<std::pair<size_t, rep>> outliers;
+
+  // Tick count that the next offset is taken from.
+  rep anchor = 0;
+
+ public:
+  using value_type = TimePoint;
+  using size_type = size_t;
+  using const_iterator = index_iterator<delta_buffer>;
+  using iterator = const_iterator;
+
+  /**
+   * Reserve room for the given number of time points.
+   */
+  void reserve(size_t res);
+
+  /**
+   * Returns the number of stored time points.
+   */
+  size_t size() const noexcept { return deltas.size(); }
+
+  /**
+   * Returns whether or not there are stored time points.
+   */
+  bool empty() const noexcept { return deltas.empty(); }
+
+  /**
+   * Appends the time point.
+   */
+  void emplace_back(const TimePoint& val);
+
+  /**
+   * Alias for emplace_back.
+   */
+  void push_back(const TimePoint& val) { emplace_back(val); }
+
+  /**
+   * Delete all stored time points.
+   */
+  void clear() noexcept;
+
+  /**
+   * Unchecked access, decoding the time point.
+   */
+  TimePoint operator[](size_t index) const;
+
+  /**
+   * Index-checked access, decoding the time point.
+   */
+  TimePoint at(size_t index) const;
+
+  /**
+   * Returns the first time point.
+   */
+  TimePoint front() const { return (*this)[0]; }
+
+  /**
+   * Returns the last time point.
+   */
+  TimePoint back() const { return (*this)[size() - 1]; }
+
+  // Iteration in insertion order.
+
+  const_iterator begin() const noexcept { return const_iterator(this, 0); }
+  const_iterator end() const noexcept {
+    return const_iterator(this, static_cast<ptrdiff_t>(size()));
+  }
+
+  /**
+   * Returns the number of heap bytes used by the encoding.
+   */
+  size_t footprint() const noexcept;
+
+  /**
+   * Exchange contents with other.
+   */
+  void swap(delta_buffer& other) noexcept;
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Storage>
+inline Storage empty_like(const Storage& other) {
+  if constexpr (is_allocator_aware<Storage>::value) {
+    return Storage(other.get_allocator());
+  } else {
+    static_cast<void>(other);
+    return Storage();
+  }
+}
+
+inline std::pmr::memory_resource* thread_pool() noexcept {
+  thread_local std::pmr::unsynchronized_pool_resource pool;
+  return &pool;
+}
+
+template <typename T, size_t N, overflow Policy>
+inline void fixed_buffer<T, N, Policy>::emplace_back(const T& val) noexcept {
+  if (count < N) {
+    buffer[count++] = val;
+  } else if constexpr (Policy == overflow::ring) {
+    buffer[head] = val;
+    if (++head == N) head = 0;
+  }
+}
+
+template <typename T, size_t N, overflow Policy>
+inline const T& fixed_buffer<T, N, Policy>::operator[](
+    size_t index) const noexcept {
+  if constexpr (Policy == overflow::ring) {
+    // Avoid modulus on the common path.
+    index += head;
+    if (index >= N) index -= N;
+  }
+  return buffer[index];
+}
+
+template <typename T, size_t N, overflow Policy>
+inline const T& fixed_buffer<T, N, Policy>::at(size_t index) const {
+  if (index >= count) {
+    throw std::out_of_range("Fixed buffer index out of range.");
+  }
+  return (*this)[index];
+}
+
+template <typename T, size_t N, overflow Policy>
+inline void fixed_buffer<T, N, Policy>::swap(fixed_buffer& other) noexcept {
+  std::swap(buffer, other.buffer);
+  std::swap(head, other.head);
+  std::swap(count, other.count);
+}
+
+template <typename TimePoint, typename Delta, size_t Block>
+inline void delta_buffer<TimePoint, Delta, Block>::reserve(size_t res) {
+  bases.reserve(res / Block + 1);
+  rebased.reserve(res / Block + 1);
+  deltas.reserve(res);
+}
+
+template <typename TimePoint, typename Delta, size_t Block>
+inline void delta_buffer<TimePoint, Delta, Block>::emplace_back(
+    const TimePoint& val) {
+  const auto ticks = val.time_since_epoch().count();
+  const auto index = deltas.size();
+  if ((index & (Block - 1)) == 0) {
+    bases.push_back(ticks);
+    rebased.push_back(false);
+    anchor = ticks;
+  }
+  const auto offset = ticks - anchor;
+  if (offset >= 0 && static_cast<uint64_t>(offset) < ESCAPE) {
+    deltas.push_back(static_cast<Delta>(offset));
+  } else {
+    deltas.push_back(ESCAPE);
+    outliers.emplace_back(index, ticks);
+    rebased.back() = true;
+    anchor = ticks;
+  }
+}
+
+template <typename TimePoint, typename Delta, size_t Block>
+inline void delta_buffer<TimePoint, Delta, Block>::clear() noexcept {
+  bases.clear();
+  rebased.clear();
+  deltas.clear();
+  outliers.clear();
+  anchor = 0;
+}
+
+template <typename TimePoint, typename Delta, size_t Block>
+inline TimePoint delta_buffer<TimePoint, Delta, Block>::operator[](
+    size_t index) const {
+  using duration = typename TimePoint::duration;
+  const auto delta = deltas[index];
+  const auto block = index / Block;
+  if (!rebased[block]) {
+    return TimePoint(duration(bases[block] + static_cast<rep>(delta)));
+  }
+  // Outliers are appended in index order. Find the latest one at or
+  // before index, which is this time point itself if it escaped.
+  auto iter = std::upper_bound(
+      outliers.begin(), outliers.end(), index,
+      [](size_t idx, const auto& outlier) { return idx < outlier.first; });
+  if (delta == ESCAPE) return TimePoint(duration(std::prev(iter)->second));
+  const bool before = iter == outliers.begin() ||
+                      std::prev(iter)->first < block * Block;
+  const auto from = before ? bases[block] : std::prev(iter)->second;
+  return TimePoint(duration(from + static_cast<rep>(delta)));
+}
+
+template <typename TimePoint, typename Delta, size_t Block>
+inline TimePoint delta_buffer<TimePoint, Delta, Block>::at(size_t index) const {
+  if (index >= size()) {
+    throw std::out_of_range("Delta buffer index out of range.");
+  }
+  return (*this)[index];
+}
+
+template <typename TimePoint, typename Delta, size_t Block>
+inline size_t delta_buffer<TimePoint, Delta, Block>::footprint()
+    const noexcept {
+  return bases.capacity() * sizeof(rep) + rebased.capacity() / 8 +
+         deltas.capacity() * sizeof(Delta) +
+         outliers.capacity() * sizeof(std::pair<size_t, rep>);
+}
+
+template <typename TimePoint, typename Delta, size_t Block>
+inline void delta_buffer<TimePoint, Delta, Block>::swap(
+    delta_buffer& other) noexcept {
+  bases.swap(other.bases);
+  rebased.swap(other.rebased);
+  deltas.swap(other.deltas);
+  outliers.swap(other.outliers);
+  std::swap(anchor, other.anchor);
+}
@@ -0,0 +1,138 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of constant memory stopwatch.
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <utility>
+#include "statistics.h"
+#include "stopwatch.h"
+
+/**
+ * A stopwatch that does not store time points.
+ * Keeps only the last recorded time point and
+ * feeds each split into a Sink, so memory per
+ * instance is constant. By default, the Sink
+ * is running Statistics of the splits.
+ * Sink requires add(Duration::rep), clear(),
+ * and operator+=.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock,
+          typename Sink = Statistics<Duration>>
+class StreamingStopwatch {
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // Receives every split.
+  Sink splits;
+
+  // The most recently recorded time point.
+  typename Clock::time_point last;
+
+  // Whether or not any time point has been recorded.
+  bool started = false;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Basic default constructor. Optional
+   * argument to initialize the sink.
+   */
+  explicit StreamingStopwatch(Sink sink_in = Sink());
+
+  /**
+   * Records the current time measurement and
+   * adds the split since the previous one.
+   */
+  void record();
+
+  /**
+   * Returns the sink that received all splits.
+   */
+  const Sink& sink() const noexcept;
+
+  /**
+   * Returns the most recently recorded time point.
+   * THROWS: if nothing has been recorded.
+   */
+  typename Clock::time_point data() const;
+
+  /**
+   * Forget the last time point and clear the sink.
+   */
+  void clear() noexcept;
+
+  /**
+   * Combines the split summaries of other into this.
+   * Unlike Stopwatch interleaving, splits are not
+   * recomputed across the two sets of time points.
+   */
+  StreamingStopwatch& operator+=(const StreamingStopwatch&);
+
+  /**
+   * Returns a new StreamingStopwatch with combined splits.
+   */
+  StreamingStopwatch operator+(const StreamingStopwatch&) const;
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration, typename Clock, typename Sink>
+inline StreamingStopwatch<Duration, Clock, Sink>::StreamingStopwatch(
+    Sink sink_in)
+    : splits(std::move(sink_in)) {}
+
+template <typename Duration, typename Clock, typename Sink>
+inline void StreamingStopwatch<Duration, Clock, Sink>::record() {
+  const auto now = Clock::now();
+  if (started) {
+    splits.add(
+        clock_traits<Clock>::template convert<Duration>(now - last).count());
+  }
+  last = now;
+  started = true;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline const Sink& StreamingStopwatch<Duration, Clock, Sink>::sink()
+    const noexcept {
+  return splits;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline typename Clock::time_point
+StreamingStopwatch<Duration, Clock, Sink>::data() const {
+  if (!started) throw std::out_of_range("No time point has been recorded.");
+  return last;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+inline void StreamingStopwatch<Duration, Clock, Sink>::clear() noexcept {
+  splits.clear();
+  started = false;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+StreamingStopwatch<Duration, Clock, Sink>&
+StreamingStopwatch<Duration, Clock, Sink>::operator+=(
+    const StreamingStopwatch<Duration, Clock, Sink>& other) {
+  splits += other.splits;
+  if (other.started) {
+    last = started ? std::max(last, other.last) : other.last;
+    started = true;
+  }
+  return *this;
+}
+
+template <typename Duration, typename Clock, typename Sink>
+StreamingStopwatch<Duration, Clock, Sink>
+StreamingStopwatch<Duration, Clock, Sink>::operator+(
+    const StreamingStopwatch<Duration, Clock, Sink>& other) const {
+  auto temp(*this);
+  return temp += other;
+}
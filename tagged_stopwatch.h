@@ -0,0 +1,331 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of column stored tagged stopwatch.
+*/
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "perf_counters.h"
+#include "section.h"
+#include "simd.h"
+#include "stopwatch.h"
+
+/**
+ * Returns a small index for the calling thread,
+ * assigned in order of first call, starting at zero.
+ */
+uint32_t this_thread_index() noexcept;
+
+/**
+ * A stopwatch that tags every time point with a section id
+ * and a thread index, and optionally samples the hardware
+ * counters Events. Each channel is stored in its own column,
+ * so pure time iteration only reads time points, and section
+ * or thread filtering only adds the matching id column.
+ * Filters are vectorized with a masked compress where
+ * available. Split i ends at time point i + 1 and takes that
+ * time point's tags. Counters only count the thread that
+ * built the stopwatch.
+ */
+template <typename Duration = std::chrono::milliseconds,
+          typename Clock = std::chrono::steady_clock, counter... Events>
+class TaggedStopwatch {
+ public:
+  using time_point = typename Clock::time_point;
+  using rep = typename Duration::rep;
+
+  // Number of counter columns.
+  static constexpr size_t COUNTERS = sizeof...(Events);
+
+ private:
+  /* --- MEMBER VARIABLES --- */
+
+  // The sampled counters, in column order.
+  static constexpr std::array<counter, COUNTERS> events{Events...};
+
+  // One column per channel, all of the same length.
+  std::vector<time_point> points;
+  std::vector<section_id> tags;
+  std::vector<uint32_t> threads;
+  std::array<std::vector<uint64_t>, COUNTERS> counts;
+
+  // The open counters, if any are sampled.
+  std::shared_ptr<perf_group> group;
+
+  // Converts n raw tick counts at out to Duration in place.
+  static void convert_ticks(rep* out, size_t n) noexcept;
+
+  // Converts and filters splits whose key column matches.
+  size_t filter_into(const std::vector<uint32_t>& keys, uint32_t key,
+                     rep* out) const;
+
+ public:
+  /* --- PUBLIC INTERFACE --- */
+
+  /**
+   * Reserves every column for res time points,
+   * and opens the counters for the calling thread.
+   */
+  explicit TaggedStopwatch(size_t res = 0);
+
+  /**
+   * Records the current time, tagged with the section id and
+   * the calling thread, then samples the counters.
+   */
+  void record(section_id tag = 0);
+
+  /**
+   * Appends a time point with the given tags, such as from a
+   * replayed trace. Its counters are zero.
+   * REQUIRES: point is no earlier than the last time point.
+   */
+  void append(time_point point, section_id tag, uint32_t thread);
+
+  /**
+   * Returns the number of splits.
+   */
+  size_t size() const noexcept;
+
+  /**
+   * Returns the time point, section id, and thread index columns.
+   */
+  const std::vector<time_point>& time_points() const noexcept;
+  const std::vector<section_id>& sections() const noexcept;
+  const std::vector<uint32_t>& thread_indices() const noexcept;
+
+  /**
+   * Returns the column of counter values.
+   * THROWS: if the counter is not sampled.
+   */
+  const std::vector<uint64_t>& counts_of(counter which) const;
+
+  /**
+   * Index-checked access into splits.
+   */
+  rep operator[](size_t index) const;
+
+  /**
+   * Writes every split to out, reading only time points.
+   * REQUIRES: out holds size() reps.
+   */
+  void splits_into(rep* out) const;
+
+  /**
+   * Writes the splits tagged with the section id to out,
+   * in order. Returns the number of splits written.
+   * REQUIRES: out holds size() reps.
+   */
+  size_t section_splits_into(section_id id, rep* out) const;
+
+  /**
+   * Same as section_splits_into, for splits ending on a thread.
+   */
+  size_t thread_splits_into(uint32_t thread, rep* out) const;
+
+  /**
+   * Feeds each split tagged with the section id into sink.
+   * Sink may be Statistics or Histogram.
+   */
+  template <typename Sink>
+  Sink section(section_id id, Sink sink = Sink()) const;
+
+  /**
+   * Returns the change in the counter over split index.
+   * THROWS: if the counter is not sampled or index is out of range.
+   */
+  uint64_t counter_delta(size_t index, counter which) const;
+
+  /**
+   * Returns an ordinary Stopwatch of the time points.
+   */
+  Stopwatch<Duration, Clock> untagged(
+      bool mode = Stopwatch<Duration, Clock>::SPLIT_MODE) const;
+
+  /**
+   * Delete every time point and its tags.
+   */
+  void clear() noexcept;
+};
+
+/* --- IMPLEMENTATION --- */
+
+inline uint32_t this_thread_index() noexcept {
+  static std::atomic<uint32_t> next{0};
+  thread_local const uint32_t index = next++;
+  return index;
+}
+
+template <typename Duration, typename Clock, counter... Events>
+TaggedStopwatch<Duration, Clock, Events...>::TaggedStopwatch(size_t res) {
+  points.reserve(res);
+  tags.reserve(res);
+  threads.reserve(res);
+  for (auto& column : counts) column.reserve(res);
+  if constexpr (COUNTERS > 0) {
+    group = std::make_shared<perf_group>(events.data(), COUNTERS);
+  }
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline void TaggedStopwatch<Duration, Clock, Events...>::record(
+    section_id tag) {
+  points.emplace_back(Clock::now());
+  tags.push_back(tag);
+  threads.push_back(this_thread_index());
+  if constexpr (COUNTERS > 0) {
+    std::array<uint64_t, COUNTERS> values;
+    group->read(values.data());
+    for (size_t c = 0; c < COUNTERS; ++c) counts[c].push_back(values[c]);
+  }
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline void TaggedStopwatch<Duration, Clock, Events...>::append(
+    time_point point, section_id tag, uint32_t thread) {
+  points.push_back(point);
+  tags.push_back(tag);
+  threads.push_back(thread);
+  for (auto& column : counts) column.push_back(0);
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline size_t TaggedStopwatch<Duration, Clock, Events...>::size()
+    const noexcept {
+  return points.empty() ? 0 : points.size() - 1;
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline const std::vector<typename Clock::time_point>&
+TaggedStopwatch<Duration, Clock, Events...>::time_points() const noexcept {
+  return points;
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline const std::vector<section_id>&
+TaggedStopwatch<Duration, Clock, Events...>::sections() const noexcept {
+  return tags;
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline const std::vector<uint32_t>&
+TaggedStopwatch<Duration, Clock, Events...>::thread_indices() const noexcept {
+  return threads;
+}
+
+template <typename Duration, typename Clock, counter... Events>
+const std::vector<uint64_t>&
+TaggedStopwatch<Duration, Clock, Events...>::counts_of(counter which) const {
+  for (size_t c = 0; c < COUNTERS; ++c) {
+    if (events[c] == which) return counts[c];
+  }
+  throw std::invalid_argument("Counter is not sampled.");
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline typename Duration::rep
+TaggedStopwatch<Duration, Clock, Events...>::operator[](size_t index) const {
+  if (index >= size()) throw std::out_of_range("Split index out of range.");
+  return clock_traits<Clock>::template convert<Duration>(points[index + 1] -
+                                                         points[index])
+      .count();
+}
+
+template <typename Duration, typename Clock, counter... Events>
+void TaggedStopwatch<Duration, Clock, Events...>::splits_into(rep* out) const {
+  const auto n = size();
+  if (n == 0) return;
+  if constexpr (std::is_same_v<rep, typename Clock::rep>) {
+    split_ticks(points.data(), n, out);
+    convert_ticks(out, n);
+  } else {
+    for (size_t i = 0; i < n; ++i) out[i] = (*this)[i];
+  }
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline void TaggedStopwatch<Duration, Clock, Events...>::convert_ticks(
+    rep* out, size_t n) noexcept {
+  using clock_duration = typename Clock::duration;
+  if constexpr (!std::is_same_v<Duration, clock_duration>) {
+    for (size_t i = 0; i < n; ++i) {
+      out[i] = clock_traits<Clock>::template convert<Duration>(
+                   clock_duration(out[i]))
+                   .count();
+    }
+  } else {
+    static_cast<void>(out);
+    static_cast<void>(n);
+  }
+}
+
+template <typename Duration, typename Clock, counter... Events>
+size_t TaggedStopwatch<Duration, Clock, Events...>::filter_into(
+    const std::vector<uint32_t>& keys, uint32_t key, rep* out) const {
+  const auto n = size();
+  if (n == 0) return 0;
+  if constexpr (std::is_same_v<rep, typename Clock::rep>) {
+    // The key of split i is the key of time point i + 1.
+    const auto count =
+        filter_split_ticks(points.data(), keys.data() + 1, n, key, out);
+    convert_ticks(out, count);
+    return count;
+  } else {
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (keys[i + 1] == key) out[count++] = (*this)[i];
+    }
+    return count;
+  }
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline size_t TaggedStopwatch<Duration, Clock, Events...>::section_splits_into(
+    section_id id, rep* out) const {
+  return filter_into(tags, id, out);
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline size_t TaggedStopwatch<Duration, Clock, Events...>::thread_splits_into(
+    uint32_t thread, rep* out) const {
+  return filter_into(threads, thread, out);
+}
+
+template <typename Duration, typename Clock, counter... Events>
+template <typename Sink>
+Sink TaggedStopwatch<Duration, Clock, Events...>::section(section_id id,
+                                                          Sink sink) const {
+  std::vector<rep> splits(size());
+  const auto count = section_splits_into(id, splits.data());
+  for (size_t i = 0; i < count; ++i) sink.add(splits[i]);
+  return sink;
+}
+
+template <typename Duration, typename Clock, counter... Events>
+uint64_t TaggedStopwatch<Duration, Clock, Events...>::counter_delta(
+    size_t index, counter which) const {
+  if (index >= size()) throw std::out_of_range("Split index out of range.");
+  const auto& column = counts_of(which);
+  return column[index + 1] - column[index];
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline Stopwatch<Duration, Clock>
+TaggedStopwatch<Duration, Clock, Events...>::untagged(bool mode) const {
+  return Stopwatch<Duration, Clock>(points, mode);
+}
+
+template <typename Duration, typename Clock, counter... Events>
+inline void TaggedStopwatch<Duration, Clock, Events...>::clear() noexcept {
+  points.clear();
+  tags.clear();
+  threads.clear();
+  for (auto& column : counts) column.clear();
+}
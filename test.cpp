@@ -5,14 +5,39 @@ Unit testing for stopwatch class.
 */
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <memory_resource>
 #include <numeric>
+#include <optional>
 #include <random>
+#include <sstream>
 #include <thread>
 #include <type_traits>
+#include "analysis.h"
+#include "archive.h"
+#include "async_stopwatch.h"
+#include "concurrent_stopwatch.h"
+#include "export_sinks.h"
 #include "framework.h"
+#include "histogram.h"
+#include "instrument.h"
+#include "perf_counters.h"
+#include "resumable_stopwatch.h"
+#include "rolling_window.h"
+#include "sampled_stopwatch.h"
+#include "statistics.h"
 #include "stopwatch.h"
+#include "streaming_stopwatch.h"
+#include "tagged_stopwatch.h"
+#include "trace_export.h"
+#include "tsc_clock.h"
+#include "virtual_clock.h"
 using std::array;
 using std::bind;
 using std::cout;
@@ -25,6 +50,7 @@ using std::ios_base;
 using std::is_integral_v;
 using std::is_sorted;
 using std::partial_sum;
+using std::string;
 using std::uniform_int_distribution;
 using std::vector;
 using std::chrono::duration_cast;
@@ -36,7 +62,10 @@ using std::this_thread::sleep_for;
 // WARNING: nanoseconds is too fine grained for sleep_for.
 using time_unit = std::chrono::milliseconds;
 
-// The margin of error we are willing to accept.
+// Advanced manually, so splits are exact and tests never sleep.
+using test_clock = virtual_clock<>;
+
+// The margin of error we are willing to accept from real clocks.
 static constexpr time_unit::rep epsilon = 2;
 
 /**
@@ -63,10 +92,12 @@ void print_range(const Container&);
 /**
  * Return a stop watch with record called
  * at the given time intervals in the given mode.
+ * Advances virtual clocks, and sleeps between
+ * records for every other clock.
  */
-template <typename Times>
-Stopwatch<time_unit> recorded(const Times&,
-                              bool mode = Stopwatch<>::SPLIT_MODE);
+template <typename Clock = test_clock, typename Times>
+Stopwatch<time_unit, Clock> recorded(const Times&,
+                                     bool mode = Stopwatch<>::SPLIT_MODE);
 
 // Unit tests for stopwatch.
 namespace Test {
@@ -78,6 +109,34 @@ void test_compare();
 void test_arithmetic();
 void test_data();
 void test_interleave();
+void test_tsc_clock();
+void test_fixed();
+void test_concurrent();
+void test_statistics();
+void test_histogram();
+void test_bulk();
+void test_compact();
+void test_archive();
+void test_merge();
+void test_section();
+void test_overhead();
+void test_prefix();
+void test_perf();
+void test_async();
+void test_trace();
+void test_conversion();
+void test_sampling();
+void test_unsorted();
+void test_domain();
+void test_bench();
+void test_registry();
+void test_virtual_clock();
+void test_tagged();
+void test_allocator();
+void test_rolling();
+void test_resumable();
+void test_analysis();
+void test_instrument();
 }  // namespace Test
 
 int main() {
@@ -92,8 +151,36 @@ int main() {
   fr.emplace("arithmetic", Test::test_arithmetic);
   fr.emplace("data", Test::test_data);
   fr.emplace("interleave", Test::test_interleave);
+  fr.emplace("tsc clock", Test::test_tsc_clock, Framework::SERIAL);
+  fr.emplace("fixed", Test::test_fixed);
+  fr.emplace("concurrent", Test::test_concurrent);
+  fr.emplace("statistics", Test::test_statistics);
+  fr.emplace("histogram", Test::test_histogram);
+  fr.emplace("bulk", Test::test_bulk);
+  fr.emplace("compact", Test::test_compact);
+  fr.emplace("archive", Test::test_archive);
+  fr.emplace("merge", Test::test_merge);
+  fr.emplace("section", Test::test_section);
+  fr.emplace("overhead", Test::test_overhead, Framework::SERIAL);
+  fr.emplace("prefix", Test::test_prefix, Framework::SERIAL);
+  fr.emplace("perf", Test::test_perf);
+  fr.emplace("async", Test::test_async);
+  fr.emplace("trace", Test::test_trace);
+  fr.emplace("conversion", Test::test_conversion);
+  fr.emplace("sampling", Test::test_sampling);
+  fr.emplace("unsorted", Test::test_unsorted);
+  fr.emplace("domain", Test::test_domain);
+  fr.emplace("bench", Test::test_bench, Framework::SERIAL);
+  fr.emplace("registry", Test::test_registry);
+  fr.emplace("virtual clock", Test::test_virtual_clock);
+  fr.emplace("tagged", Test::test_tagged);
+  fr.emplace("allocator", Test::test_allocator);
+  fr.emplace("rolling", Test::test_rolling);
+  fr.emplace("resumable", Test::test_resumable);
+  fr.emplace("analysis", Test::test_analysis);
+  fr.emplace("instrument", Test::test_instrument);
 
-  fr.run_all();
+  fr.run_all(std::max(1u, std::thread::hardware_concurrency()));
   cout << fr << "Passed " << fr.passed() << " out of " << fr.executed_size()
        << " tests.\n";
 }
@@ -101,8 +188,8 @@ int main() {
 template <typename T, size_t N>
 array<T, N> randint_sample(T a, T b) {
   static_assert(is_integral_v<T>, "Integer type required.");
-  static const auto seed = system_clock::now().time_since_epoch().count();
-  static default_random_engine gen(seed);
+  // Seeded identically on every thread, so runs are reproducible.
+  thread_local default_random_engine gen(2020);
 
   uniform_int_distribution<T> distr(a, b);
   array<T, N> arr;
@@ -121,12 +208,16 @@ void print_range(const Container& items) {
   cout << '\n';
 }
 
-template <typename Times>
-Stopwatch<time_unit> recorded(const Times& times, bool mode) {
-  Stopwatch<time_unit> sw(times.size(), mode);
+template <typename Clock, typename Times>
+Stopwatch<time_unit, Clock> recorded(const Times& times, bool mode) {
+  Stopwatch<time_unit, Clock> sw(times.size(), mode);
   sw.record();
   for (const auto t : times) {
-    sleep_for(time_unit(t));
+    if constexpr (std::is_same_v<Clock, test_clock>) {
+      Clock::advance(time_unit(t));
+    } else {
+      sleep_for(time_unit(t));
+    }
     sw.record();
   }
   return sw;
@@ -171,12 +262,24 @@ void Test::test_split() {
   assert_eq(sw.size(), times.size(), "Stopwatch is missing measurements.");
 
   assert_true(equal(times.begin(), times.end(), sw.begin(),
-                    bind(approx, _1, _2, epsilon)),
+                    [](auto t, auto split) { return split == t; }),
               "Stopwatch splits are inaccurate.");
 
   for (size_t i = 0; i < sw.size(); ++i) {
-    assert_true(approx(sw[i], times[i], epsilon),
-                "Stopwatch splits don't match iteration.");
+    assert_eq(sw[i], times[i], "Stopwatch splits don't match iteration.");
+  }
+
+  // Virtual time is exact even at nanosecond resolution.
+  using std::chrono::nanoseconds;
+  Stopwatch<nanoseconds, test_clock> nano;
+  nano.record();
+  for (const auto t : times) {
+    test_clock::advance(nanoseconds(t));
+    nano.record();
+  }
+  for (size_t i = 0; i < nano.size(); ++i) {
+    assert_eq(nano[i], static_cast<nanoseconds::rep>(times[i]),
+              "Nanosecond splits are inaccurate.");
   }
 }
 
@@ -191,10 +294,8 @@ void Test::test_elapsed() {
             "Stopwatch should be in elapse mode.");
   assert_eq(sw.size(), times.size(), "Stopwatch is missing measurements.");
 
-  // Error bounds grow as we increase.
   for (size_t i = 0; i < sw.size(); ++i) {
-    assert_true(approx(sw[i], partials[i], epsilon * (i + 1)),
-                "Stopwatch elapses are inaccurate.");
+    assert_eq(sw[i], partials[i], "Stopwatch elapses are inaccurate.");
   }
 }
 
@@ -358,3 +459,1912 @@ void Test::test_interleave() {
   assert_true(is_sorted(sw_b.data().begin(), sw_b.data().end()),
               "Stopwatch data is not sorted.");
 }
+
+void Test::test_tsc_clock() {
+  using std::chrono::microseconds;
+  using std::chrono::steady_clock;
+  bool refused = false;
+  try {
+    tsc_clock::calibrate_now();
+  } catch (const std::runtime_error& err) {
+    refused = true;
+  }
+  assert_eq(refused, !tsc_clock::invariant(),
+            "Calibration should only refuse a variant counter.");
+  // Sleeps overshoot by milliseconds on a busy host, so the counter is
+  // checked against steady_clock read at the same moments instead.
+  vector<tsc_clock::time_point> counter_points;
+  vector<steady_clock::time_point> steady_points;
+  const auto read_both = [&] {
+    tsc_clock::time_point before, after;
+    steady_clock::time_point between;
+    // Retry if preempted between the readings.
+    do {
+      before = tsc_clock::now();
+      between = steady_clock::now();
+      after = tsc_clock::now();
+    } while (tsc_clock::to_duration<microseconds>(after - before) >
+             microseconds(5));
+    counter_points.push_back(before);
+    steady_points.push_back(between);
+  };
+  const auto times = randint_sample<unsigned, 10>(10, 30);
+  read_both();
+  for (const auto t : times) {
+    sleep_for(time_unit(t));
+    read_both();
+  }
+  const Stopwatch<microseconds, tsc_clock> sw(counter_points);
+  const Stopwatch<microseconds> reference(steady_points);
+  assert_eq(sw.size(), times.size(), "Stopwatch is missing measurements.");
+  assert_true(is_sorted(sw.data().begin(), sw.data().end()),
+              "Counter readings are not monotonic.");
+
+  auto iter = sw.begin();
+  for (size_t i = 0; i < sw.size(); ++i, ++iter) {
+    // Calibration is within 0.1%, and each reading within 5 us.
+    const auto margin = 10 + reference[i] / 1000;
+    assert_less(std::abs(sw[i] - reference[i]), margin,
+                "Counter splits are inaccurate.");
+    assert_eq(*iter, sw[i], "Counter splits don't match iteration.");
+  }
+}
+
+void Test::test_fixed() {
+  using std::chrono::nanoseconds;
+  FixedStopwatch<8, nanoseconds> ring;
+  FixedStopwatch<8, nanoseconds, std::chrono::steady_clock, overflow::drop>
+      drop;
+  vector<decltype(ring.data(0))> ring_points, drop_points;
+  for (unsigned i = 0; i < 20; ++i) {
+    ring.record();
+    drop.record();
+    ring_points.push_back(ring.data().back());
+    drop_points.push_back(drop.data(drop.data_size() - 1));
+    assert_eq(ring.data_size(), std::min(i + 1, 8u),
+              "Fixed stopwatch size is incorrect.");
+  }
+  assert_eq(ring.size(), static_cast<size_t>(7), "Ring should be full.");
+  assert_eq(drop.size(), static_cast<size_t>(7), "Drop should be full.");
+
+  assert_true(equal(ring.data().begin(), ring.data().end(),
+                    ring_points.end() - 8),
+              "Ring stopwatch should keep its newest points.");
+  assert_true(equal(drop.data().begin(), drop.data().end(),
+                    drop_points.begin()),
+              "Drop stopwatch should keep its oldest points.");
+
+  for (size_t i = 0; i < ring.size(); ++i) {
+    const auto& pts = ring_points;
+    const auto split = pts[i + 13] - pts[i + 12];
+    const auto elapse = pts[i + 13] - pts[12];
+    assert_eq(ring[i], duration_cast<nanoseconds>(split).count(),
+              "Ring split is incorrect.");
+    assert_eq(ring.begin()[static_cast<ptrdiff_t>(i)], ring[i],
+              "Ring iterator does not match index.");
+    ring.mode(Stopwatch<>::ELAPSE_MODE);
+    assert_eq(ring[i], duration_cast<nanoseconds>(elapse).count(),
+              "Ring elapse is incorrect.");
+    ring.mode(Stopwatch<>::SPLIT_MODE);
+  }
+  assert_eq(distance(ring.begin(), ring.end()), 7,
+            "Ring stopwatch has wrong range.");
+
+  ring.clear();
+  assert_true(ring.empty(), "Nonempty ring stopwatch after clear.");
+  assert_eq(ring.begin(), ring.end(), "Empty ring stopwatch has no range.");
+}
+
+void Test::test_concurrent() {
+  constexpr unsigned workers = 4;
+  constexpr unsigned records = 500;
+  ConcurrentStopwatch<time_unit> csw(records);
+  csw.record();
+
+  vector<std::thread> pool;
+  for (unsigned i = 0; i < workers; ++i) {
+    pool.emplace_back([&csw] {
+      for (unsigned j = 0; j < records; ++j) csw.record();
+    });
+  }
+  for (auto& th : pool) th.join();
+  assert_eq(csw.threads(), workers + 1, "Each thread should have a buffer.");
+  assert_eq(csw.data_size(), workers * records + 1,
+            "Concurrent stopwatch is missing measurements.");
+
+  const auto sw = csw.merged(Stopwatch<>::ELAPSE_MODE);
+  assert_eq(sw.data_size(), csw.data_size(), "Merge lost measurements.");
+  assert_eq(sw.mode(), Stopwatch<>::ELAPSE_MODE,
+            "Merged stopwatch should be in elapse mode.");
+  assert_true(is_sorted(sw.data().begin(), sw.data().end()),
+              "Merged stopwatch data is not sorted.");
+
+  csw.clear();
+  assert_eq(csw.data_size(), static_cast<size_t>(0),
+            "Concurrent stopwatch should be empty after clear.");
+  csw.record();
+  assert_eq(csw.threads(), workers + 1, "Thread buffers are reused.");
+  assert_eq(csw.data_size(), static_cast<size_t>(1),
+            "Only the new measurement should remain.");
+
+  // Short-lived instances between records into csw must not
+  // disturb the lane this thread keeps in csw.
+  for (unsigned i = 0; i < 100; ++i) {
+    ConcurrentStopwatch<time_unit> brief;
+    brief.record();
+    brief.record();
+    assert_eq(brief.threads(), static_cast<size_t>(1),
+              "A new instance should get a new buffer.");
+    assert_eq(brief.data_size(), static_cast<size_t>(2),
+              "A new instance should start empty.");
+    csw.record();
+  }
+  assert_eq(csw.threads(), workers + 1, "Thread buffers outlive others.");
+  assert_eq(csw.data_size(), static_cast<size_t>(101),
+            "Records should reach the surviving buffer.");
+
+  // Alternating instances each keep a single lane for this thread.
+  ConcurrentStopwatch<time_unit> left, right;
+  for (unsigned i = 0; i < records; ++i) {
+    left.record();
+    right.record();
+  }
+  assert_eq(left.threads() + right.threads(), static_cast<size_t>(2),
+            "Alternating instances should not add buffers.");
+  assert_eq(right.data_size(), static_cast<size_t>(records),
+            "Alternating records should all be kept.");
+
+  // Readers see a sorted prefix while the writer adds chunks.
+  std::atomic<bool> done{false};
+  std::thread writer([&left, &done] {
+    for (unsigned j = 0; j < 20 * records; ++j) left.record();
+    done = true;
+  });
+  size_t last = 0;
+  bool sorted = true, growing = true;
+  const auto check = [&](size_t thread, auto first, auto last_point) {
+    if (thread != 1) return;
+    sorted = sorted && is_sorted(first, last_point);
+    const auto count = static_cast<size_t>(last_point - first);
+    growing = growing && count >= last;
+    last = count;
+  };
+  while (!done) left.for_each_published(check);
+  writer.join();
+  left.for_each_published(check);
+  assert_true(sorted, "Published time points are not sorted.");
+  assert_true(growing, "Published time points should only grow.");
+  assert_eq(last, static_cast<size_t>(20 * records),
+            "Every record should be published.");
+  assert_eq(left.merged().data_size(), static_cast<size_t>(21 * records),
+            "Merge lost measurements across chunks.");
+}
+
+void Test::test_statistics() {
+  const array<time_unit::rep, 8> vals = {4, 8, 15, 16, 23, 42, 1, 7};
+  Statistics<time_unit> all(vals.begin(), vals.end());
+  Statistics<time_unit> low(vals.begin(), vals.begin() + 3);
+  Statistics<time_unit> high(vals.begin() + 3, vals.end());
+
+  assert_eq(all.count(), vals.size(), "Statistics count is incorrect.");
+  assert_eq(all.min(), 1, "Statistics min is incorrect.");
+  assert_eq(all.max(), 42, "Statistics max is incorrect.");
+  assert_less(std::abs(all.mean() - 14.5), 1e-9, "Statistics mean is off.");
+  assert_less(std::abs(all.variance() * 7 - 1222.0), 1e-9,
+              "Statistics variance is off.");
+
+  const auto both = low + high;
+  assert_eq(both.count(), all.count(), "Combined count is incorrect.");
+  assert_eq(both.min(), all.min(), "Combined min is incorrect.");
+  assert_eq(both.max(), all.max(), "Combined max is incorrect.");
+  assert_less(std::abs(both.mean() - all.mean()), 1e-9,
+              "Combined mean is off.");
+  assert_less(std::abs(both.variance() - all.variance()), 1e-9,
+              "Combined variance is off.");
+
+  bool caught = false;
+  try {
+    Statistics<time_unit>().min();
+  } catch (const std::out_of_range& err) {
+    caught = true;
+  }
+  assert_true(caught, "Empty statistics should throw.");
+
+  const auto times = randint_sample<unsigned, 5>(10, 20);
+  const auto sw = recorded(times);
+  const Statistics<time_unit> from_sw(sw.begin(), sw.end());
+  assert_eq(from_sw.count(), sw.size(), "Stopwatch statistics count is off.");
+  assert_eq(from_sw.min(), *std::min_element(sw.begin(), sw.end()),
+            "Stopwatch statistics min is off.");
+
+  StreamingStopwatch<time_unit, test_clock> stream, other;
+  stream.record();
+  assert_true(stream.sink().empty(), "One time point has no split.");
+  for (const auto t : times) {
+    test_clock::advance(time_unit(t));
+    stream.record();
+    other.record();
+  }
+  const auto& stats = stream.sink();
+  assert_eq(stats.count(), times.size(), "Streaming count is incorrect.");
+  assert_eq(stats.min(), *std::min_element(times.begin(), times.end()),
+            "Streaming min is inaccurate.");
+  assert_eq(stats.max(), *std::max_element(times.begin(), times.end()),
+            "Streaming max is inaccurate.");
+
+  stream += other;
+  assert_eq(stream.sink().count(), 2 * times.size() - 1,
+            "Combined streaming count is incorrect.");
+  assert_eq(stream.data(), other.data(), "Latest time point should be kept.");
+  stream.clear();
+  assert_true(stream.sink().empty(), "Streaming stopwatch should be clear.");
+}
+
+void Test::test_histogram() {
+  using std::chrono::nanoseconds;
+  using rep = nanoseconds::rep;
+  Histogram<nanoseconds> hist(3), low(3), high(2);
+  for (rep i = 1; i <= 100000; ++i) {
+    hist.add(i);
+    (i <= 50000 ? low : high).add(i);
+  }
+  assert_eq(hist.count(), static_cast<uint64_t>(100000),
+            "Histogram count is incorrect.");
+  assert_eq(hist.min(), 1, "Histogram min is incorrect.");
+  assert_eq(hist.max(), 100000, "Histogram max is incorrect.");
+  assert_eq(hist.percentile(100), 100000, "Max percentile is incorrect.");
+  assert_eq(hist.percentile(0), 1, "Min percentile is incorrect.");
+  assert_less(std::abs(hist.mean() - 50000.5), 1e-6, "Histogram mean is off.");
+
+  // Three significant digits is accurate within 0.1%.
+  for (const double pct : {50.0, 90.0, 99.0, 99.9}) {
+    const auto expected = static_cast<rep>(pct * 1000);
+    const auto actual = hist.percentile(pct);
+    assert_leq(std::abs(actual - expected), expected / 1000 + 1,
+               "Histogram percentile is inaccurate.");
+  }
+  assert_less(hist.footprint(), static_cast<size_t>(64 * 1024),
+              "Histogram footprint is too large.");
+
+  const auto merged = low + high;
+  assert_eq(merged.count(), hist.count(), "Merged count is incorrect.");
+  assert_eq(merged.min(), hist.min(), "Merged min is incorrect.");
+  assert_eq(merged.max(), hist.max(), "Merged max is incorrect.");
+  // Merging in two significant digits is accurate within 1%.
+  assert_leq(std::abs(merged.percentile(99) - hist.percentile(99)), 1000,
+             "Merged percentile is inaccurate.");
+
+  bool caught = false;
+  try {
+    Histogram<nanoseconds>(0);
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "Invalid significant digits should throw.");
+
+  const auto times = randint_sample<unsigned, 5>(10, 20);
+  const auto sw = recorded(times);
+  const Histogram<time_unit> from_sw(sw.begin(), sw.end());
+  assert_eq(from_sw.count(), sw.size(), "Stopwatch histogram count is off.");
+  assert_eq(from_sw.percentile(100), *std::max_element(sw.begin(), sw.end()),
+            "Stopwatch histogram max is off.");
+
+  StreamingStopwatch<nanoseconds, std::chrono::steady_clock,
+                     Histogram<nanoseconds>>
+      stream;
+  for (unsigned i = 0; i < 100; ++i) stream.record();
+  assert_eq(stream.sink().count(), static_cast<uint64_t>(99),
+            "Streaming histogram count is incorrect.");
+  assert_leq(stream.sink().percentile(50), stream.sink().percentile(99),
+             "Streaming percentiles are not ordered.");
+}
+
+void Test::test_bulk() {
+  using std::chrono::microseconds;
+  using std::chrono::nanoseconds;
+  Stopwatch<nanoseconds> nano;
+  Stopwatch<microseconds> micro;
+  Stopwatch<nanoseconds, tsc_clock> tsc;
+  FixedStopwatch<16, microseconds> ring;
+  for (unsigned i = 0; i < 37; ++i) {
+    nano.record();
+    micro.record();
+    tsc.record();
+    ring.record();
+  }
+
+  const auto check = [](const auto& sw, const char* name) {
+    vector<decltype(sw[0])> out(sw.size());
+    sw.splits_into(out.data());
+    assert_true(equal(out.begin(), out.end(), sw.begin()),
+                string("Bulk splits do not match iteration: ") + name);
+    auto iter = sw.begin();
+    iter.mode(Stopwatch<>::ELAPSE_MODE);
+    sw.elapsed_into(out.data());
+    assert_true(equal(out.begin(), out.end(), iter),
+                string("Bulk elapses do not match iteration: ") + name);
+  };
+  check(nano, "nanoseconds");
+  check(micro, "microseconds");
+  check(tsc, "tsc clock");
+  check(ring, "ring buffer");
+
+  Stopwatch<> edge;
+  edge.splits_into(nullptr);
+  edge.record();
+  edge.elapsed_into(nullptr);
+
+  // Every kernel the host supports agrees with the scalar loops.
+  using time_point = std::chrono::steady_clock::time_point;
+  const auto steps = randint_sample<int64_t, 38>(-50, 5000);
+  vector<time_point> points;
+  vector<uint32_t> keys;
+  for (size_t i = 0; i < steps.size(); ++i) {
+    points.emplace_back(nanoseconds(steps[i] * static_cast<int64_t>(i + 1)));
+    keys.push_back(static_cast<uint32_t>(steps[i] % 3));
+  }
+  const size_t n = points.size() - 1;
+  const auto run = [&](simd_level level) {
+    vector<int64_t> out(3 * n);
+    split_ticks(points.data(), n, out.data(), level);
+    elapse_ticks(points.data(), n, out.data() + n, level);
+    const auto kept = filter_split_ticks(points.data(), keys.data(), n, 1,
+                                         out.data() + 2 * n, level);
+    out.resize(2 * n + kept);
+    auto aligned = points;
+    align_ticks(aligned.data(), aligned.size(), int64_t(1000), int64_t(-7),
+                2.5e-4, level);
+    for (const auto point : aligned) {
+      out.push_back(point.time_since_epoch().count());
+    }
+    return out;
+  };
+  const auto expected = run(simd_level::scalar);
+  for (const auto level :
+       {simd_level::neon, simd_level::avx2, simd_level::avx512}) {
+    if (level > simd_host_level()) continue;
+    assert_eq(run(level), expected, "Kernels should match scalar loops.");
+  }
+}
+
+void Test::test_compact() {
+  using std::chrono::nanoseconds;
+  using time_point = std::chrono::steady_clock::time_point;
+  delta_buffer<time_point, uint16_t> compact;
+  vector<time_point> plain;
+  compact.reserve(1000);
+  // Mostly small steps, with jumps too large and negative to encode.
+  const auto steps = randint_sample<int64_t, 1000>(0, 5000);
+  auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < steps.size(); ++i) {
+    auto step = nanoseconds(steps[i]);
+    if (i % 97 == 0) step *= 1000;
+    if (i % 211 == 0) step = -step;
+    now += step;
+    plain.push_back(now);
+    compact.push_back(now);
+  }
+  assert_eq(compact.size(), plain.size(), "Compact buffer size is incorrect.");
+  assert_true(equal(plain.begin(), plain.end(), compact.begin()),
+              "Compact buffer does not decode its time points.");
+  assert_less(compact.footprint(), plain.size() * sizeof(time_point) / 2,
+              "Compact buffer should be smaller than plain storage.");
+
+  CompactStopwatch<nanoseconds> sw(static_cast<size_t>(500));
+  for (unsigned i = 0; i < 500; ++i) sw.record();
+  assert_eq(sw.size(), static_cast<size_t>(499), "Compact stopwatch size.");
+  for (size_t i = 0; i < sw.size(); ++i) {
+    const auto split = sw.data(i + 1) - sw.data(i);
+    assert_eq(sw[i], duration_cast<nanoseconds>(split).count(),
+              "Compact stopwatch split is incorrect.");
+  }
+  vector<nanoseconds::rep> bulk(sw.size());
+  sw.splits_into(bulk.data());
+  assert_true(equal(bulk.begin(), bulk.end(), sw.begin()),
+              "Compact stopwatch iteration is inconsistent.");
+}
+
+void Test::test_archive() {
+  using std::chrono::microseconds;
+  const auto dir = std::filesystem::temp_directory_path();
+  const auto path = (dir / "stopwatch_test_archive.bin").string();
+  const auto ring_path = (dir / "stopwatch_test_ring.bin").string();
+
+  Stopwatch<microseconds> sw(static_cast<size_t>(100),
+                             Stopwatch<>::ELAPSE_MODE);
+  FixedStopwatch<16, microseconds> ring;
+  for (unsigned i = 0; i < 100; ++i) {
+    sw.record();
+    ring.record();
+  }
+  dump(sw, path);
+  dump(ring, ring_path);
+
+  const auto loaded = load<microseconds>(path);
+  assert_eq(loaded.mode(), Stopwatch<>::ELAPSE_MODE,
+            "Loaded stopwatch should keep its mode.");
+  assert_eq(loaded.data_size(), sw.data_size(),
+            "Loaded stopwatch is missing measurements.");
+  assert_true(equal(sw.data().begin(), sw.data().end(), loaded.data().begin()),
+              "Loaded time points do not match.");
+  assert_true(equal(sw.begin(), sw.end(), loaded.begin()),
+              "Loaded durations do not match.");
+  assert_eq(loaded[42], sw[42], "Loaded index does not match.");
+
+  const auto loaded_ring = load<microseconds>(ring_path);
+  assert_eq(loaded_ring.mode(), Stopwatch<>::SPLIT_MODE,
+            "Loaded ring should be in split mode.");
+  assert_true(equal(ring.begin(), ring.end(), loaded_ring.begin(),
+                    loaded_ring.end()),
+              "Loaded ring durations do not match.");
+
+  bool caught = false;
+  try {
+    load<microseconds, std::chrono::system_clock>(path);
+  } catch (const std::runtime_error& err) {
+    caught = true;
+  }
+  assert_true(caught, "Loading from a different clock should throw.");
+
+  // Clocks without an id cannot be told apart.
+  struct unknown_clock : std::chrono::steady_clock {};
+  Stopwatch<microseconds, unknown_clock> unknown;
+  unknown.record();
+  dump(unknown, path);
+  caught = false;
+  try {
+    load<microseconds, unknown_clock>(path);
+  } catch (const std::runtime_error& err) {
+    caught = true;
+  }
+  assert_true(caught, "Loading from an unknown clock should throw.");
+
+  // A capture calibrated elsewhere would be scaled wrong.
+  Stopwatch<microseconds, tsc_clock> counter;
+  counter.record();
+  counter.record();
+  dump(counter, path);
+  assert_eq(load<microseconds, tsc_clock>(path).data_size(),
+            static_cast<size_t>(2), "Local calibration should load.");
+  archive_header head;
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.read(reinterpret_cast<char*>(&head), sizeof(head));
+    head.ns_per_tick *= 1.01;
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&head), sizeof(head));
+  }
+  caught = false;
+  try {
+    load<microseconds, tsc_clock>(path);
+  } catch (const std::runtime_error& err) {
+    caught = true;
+  }
+  assert_true(caught, "Loading another calibration should throw.");
+
+  caught = false;
+  try {
+    load<microseconds, tsc_clock>(dir / "stopwatch_test_missing.bin");
+  } catch (const std::runtime_error& err) {
+    caught = true;
+  }
+  assert_true(caught, "Loading a missing capture should throw.");
+  std::remove(path.c_str());
+  std::remove(ring_path.c_str());
+}
+
+void Test::test_merge() {
+  using std::chrono::nanoseconds;
+  using sw_type = Stopwatch<nanoseconds>;
+  vector<sw_type> shards(6);
+  for (unsigned i = 0; i < 300; ++i) shards[i % 5].record();
+  // Common time points must be deduplicated.
+  shards[5] = shards[0] + shards[3];
+
+  auto folded = shards[0];
+  for (size_t i = 1; i < shards.size(); ++i) folded = folded + shards[i];
+  const auto merged =
+      sw_type::merge(shards.begin(), shards.end(), Stopwatch<>::ELAPSE_MODE);
+  assert_eq(merged.mode(), Stopwatch<>::ELAPSE_MODE,
+            "Merged stopwatch should be in elapse mode.");
+  assert_eq(merged.data_size(), static_cast<size_t>(300),
+            "Merged stopwatch should discard common time points.");
+  assert_eq(merged.data(), folded.data(), "Merge should match folding.");
+
+  // Temporaries are reused and the result takes the left mode.
+  sw_type left(Stopwatch<>::ELAPSE_MODE);
+  left.record();
+  auto right = shards[1];
+  const auto sum = left + std::move(right);
+  assert_eq(sum.mode(), Stopwatch<>::ELAPSE_MODE,
+            "Sum should take the mode of the left operand.");
+  assert_eq(sum.data_size(), shards[1].data_size() + 1,
+            "Sum of temporaries is missing measurements.");
+  auto chained = sw_type(shards[0]) + shards[1] + shards[2] + shards[3];
+  assert_eq(chained.data_size(), static_cast<size_t>(240),
+            "Chained sum is missing measurements.");
+  assert_true(is_sorted(chained.data().begin(), chained.data().end()),
+              "Chained sum is not sorted.");
+
+  FixedStopwatch<64, nanoseconds> fixed_a, fixed_b;
+  for (unsigned i = 0; i < 20; ++i) (i % 2 ? fixed_a : fixed_b).record();
+  const std::array<decltype(fixed_a), 2> pair = {fixed_a, fixed_b};
+  const auto fixed = decltype(fixed_a)::merge(pair.begin(), pair.end());
+  assert_true(equal(fixed.data().begin(), fixed.data().end(),
+                    (fixed_a + fixed_b).data().begin()),
+              "Fixed merge should match interleaving.");
+
+  auto self = shards[2];
+  self += self;
+  assert_eq(self.data(), shards[2].data(),
+            "Interleaving with itself changes nothing.");
+  assert_eq(sw_type::merge(shards.end(), shards.end()).data_size(),
+            static_cast<size_t>(0), "Merging nothing is empty.");
+}
+
+void Test::test_section() {
+  using std::chrono::nanoseconds;
+  constexpr auto outer = "outer"_section;
+  constexpr auto inner = "inner"_section;
+  static_assert(outer == section_hash("outer"), "Ids must be interned.");
+  static_assert(outer != inner, "Distinct names must not collide.");
+
+  Stopwatch<nanoseconds> sw;
+  {
+    const auto guard = sw.scope(outer);
+    for (unsigned i = 0; i < 3; ++i) {
+      const auto nested = sw.scope(inner);
+    }
+  }
+  assert_eq(sw.data_size(), static_cast<size_t>(8),
+            "Scopes record on entry and exit.");
+  assert_eq(sw.section_count(outer), static_cast<size_t>(1),
+            "Outer section was timed once.");
+  assert_eq(sw.section_count(inner), static_cast<size_t>(3),
+            "Inner section was timed three times.");
+  const auto& spans = sw.section_spans();
+  assert_eq(spans.back().begin, static_cast<size_t>(0),
+            "Outer scope exits last and began first.");
+  assert_eq(spans.back().end, static_cast<size_t>(7),
+            "Outer scope should span every time point.");
+  assert_true(sw.section_total(outer) >= sw.section_total(inner),
+              "Nested sections cannot exceed the enclosing section.");
+  const auto stats = sw.section<Statistics<nanoseconds>>(inner);
+  assert_eq(stats.count(), static_cast<size_t>(3),
+            "Section sink should see every span.");
+
+  // Spans follow their time points through interleaving.
+  Stopwatch<nanoseconds> other;
+  { const auto guard = other.scope(inner); }
+  const auto merged = sw + other;
+  assert_eq(merged.section_count(inner), static_cast<size_t>(4),
+            "Interleaving should keep the spans of both operands.");
+  assert_eq(merged.section_total(inner),
+            sw.section_total(inner) + other.section_total(inner),
+            "Interleaved spans should keep their durations.");
+  sw.clear();
+  assert_eq(sw.section_count(outer), static_cast<size_t>(0),
+            "Clear should remove sections.");
+
+  // Open scopes keep room for their exits, so guards never
+  // allocate when destroyed, even after plain records.
+  Stopwatch<nanoseconds> roomy;
+  {
+    const auto guard = roomy.scope(outer);
+    for (unsigned i = 0; i < 100; ++i) {
+      roomy.record();
+      assert_greater(roomy.data().capacity(), roomy.data_size(),
+                     "Open scopes should keep room for their exit.");
+    }
+  }
+  assert_eq(roomy.section_spans().back().end, static_cast<size_t>(101),
+            "The exit should follow every record.");
+  using ring_storage = std::decay_t<decltype(FixedStopwatch<8>().data())>;
+  static_assert(!keeps_every_point<ring_storage>::value,
+                "Ring storage cannot hold scope indices.");
+}
+
+void Test::test_overhead() {
+  using std::chrono::nanoseconds;
+  using sw_type = Stopwatch<nanoseconds>;
+  const auto cost = sw_type::record_overhead();
+  assert_true(cost >= nanoseconds(0), "Overhead cannot be negative.");
+  assert_eq(sw_type::record_overhead(), cost, "Overhead is measured once.");
+
+  sw_type sw(static_cast<size_t>(1000));
+  for (unsigned i = 0; i <= 1000; ++i) sw.record();
+  const vector<nanoseconds::rep> raw(sw.begin(), sw.end());
+  assert_eq(sw.overhead(), nanoseconds(0), "Correction is opt in.");
+  sw.correct_overhead();
+  assert_eq(sw.overhead(), cost, "Correction should use the calibration.");
+
+  vector<nanoseconds::rep> bulk(sw.size());
+  sw.splits_into(bulk.data());
+  for (size_t i = 0; i < sw.size(); ++i) {
+    const auto expected = std::max(raw[i] - cost.count(), nanoseconds::rep(0));
+    assert_eq(sw[i], expected, "Split should subtract the overhead.");
+    assert_eq(bulk[i], expected, "Bulk split should subtract the overhead.");
+  }
+  assert_true(equal(sw.begin(), sw.end(), bulk.begin()),
+              "Iteration should subtract the overhead.");
+
+  // Elapsed times subtract the overhead of every split they span.
+  sw.mode(sw_type::ELAPSE_MODE);
+  const auto last = sw.size() - 1;
+  vector<nanoseconds::rep> elapsed(sw.size());
+  sw.elapsed_into(elapsed.data());
+  const auto total = sw.data().back() - sw.data().front();
+  const auto corrected = total - cost * static_cast<nanoseconds::rep>(last + 1);
+  assert_eq(sw[last], std::max(corrected.count(), nanoseconds::rep(0)),
+            "Elapsed time should subtract the overhead of every split.");
+  assert_eq(elapsed[last], sw[last], "Bulk elapsed should match indexing.");
+
+  sw.correct_overhead(false);
+  sw.mode(sw_type::SPLIT_MODE);
+  assert_true(equal(sw.begin(), sw.end(), raw.begin()),
+              "Disabling correction should restore raw splits.");
+
+  // Only subtracting the overhead is clamped, not backwards splits.
+  const auto now = std::chrono::steady_clock::now();
+  sw_type backwards({now, now - nanoseconds(500)});
+  vector<nanoseconds::rep> backwards_bulk(1);
+  backwards.splits_into(backwards_bulk.data());
+  assert_eq(backwards[0], nanoseconds::rep(-500),
+            "Backwards splits should stay negative.");
+  assert_eq(backwards_bulk[0], backwards[0],
+            "Bulk backwards splits should match indexing.");
+  backwards.correct_overhead();
+  assert_eq(backwards[0], nanoseconds::rep(-500),
+            "Correction should not change backwards splits.");
+
+  // Section views subtract the overhead of every split a span covers.
+  sw_type nested;
+  nested.correct_overhead();
+  for (unsigned i = 0; i < 10; ++i) {
+    const auto outer = nested.scope("outer"_section);
+    const auto inner = nested.scope("inner"_section);
+  }
+  nanoseconds expected(0);
+  for (const auto& span : nested.section_spans()) {
+    if (span.id != "outer"_section) continue;
+    const auto raw_span = nested.data()[span.end] - nested.data()[span.begin];
+    const auto covered =
+        cost * static_cast<nanoseconds::rep>(span.end - span.begin);
+    expected += std::max(raw_span - covered, nanoseconds(0));
+  }
+  assert_eq(nested.section_total("outer"_section), expected.count(),
+            "Section total should subtract the overhead.");
+  const auto outer_stats =
+      nested.section<Statistics<nanoseconds>>("outer"_section);
+  assert_eq(outer_stats.count(), static_cast<uint64_t>(10),
+            "Section sink should see every span.");
+  assert_less(std::abs(outer_stats.mean() * 10 -
+                       static_cast<double>(expected.count())),
+              1e-6 * static_cast<double>(expected.count()) + 1,
+              "Section sink should subtract the overhead.");
+}
+
+void Test::test_prefix() {
+  using std::chrono::nanoseconds;
+  // Sums of converted splits, which can differ from converted totals.
+  const auto summed = [](const auto& sw, size_t first, size_t last) {
+    nanoseconds::rep total = 0;
+    for (auto i = first; i < last; ++i) total += sw[i];
+    return total;
+  };
+
+  Stopwatch<nanoseconds> sw(Stopwatch<>::ELAPSE_MODE);
+  for (unsigned i = 0; i < 200; ++i) sw.record();
+  sw.mode(Stopwatch<>::SPLIT_MODE);
+  assert_eq(sw.range_sum(0, sw.size()), summed(sw, 0, sw.size()),
+            "Range sum should not need an index.");
+  sw.build_prefix();
+  assert_eq(sw.range_sum(0, sw.size()), summed(sw, 0, sw.size()),
+            "Range sum should cover every split.");
+  assert_eq(sw.range_sum(40, 40), nanoseconds::rep(0),
+            "Empty range sums to zero.");
+  // Splits past the index are summed until it is extended.
+  for (unsigned i = 0; i < 100; ++i) sw.record();
+  assert_eq(sw.range_sum(150, 250), summed(sw, 150, 250),
+            "Range sum should cover splits past the index.");
+  sw.build_prefix();
+  assert_eq(sw.range_sum(150, 250), summed(sw, 150, 250),
+            "Range sum should extend over new splits.");
+  assert_true(approx(static_cast<nanoseconds::rep>(sw.range_mean(10, 20)),
+                     summed(sw, 10, 20) / 10, 1),
+              "Range mean should average the range.");
+  bool caught = false;
+  try {
+    sw.range_sum(5, sw.size() + 1);
+  } catch (const std::out_of_range& err) {
+    caught = true;
+  }
+  assert_true(caught, "Range past the last split should throw.");
+  caught = false;
+  try {
+    sw.range_mean(5, 5);
+  } catch (const std::out_of_range& err) {
+    caught = true;
+  }
+  assert_true(caught, "Mean of an empty range should throw.");
+
+  auto other = sw;
+  sw += other;
+  sw.clear();
+  assert_eq(sw.range_sum(0, 0), nanoseconds::rep(0),
+            "Clear should reset the prefix index.");
+
+  // Overwriting the oldest time point rebuilds the index.
+  FixedStopwatch<16, nanoseconds> ring;
+  for (unsigned i = 0; i < 10; ++i) ring.record();
+  ring.build_prefix();
+  for (unsigned i = 0; i < 30; ++i) ring.record();
+  assert_eq(ring.range_sum(3, ring.size()), summed(ring, 3, ring.size()),
+            "Range sum should ignore a stale index.");
+  ring.build_prefix();
+  assert_eq(ring.range_sum(3, ring.size()), summed(ring, 3, ring.size()),
+            "Range sum should follow ring overwrites.");
+}
+
+void Test::test_perf() {
+  using std::chrono::nanoseconds;
+  PerfStopwatch<nanoseconds> sw(static_cast<size_t>(10));
+  volatile unsigned work = 0;
+  for (unsigned i = 0; i <= 10; ++i) {
+    for (unsigned k = 0; k < 10000; ++k) work = work + k;
+    sw.record();
+  }
+  assert_eq(sw.size(), static_cast<size_t>(10),
+            "Counted stopwatch should record as usual.");
+  vector<nanoseconds::rep> bulk(sw.size());
+  sw.splits_into(bulk.data());
+  assert_true(equal(sw.begin(), sw.end(), bulk.begin()),
+              "Counted splits should match bulk extraction.");
+  // The kernel may refuse counters, in which case they read as zero.
+  for (auto iter = sw.begin(); iter != sw.end(); ++iter) {
+    const auto instructions = iter.counter_delta(counter::instructions);
+    assert_eq(instructions > 0, sw.data().available(),
+              "Instructions should be counted when available.");
+    assert_true(ipc(iter) >= 0 && miss_rate(iter) >= 0,
+                "Derived rates cannot be negative.");
+  }
+  auto elapsed = sw.begin() + 5;
+  elapsed.mode(Stopwatch<>::ELAPSE_MODE);
+  assert_geq(elapsed.counter_delta(counter::cycles),
+             (sw.begin() + 5).counter_delta(counter::cycles),
+             "Elapsed deltas should cover every split.");
+
+  PerfStopwatch<nanoseconds, std::chrono::steady_clock, counter::instructions>
+      single;
+  single.record();
+  single.record();
+  bool caught = false;
+  try {
+    single.begin().counter_delta(counter::cycles);
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "Unsampled counters should throw.");
+
+  // Sorting moves each time point's counters with it.
+  PerfStopwatch<nanoseconds, test_clock> shuffled;
+  vector<std::pair<test_clock::time_point, uint64_t>> expected;
+  for (const int step : {5, -3, 7, -6, 2}) {
+    for (unsigned k = 0; k < 1000; ++k) work = work + k;
+    test_clock::advance(nanoseconds(step));
+    shuffled.record();
+    const auto index = shuffled.data_size() - 1;
+    expected.emplace_back(shuffled.data()[index],
+                          shuffled.data().count(index, counter::instructions));
+  }
+  shuffled.sort();
+  std::stable_sort(
+      expected.begin(), expected.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (size_t i = 0; i < expected.size(); ++i) {
+    assert_eq(shuffled.data()[i], expected[i].first,
+              "Sorting should order time points.");
+    assert_eq(shuffled.data().count(i, counter::instructions),
+              expected[i].second, "Sorting should keep counters in step.");
+  }
+
+  // Merging would resample counters, so it must not compile.
+  using counted_storage = std::decay_t<decltype(sw.data())>;
+  using plain_storage = std::decay_t<decltype(Stopwatch<>().data())>;
+  static_assert(!is_interleavable<counted_storage>::value,
+                "Counted storage must reject interleaving.");
+  static_assert(is_interleavable<plain_storage>::value,
+                "Plain storage should interleave.");
+}
+
+void Test::test_async() {
+  using std::chrono::microseconds;
+  using std::chrono::nanoseconds;
+  using async_type = AsyncStopwatch<nanoseconds>;
+  const auto raw_path =
+      (std::filesystem::temp_directory_path() / "stopwatch_raw.bin").string();
+  const auto zip_path =
+      (std::filesystem::temp_directory_path() / "stopwatch_zip.bin").string();
+  std::remove(raw_path.c_str());
+  std::remove(zip_path.c_str());
+
+  vector<nanoseconds::rep> collected;
+  const prometheus_histogram<nanoseconds> prom({100, 1000, 10000});
+  {
+    async_type sw({[&collected](const nanoseconds::rep* splits,
+                                size_t count) {
+                     collected.insert(collected.end(), splits, splits + count);
+                   },
+                   file_sink<nanoseconds>(raw_path),
+                   file_sink<nanoseconds>(zip_path, true), prom},
+                  microseconds(100));
+    for (unsigned i = 0; i < 1000; ++i) sw.record();
+    sw.flush();
+    assert_eq(sw.exported(), static_cast<uint64_t>(1000),
+              "Flush should export every time point.");
+    assert_eq(sw.dropped(), static_cast<uint64_t>(0),
+              "A large ring should not drop time points.");
+  }
+  assert_eq(collected.size(), static_cast<size_t>(999),
+            "Sinks should receive every split.");
+  assert_true(std::all_of(collected.begin(), collected.end(),
+                          [](auto split) { return split >= 0; }),
+              "Exported splits cannot be negative.");
+  assert_eq(read_splits<nanoseconds>(raw_path), collected,
+            "Raw export should round trip.");
+  assert_eq(read_splits<nanoseconds>(zip_path, true), collected,
+            "Compressed export should round trip.");
+  assert_less(std::filesystem::file_size(zip_path),
+              std::filesystem::file_size(raw_path),
+              "Compressed export should be smaller.");
+  assert_eq(prom.count(), static_cast<uint64_t>(999),
+            "Prometheus histogram should count every split.");
+  const auto text = prom.exposition("latency");
+  assert_true(text.find("latency_bucket{le=\"+Inf\"} 999") != string::npos &&
+                  text.find("latency_count 999") != string::npos,
+              "Exposition should report cumulative buckets and count.");
+  // A run of continuation bytes longer than any varint is corrupt.
+  {
+    std::ofstream corrupt(zip_path, std::ios::binary | std::ios::trunc);
+    const string endless(11, static_cast<char>(0xFF));
+    corrupt.write(endless.data(), static_cast<std::streamsize>(endless.size()));
+  }
+  bool caught = false;
+  try {
+    read_splits<nanoseconds>(zip_path, true);
+  } catch (const std::runtime_error& err) {
+    caught = true;
+  }
+  assert_true(caught, "Overlong varints should be rejected.");
+  std::remove(raw_path.c_str());
+  std::remove(zip_path.c_str());
+
+  // Statsd lines arrive in one datagram on a local socket.
+  const int receiver = ::socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in local{};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(local);
+  ::bind(receiver, reinterpret_cast<sockaddr*>(&local), sizeof(local));
+  ::getsockname(receiver, reinterpret_cast<sockaddr*>(&local), &length);
+  const nanoseconds::rep samples[] = {5, 42, 7};
+  const statsd_sink<nanoseconds> statsd("127.0.0.1", ntohs(local.sin_port),
+                                        "job");
+  statsd(samples, 3);
+  char datagram[128] = {};
+  ::recv(receiver, datagram, sizeof(datagram) - 1, 0);
+  ::close(receiver);
+  assert_eq(string(datagram), string("job:5|ms\njob:42|ms\njob:7|ms"),
+            "Statsd sink should send timer lines.");
+
+  // A tiny ring that is drained rarely must drop rather than block,
+  // and the gaps across dropped time points are not splits.
+  uint64_t received = 0;
+  bool exact = true;
+  {
+    AsyncStopwatch<nanoseconds, test_clock, 16> tiny(
+        {[&received, &exact](const nanoseconds::rep* splits, size_t count) {
+          received += count;
+          exact = exact && std::all_of(splits, splits + count,
+                                       [](auto split) { return split == 1; });
+        }},
+        std::chrono::milliseconds(1));
+    for (unsigned i = 0; i < 1000; ++i) {
+      test_clock::advance(nanoseconds(1));
+      tiny.record();
+    }
+    assert_greater(tiny.dropped(), static_cast<uint64_t>(0),
+                   "A full ring should count drops.");
+    tiny.flush();
+    assert_eq(tiny.exported() + tiny.dropped(), static_cast<uint64_t>(1000),
+              "Every time point is either exported or dropped.");
+  }
+  assert_greater(received, static_cast<uint64_t>(0),
+                 "Kept time points should still be exported.");
+  assert_true(exact, "Splits should not span dropped time points.");
+}
+
+void Test::test_trace() {
+  using std::chrono::nanoseconds;
+  const auto occurrences = [](const string& text, const string& word) {
+    size_t count = 0;
+    for (auto pos = text.find(word); pos != string::npos;
+         pos = text.find(word, pos + 1)) {
+      ++count;
+    }
+    return count;
+  };
+
+  Stopwatch<nanoseconds> sw;
+  {
+    const auto outer = sw.scope("outer"_section);
+    for (unsigned i = 0; i < 2; ++i) {
+      const auto inner = sw.scope("in\"ner"_section);
+    }
+  }
+  // A tiny buffer forces the trace to be streamed in pieces.
+  std::ostringstream chrome;
+  {
+    chrome_trace trace(chrome, 64);
+    trace.add(sw, 7, {{"outer"_section, "outer"}});
+  }
+  const auto json = chrome.str();
+  assert_eq(occurrences(json, "\"ph\":\"B\""), static_cast<size_t>(3),
+            "Every section should begin a slice.");
+  assert_eq(occurrences(json, "\"ph\":\"E\""), static_cast<size_t>(3),
+            "Every section should end a slice.");
+  assert_eq(occurrences(json, "\"name\":\"outer\""), static_cast<size_t>(1),
+            "Named sections should use their names.");
+  assert_eq(occurrences(json, "\"name\":\"section "), static_cast<size_t>(2),
+            "Unnamed sections should use their ids.");
+  assert_eq(occurrences(json, "\"tid\":7"), static_cast<size_t>(6),
+            "Slices should be on the given thread.");
+  assert_true(json.find("B\",\"pid\":1,\"tid\":7") <
+                  json.find("E\",\"pid\":1,\"tid\":7"),
+              "Enclosing slice should begin first.");
+  assert_eq(json.substr(json.size() - 4), string("\n]}\n"),
+            "Trace should be complete.");
+
+  ConcurrentStopwatch<nanoseconds> shared;
+  std::thread worker([&shared] {
+    for (unsigned i = 0; i < 4; ++i) shared.record();
+  });
+  worker.join();
+  for (unsigned i = 0; i < 3; ++i) shared.record();
+  std::ostringstream threads;
+  chrome_trace(threads).add(shared);
+  assert_eq(occurrences(threads.str(), "\"tid\":0"), static_cast<size_t>(6),
+            "First thread should have three splits.");
+  assert_eq(occurrences(threads.str(), "\"tid\":1"), static_cast<size_t>(4),
+            "Second thread should have two splits.");
+
+  // Walk the top level Trace.packet fields.
+  std::ostringstream perfetto;
+  {
+    perfetto_trace trace(perfetto, 64);
+    trace.add(sw);
+    trace.add(shared, 1);
+  }
+  const auto bytes = perfetto.str();
+  size_t packets = 0;
+  size_t pos = 0;
+  while (pos < bytes.size() && bytes[pos] == 0x0A) {
+    uint64_t len = 0;
+    unsigned shift = 0;
+    unsigned char byte;
+    do {
+      byte = static_cast<unsigned char>(bytes[++pos]);
+      len |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      shift += 7;
+    } while (byte & 0x80);
+    pos += 1 + len;
+    ++packets;
+  }
+  assert_eq(pos, bytes.size(), "Perfetto trace should be well formed.");
+  // Three track descriptors, three sections, and five splits.
+  assert_eq(packets, static_cast<size_t>(3 + 2 * (3 + 5)),
+            "Perfetto trace should describe tracks and slices.");
+}
+
+void Test::test_conversion() {
+  using std::chrono::duration;
+  using std::chrono::microseconds;
+  using std::chrono::milliseconds;
+  using std::chrono::nanoseconds;
+  using std::chrono::seconds;
+  static_assert(convert_duration<milliseconds>(nanoseconds(-2999999)) ==
+                    milliseconds(-2),
+                "Conversion should round toward zero.");
+  static_assert(
+      convert_duration<nanoseconds>(seconds(3)) == nanoseconds(3000000000),
+      "Conversion should multiply integer multiples.");
+
+  std::mt19937_64 gen(7);
+  std::uniform_int_distribution<int64_t> distr(-(int64_t(1) << 50),
+                                               int64_t(1) << 50);
+  for (unsigned i = 0; i < 10000; ++i) {
+    const nanoseconds ns(distr(gen));
+    assert_eq(convert_duration<milliseconds>(ns),
+              duration_cast<milliseconds>(ns),
+              "Power of ten division should match duration_cast.");
+    assert_eq(convert_duration<microseconds>(ns),
+              duration_cast<microseconds>(ns),
+              "Power of ten division should match duration_cast.");
+    const duration<int64_t, std::ratio<1, 3>> thirds(ns.count());
+    assert_eq(convert_duration<milliseconds>(thirds),
+              duration_cast<milliseconds>(thirds),
+              "General ratios should match duration_cast.");
+    const microseconds us(ns.count() >> 12);
+    assert_eq(convert_duration<nanoseconds>(us), duration_cast<nanoseconds>(us),
+              "Multiplication should match duration_cast.");
+  }
+
+  // Raw ticks convert into the same splits.
+  Stopwatch<microseconds> sw(Stopwatch<>::ELAPSE_MODE);
+  for (unsigned i = 0; i < 50; ++i) sw.record();
+  for (size_t i = 0; i < sw.size(); ++i) {
+    assert_eq(decltype(sw)::convert(sw.raw(i)), sw[i],
+              "Raw ticks should convert into elapsed times.");
+  }
+  for (auto iter = sw.begin(); iter != sw.end(); ++iter) {
+    assert_eq(decltype(sw)::convert(iter.raw()), *iter,
+              "Raw iterator ticks should convert into elapsed times.");
+  }
+
+  // Fixed-point conversion of counter ticks agrees with floating point.
+  for (const int64_t ticks : {int64_t(0), int64_t(1) << 20, int64_t(1) << 40}) {
+    const auto fixed = tsc_clock::to_duration<nanoseconds>(
+        tsc_clock::duration(ticks));
+    const auto exact = tsc_clock::to_duration<duration<double, std::nano>>(
+        tsc_clock::duration(ticks));
+    assert_less(std::abs(static_cast<double>(fixed.count()) - exact.count()),
+                1 + exact.count() * 1e-6,
+                "Fixed-point counter conversion is inaccurate.");
+    assert_eq(tsc_clock::to_duration<nanoseconds>(tsc_clock::duration(-ticks)),
+              -fixed, "Negative counter ticks should round toward zero.");
+  }
+
+  // Backwards time points give negative splits of the same magnitude.
+  const tsc_clock::time_point late(tsc_clock::duration(3 << 20));
+  const tsc_clock::time_point early(tsc_clock::duration(1 << 20));
+  const Stopwatch<nanoseconds, tsc_clock> backwards(
+      vector<tsc_clock::time_point>{late, early}, Stopwatch<>::ELAPSE_MODE);
+  const Stopwatch<nanoseconds, tsc_clock> forwards(
+      vector<tsc_clock::time_point>{early, late}, Stopwatch<>::ELAPSE_MODE);
+  assert_eq(backwards[0], -forwards[0],
+            "Negative counter splits should round toward zero.");
+  const Stopwatch<microseconds, test_clock> reversed(
+      vector<test_clock::time_point>{test_clock::time_point(nanoseconds(2999)),
+                                     test_clock::time_point(nanoseconds(0))},
+      Stopwatch<>::ELAPSE_MODE);
+  assert_eq(reversed[0], microseconds::rep(-2),
+            "Negative splits should round toward zero.");
+}
+
+void Test::test_sampling() {
+  using std::chrono::microseconds;
+  SampledStopwatch<microseconds> nth(every_nth(10));
+  for (unsigned i = 0; i < 1000; ++i) {
+    const auto guard = nth.scope();
+    assert_eq(guard.sampled(), i % 10 == 0,
+              "Every tenth event should be sampled.");
+  }
+  assert_eq(nth.size(), static_cast<size_t>(100),
+            "One in ten events should be sampled.");
+  assert_eq(nth.events(), static_cast<uint64_t>(1000),
+            "Every event should be counted.");
+  assert_eq(static_cast<int>(nth.ratio()), 10,
+            "Each sample should represent ten events.");
+  const Statistics<microseconds> stats(nth.begin(), nth.end());
+  assert_eq(stats.count(), static_cast<uint64_t>(nth.size()),
+            "Statistics should accept samples.");
+
+  SampledStopwatch<microseconds, std::chrono::steady_clock, bernoulli> coin(
+      bernoulli(0.25, 42));
+  for (unsigned i = 0; i < 10000; ++i) {
+    const auto guard = coin.scope();
+  }
+  assert_greater(coin.size(), static_cast<size_t>(2200),
+                 "Probabilistic sampling should keep about a quarter.");
+  assert_less(coin.size(), static_cast<size_t>(2800),
+              "Probabilistic sampling should keep about a quarter.");
+
+  SampledStopwatch<microseconds, std::chrono::steady_clock, reservoir> pool(
+      reservoir(64));
+  for (unsigned i = 0; i < 1000; ++i) {
+    const auto outer = pool.scope();
+    const auto inner = pool.scope();
+  }
+  assert_eq(pool.size(), static_cast<size_t>(64),
+            "Reservoir should hold its capacity.");
+  assert_eq(pool.events(), static_cast<uint64_t>(2000),
+            "Nested scopes should be separate events.");
+  assert_less(std::abs(pool.ratio() - 2000.0 / 64), 1e-9,
+              "Reservoir ratio should be events per sample.");
+  pool.clear();
+  for (unsigned i = 0; i < 200; ++i) {
+    const auto guard = pool.scope();
+  }
+  assert_eq(pool.size(), static_cast<size_t>(64),
+            "Cleared reservoir should refill to capacity.");
+  assert_less(std::abs(pool.ratio() - 200.0 / 64), 1e-9,
+              "Cleared reservoir should forget earlier events.");
+
+  // A sampled outer scope encloses its inner scopes.
+  SampledStopwatch<microseconds, test_clock> every(every_nth(1));
+  {
+    const auto outer = every.scope();
+    test_clock::advance(microseconds(5));
+    const auto inner = every.scope();
+    test_clock::advance(microseconds(7));
+  }
+  // Samples take their slot on entry, so the outer one comes first.
+  assert_eq(every[0], 12, "Outer scope should enclose inner scope.");
+  assert_eq(every[1], 7, "Inner scope should be timed exactly.");
+  every.clear();
+  assert_eq(every.size(), static_cast<size_t>(0), "Clear should drop samples.");
+  assert_false(every.ratio() > 0, "Ratio of nothing should be zero.");
+
+  bool caught = false;
+  try {
+    every_nth bad(0);
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "Zero sampling period should throw.");
+}
+
+void Test::test_unsorted() {
+  using point = system_clock::time_point;
+  std::mt19937_64 gen(11);
+  std::uniform_int_distribution<int64_t> distr(-(int64_t(1) << 40),
+                                               int64_t(1) << 40);
+  // Enough points to sort in several parallel chunks.
+  vector<point> big(300000);
+  for (auto& p : big) p = point(system_clock::duration(distr(gen)));
+  auto expected = big;
+  std::sort(expected.begin(), expected.end());
+  parallel_sort(big.data(), big.size(), 4);
+  assert_true(big == expected, "Parallel sort should match std::sort.");
+  vector<point> scratch(big.size());
+  std::shuffle(big.begin(), big.end(), gen);
+  radix_sort(big.data(), big.size(), scratch.data());
+  assert_true(big == expected, "Radix sort should match std::sort.");
+
+  // Captures whose clocks jumped, with one common time point.
+  vector<point> first, second;
+  for (int64_t t : {50, 10, 40, 20, 30}) {
+    first.emplace_back(system_clock::duration(t));
+  }
+  for (int64_t t : {25, 5, 40, 45}) {
+    second.emplace_back(system_clock::duration(t));
+  }
+  vector<int64_t> merged{5, 10, 20, 25, 30, 40, 45, 50};
+  const auto ticks_of = [](const auto& sw) {
+    vector<int64_t> ticks;
+    for (const auto& p : sw.data()) {
+      ticks.push_back(p.time_since_epoch().count());
+    }
+    return ticks;
+  };
+  using sw_type = Stopwatch<time_unit, system_clock>;
+  sw_type a(first), b(second);
+  a += b;
+  assert_true(ticks_of(a) == merged, "Interleave should sort unsorted input.");
+
+  const vector<sw_type> sources{sw_type(first), sw_type(second)};
+  const auto all = sw_type::merge(sources.begin(), sources.end());
+  assert_true(ticks_of(all) == merged, "Merge should sort unsorted input.");
+
+  sw_type c(first);
+  c.sort();
+  assert_true(std::is_sorted(c.data().begin(), c.data().end()),
+              "Sort should order time points.");
+}
+
+void Test::test_domain() {
+  using point = system_clock::time_point;
+  using ticks = system_clock::duration;
+  using sw_type = Stopwatch<time_unit, system_clock>;
+  const auto make = [](std::initializer_list<int64_t> times) {
+    vector<point> points;
+    for (const auto t : times) points.emplace_back(ticks(t));
+    return sw_type(points);
+  };
+  const auto ticks_of = [](const sw_type& sw) {
+    vector<int64_t> out;
+    for (const auto& p : sw.data()) out.push_back(p.time_since_epoch().count());
+    return out;
+  };
+
+  // Another process whose epoch is 1000 ticks behind.
+  auto a = make({100, 200, 300});
+  auto b = make({-850, -750});
+  clock_domain<system_clock> behind;
+  behind.offset = ticks(1000);
+  b.domain(behind);
+  const auto sum = a + b;
+  assert_true(ticks_of(sum) == vector<int64_t>{100, 150, 200, 250, 300},
+              "Offsets should shift time points onto the reference.");
+  assert_true(sum.domain().identity(), "Merged time points are in reference.");
+
+  // A clock ticking at half the rate, with drift, anchored at 50.
+  clock_domain<system_clock> slow;
+  slow.rate = 2;
+  slow.anchor = point(ticks(50));
+  auto c = make({60, 90});
+  c.domain(slow);
+  auto d = make({0});
+  d += c;
+  assert_true(ticks_of(d) == vector<int64_t>{0, 70, 130},
+              "Rates should scale time points from the anchor.");
+  clock_domain<system_clock> drifting;
+  drifting.drift_ppm = 1e5;
+  assert_eq(drifting.apply(point(ticks(1000))).time_since_epoch().count(),
+            int64_t(1100), "Drift should scale time points.");
+
+  // Large captures in both domains agree with a separate mapping pass.
+  std::mt19937_64 gen(5);
+  std::uniform_int_distribution<int64_t> distr(0, int64_t(1) << 40);
+  vector<point> mine(3000), theirs(2000);
+  for (auto& p : mine) p = point(ticks(distr(gen)));
+  for (auto& p : theirs) p = point(ticks(distr(gen)));
+  std::sort(mine.begin(), mine.end());
+  std::sort(theirs.begin(), theirs.end());
+  clock_domain<system_clock> first_domain, second_domain;
+  first_domain.offset = ticks(-12345);
+  first_domain.drift_ppm = 3.5;
+  second_domain.offset = ticks(999);
+  second_domain.rate = 1.000002;
+  second_domain.anchor = point(ticks(int64_t(1) << 39));
+  sw_type e(mine), f(theirs);
+  e.domain(first_domain);
+  f.domain(second_domain);
+  for (auto& p : mine) p = first_domain.apply(p);
+  second_domain.apply(theirs.data(), theirs.size());
+  vector<point> expected;
+  std::set_union(mine.begin(), mine.end(), theirs.begin(), theirs.end(),
+                 std::back_inserter(expected));
+  const vector<sw_type> sources{e, f};
+  const auto merged = sw_type::merge(sources.begin(), sources.end());
+  assert_true(merged.data() == expected, "Merge should align domains.");
+  e += f;
+  assert_true(e.data() == expected, "Interleave should align domains.");
+}
+
+void Test::test_bench() {
+  Framework fr;
+  vector<uint64_t> sink(64);
+  size_t calls = 0;
+  fr.emplace_bench("accumulate", [&] {
+    ++calls;
+    std::iota(sink.begin(), sink.end(), calls);
+  }, 1000);
+  fr.emplace_bench("throws", [] { throw std::runtime_error("bad bench"); },
+                   10);
+  fr.run_all();
+  assert_geq(calls, static_cast<size_t>(1000 + 1000 / 10),
+             "Benchmarks should warm up and then repeat.");
+  assert_true(fr.passed("accumulate"), "Benchmark should pass.");
+  const auto& summary = fr.summary("accumulate");
+  assert_eq(summary.iterations, static_cast<size_t>(1000),
+            "Summary should count iterations.");
+  assert_leq(summary.min, summary.median, "Minimum should not exceed median.");
+  assert_leq(summary.median, summary.p99, "Median should not exceed p99.");
+  assert_false(summary.stddev_ns < 0, "Deviation should not be negative.");
+  assert_true(fr.failed("throws"), "Throwing benchmark should fail.");
+
+  std::ostringstream out;
+  out << fr;
+  assert_neq(out.str().find("Bench accumulate passed"), string::npos,
+             "Benchmarks should be printed.");
+  assert_neq(out.str().find("p99"), string::npos,
+             "Benchmark summaries should be printed.");
+
+  bool caught = false;
+  try {
+    fr.summary("throws");
+  } catch (const std::out_of_range& err) {
+    caught = true;
+  }
+  assert_true(caught, "Failed benchmarks should have no summary.");
+  caught = false;
+  try {
+    fr.emplace_bench("empty", [] {}, 0);
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "Benchmarks without iterations should throw.");
+}
+
+void Test::test_registry() {
+  // A large generated suite, registered in reverse order.
+  constexpr size_t N = 2000;
+  vector<string> names;
+  for (size_t i = 0; i < N; ++i) {
+    auto number = std::to_string(i);
+    names.push_back("gen " + string(4 - number.size(), '0') + number);
+  }
+  Framework fr;
+  for (size_t i = N; i-- > 0;) {
+    if (i % 2 == 0) {
+      fr.emplace(names[i], +[] {});
+    } else {
+      fr.emplace(names[i], +[] { throw test_error("Generated failure."); });
+    }
+  }
+  assert_eq(fr.total_size(), N, "Every test should be registered.");
+  fr.run_all(4);
+  assert_eq(fr.executed_size(), N, "Every test should run.");
+  assert_eq(fr.passed(), N / 2, "Passes should be counted.");
+  assert_eq(fr.failed(), N / 2, "Failures should be counted.");
+  assert_true(fr.error_msg("gen 0001") == "Generated failure.",
+              "Error messages should be kept.");
+
+  // Overwriting forgets the old outcome.
+  fr.emplace("gen 0001", +[] {});
+  assert_false(fr.executed("gen 0001"), "Overwritten test should not be run.");
+  assert_eq(fr.failed(), N / 2 - 1, "Overwritten failure should be forgotten.");
+  fr.run("gen 0001");
+  assert_eq(fr.passed(), N / 2 + 1, "Rerun test should be counted.");
+
+  std::ostringstream out;
+  out << fr;
+  const auto text = out.str();
+  assert_eq(text.find("Test gen 0000 passed"), static_cast<size_t>(0),
+            "Tests should print in alphabetic order.");
+  assert_less(text.find("gen 0009"), text.find("gen 0010"),
+              "Tests should print in alphabetic order.");
+
+  bool caught = false;
+  try {
+    fr.run("missing");
+  } catch (const std::out_of_range& err) {
+    caught = true;
+  }
+  assert_true(caught, "Running an unregistered test should throw.");
+
+  // Names registered twice before a lookup keep the last test.
+  Framework pending;
+  pending.emplace("twice", +[] { throw test_error("First failure."); });
+  pending.emplace("once", +[] {});
+  pending.emplace("twice", +[] {});
+  assert_eq(pending.total_size(), static_cast<size_t>(2),
+            "Repeated names should be registered once.");
+  pending.run_all();
+  assert_true(pending.passed("twice"), "The last registration should win.");
+  assert_eq(pending.executed_size(), static_cast<size_t>(2),
+            "Replaced tests should not run.");
+}
+
+void Test::test_virtual_clock() {
+  using std::chrono::microseconds;
+  using std::chrono::nanoseconds;
+  using replay_clock = virtual_clock<nanoseconds, struct replay>;
+  replay_clock::reset();
+  assert_eq(replay_clock::now().time_since_epoch().count(), nanoseconds::rep(0),
+            "Virtual time should start at the epoch.");
+  replay_clock::advance(microseconds(3));
+  assert_eq(replay_clock::now().time_since_epoch(), nanoseconds(3000),
+            "Advance should move time forward.");
+
+  // Replay a recorded trace at full speed.
+  const vector<nanoseconds::rep> trace{1000, 1250, 4000, 4001, 9000};
+  Stopwatch<microseconds, replay_clock> sw(trace.size());
+  for (const auto t : trace) {
+    replay_clock::set(replay_clock::time_point(nanoseconds(t)));
+    sw.record();
+  }
+  const vector<microseconds::rep> expected{0, 2, 0, 4};
+  assert_true(equal(sw.begin(), sw.end(), expected.begin(), expected.end()),
+              "Replayed splits should match the trace.");
+
+  // Every thread keeps its own time.
+  nanoseconds other_time(-1);
+  std::thread other([&] {
+    replay_clock::advance(nanoseconds(5));
+    other_time = replay_clock::now().time_since_epoch();
+  });
+  other.join();
+  assert_eq(other_time, nanoseconds(5), "Threads should start at the epoch.");
+  assert_eq(replay_clock::now().time_since_epoch(), nanoseconds(9000),
+            "Other threads should not move this thread's time.");
+  replay_clock::reset();
+}
+
+void Test::test_tagged() {
+  using std::chrono::microseconds;
+  using std::chrono::nanoseconds;
+  using tagged_clock = virtual_clock<nanoseconds, struct tagged>;
+  tagged_clock::reset();
+  // Enough splits for the vector kernel, with a ragged tail.
+  TaggedStopwatch<nanoseconds, tagged_clock> sw(static_cast<size_t>(101));
+  for (unsigned i = 0; i <= 100; ++i) {
+    tagged_clock::advance(nanoseconds(i * 7 % 13 + 1));
+    sw.append(tagged_clock::now(), i % 3, i % 2);
+  }
+  assert_eq(sw.size(), static_cast<size_t>(100),
+            "Tagged stopwatch should count splits.");
+  assert_eq(sw.sections().size(), sw.time_points().size(),
+            "Every time point should have a section.");
+  vector<nanoseconds::rep> all(sw.size());
+  sw.splits_into(all.data());
+  for (size_t i = 0; i < sw.size(); ++i) {
+    assert_eq(all[i], sw[i], "Bulk splits should match indexing.");
+  }
+
+  // Compare the kernel with a naive filter on each column.
+  for (section_id id = 0; id < 4; ++id) {
+    vector<nanoseconds::rep> expected, actual(sw.size());
+    for (size_t i = 0; i < sw.size(); ++i) {
+      if (sw.sections()[i + 1] == id) expected.push_back(sw[i]);
+    }
+    actual.resize(sw.section_splits_into(id, actual.data()));
+    assert_true(actual == expected, "Section filter should match naive.");
+    const auto stats = sw.section<Statistics<nanoseconds>>(id);
+    assert_eq(stats.count(), static_cast<uint64_t>(expected.size()),
+              "Section sink should see every matching split.");
+  }
+  vector<nanoseconds::rep> odd(sw.size());
+  odd.resize(sw.thread_splits_into(1, odd.data()));
+  assert_eq(odd.size(), static_cast<size_t>(50),
+            "Thread filter should keep every other split.");
+  assert_eq(odd.front(), sw[0], "Thread filter should start at split 0.");
+
+  // Coarser durations convert after filtering.
+  TaggedStopwatch<microseconds, tagged_clock> coarse;
+  coarse.append(tagged_clock::time_point(), 0, 0);
+  coarse.append(tagged_clock::time_point(nanoseconds(2500)), 1, 0);
+  vector<microseconds::rep> converted(coarse.size());
+  assert_eq(coarse.section_splits_into(1, converted.data()),
+            static_cast<size_t>(1),
+            "Coarse filter should match the one split.");
+  assert_eq(converted.front(), microseconds::rep(2),
+            "Filtered splits should be converted.");
+
+  TaggedStopwatch<nanoseconds, std::chrono::steady_clock, counter::instructions>
+      counted;
+  counted.record("outer"_section);
+  counted.record("inner"_section);
+  assert_eq(counted.thread_indices()[0], this_thread_index(),
+            "Recording should tag the calling thread.");
+  assert_eq(counted.untagged().size(), counted.size(),
+            "Untagged copy should keep every split.");
+  static_cast<void>(counted.counter_delta(0, counter::instructions));
+  bool caught = false;
+  try {
+    counted.counter_delta(0, counter::cycles);
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "Unsampled counters should throw.");
+  counted.clear();
+  assert_eq(counted.size(), static_cast<size_t>(0),
+            "Clear should drop every split.");
+  tagged_clock::reset();
+}
+
+void Test::test_allocator() {
+  using std::chrono::nanoseconds;
+  using test_clock_point = test_clock::time_point;
+  // Counts allocations passed on to the default resource.
+  struct counting_resource : std::pmr::memory_resource {
+    size_t allocations = 0;
+    void* do_allocate(size_t bytes, size_t align) override {
+      ++allocations;
+      return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override {
+      std::pmr::new_delete_resource()->deallocate(ptr, bytes, align);
+    }
+    bool do_is_equal(const memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+  } upstream;
+  const auto tick = [](auto& watch, nanoseconds dur) {
+    test_clock::advance(dur);
+    watch.record();
+  };
+
+  PmrStopwatch<nanoseconds, test_clock> sw(&upstream, 8);
+  assert_eq(upstream.allocations, static_cast<size_t>(1),
+            "Reserving should allocate from the resource.");
+  for (unsigned i = 0; i <= 8; ++i) tick(sw, nanoseconds(i + 1));
+  assert_eq(upstream.allocations, static_cast<size_t>(1),
+            "Recording within capacity should not allocate.");
+  const auto capacity = sw.data().capacity();
+  sw.domain(clock_domain<test_clock>{nanoseconds(5), 1, 0, test_clock_point()});
+  sw.reset();
+  assert_true(sw.empty(), "Reset should delete every time point.");
+  assert_eq(sw.data().capacity(), capacity, "Reset should keep capacity.");
+  assert_true(sw.domain().identity(), "Reset should restore the domain.");
+  for (unsigned i = 0; i <= 8; ++i) tick(sw, nanoseconds(2));
+  assert_eq(upstream.allocations, static_cast<size_t>(1),
+            "Reused stopwatch should not allocate.");
+  assert_eq(sw[3], nanoseconds::rep(2), "Reused stopwatch should record.");
+
+  // Merging allocates from the first stopwatch's resource.
+  PmrStopwatch<nanoseconds, test_clock> other(&upstream, 4);
+  for (unsigned i = 0; i < 4; ++i) tick(other, nanoseconds(3));
+  const std::array<PmrStopwatch<nanoseconds, test_clock>, 2> parts{sw, other};
+  const auto before = upstream.allocations;
+  const auto merged =
+      PmrStopwatch<nanoseconds, test_clock>::merge(parts.begin(), parts.end());
+  static_cast<void>(merged);
+  assert_eq(upstream.allocations, before,
+            "Copies should not use the original resource.");
+  const auto joined = PmrStopwatch<nanoseconds, test_clock>::merge(
+      &sw, &sw + 1);
+  assert_eq(joined.data().get_allocator().resource(),
+            static_cast<std::pmr::memory_resource*>(&upstream),
+            "Merge should allocate like its first source.");
+
+  // Short-lived stopwatches reuse the thread's free lists.
+  for (unsigned i = 0; i < 100; ++i) {
+    PmrStopwatch<nanoseconds, test_clock> scratch(thread_pool());
+    tick(scratch, nanoseconds(1));
+    tick(scratch, nanoseconds(1));
+    assert_eq(scratch.size(), static_cast<size_t>(1),
+              "Pooled stopwatch should record.");
+  }
+}
+
+void Test::test_rolling() {
+  using std::chrono::microseconds;
+  using std::chrono::nanoseconds;
+  using point = test_clock::time_point;
+  // Ten microseconds in five buckets of two.
+  RollingWindow<nanoseconds, test_clock, Statistics<nanoseconds>> timed(
+      microseconds(10), 5);
+  assert_eq(timed.buckets(), static_cast<size_t>(5),
+            "Window should keep every bucket.");
+  for (int64_t t = 0; t < 20; ++t) timed.add(t, point(microseconds(t)));
+  // At 19 us the live buckets cover [10, 20) us.
+  const auto recent = timed.window(point(microseconds(19)));
+  assert_eq(recent.count(), static_cast<uint64_t>(10),
+            "Window should only cover its span.");
+  assert_eq(recent.min(), nanoseconds::rep(10),
+            "Window should drop expired buckets.");
+  assert_eq(timed.window(point(microseconds(25))).count(),
+            static_cast<uint64_t>(4),
+            "Window should slide one bucket at a time.");
+  assert_true(timed.window(point(microseconds(40))).empty(),
+              "Idle windows should be empty.");
+  timed.add(100, point(microseconds(1)));
+  assert_eq(timed.window(point(microseconds(19))).max(), nanoseconds::rep(19),
+            "Splits older than the window should be discarded.");
+
+  // The last eight splits in four buckets of two.
+  RollingWindow<nanoseconds, test_clock> counted(static_cast<size_t>(8), 4);
+  for (int64_t i = 1; i <= 11; ++i) counted.add(i * 10);
+  const auto hist = counted.window();
+  assert_eq(hist.count(), static_cast<uint64_t>(7),
+            "Counted window should cover the last buckets.");
+  assert_eq(hist.min(), nanoseconds::rep(50),
+            "Counted window should drop the oldest bucket.");
+
+  // Drained sources only feed new splits.
+  RollingWindow<nanoseconds, test_clock, Statistics<nanoseconds>> drained(
+      static_cast<size_t>(100), 10);
+  FixedStopwatch<8, nanoseconds, test_clock> ring;
+  for (unsigned i = 0; i < 6; ++i) {
+    test_clock::advance(nanoseconds(3));
+    ring.record();
+  }
+  drained.drain(ring);
+  assert_eq(drained.window().count(), static_cast<uint64_t>(5),
+            "Drain should add every split.");
+  for (unsigned i = 0; i < 6; ++i) {
+    test_clock::advance(nanoseconds(4));
+    ring.record();
+  }
+  drained.drain(ring);
+  drained.drain(ring);
+  const auto summary = drained.window();
+  assert_eq(summary.count(), static_cast<uint64_t>(11),
+            "Drain should follow ring overwrites.");
+  assert_eq(summary.max(), nanoseconds::rep(4),
+            "Drained splits should match the stopwatch.");
+
+  // Repeated time points are zero length splits, not duplicates.
+  drained.clear();
+  Stopwatch<nanoseconds, test_clock> coarse;
+  coarse.record();
+  coarse.record();
+  drained.drain(coarse);
+  coarse.record();
+  coarse.record();
+  drained.drain(coarse);
+  test_clock::advance(nanoseconds(6));
+  coarse.record();
+  drained.drain(coarse);
+  assert_eq(drained.window().count(), static_cast<uint64_t>(coarse.size()),
+            "Drain should keep splits within one tick.");
+  assert_eq(drained.window().max(), nanoseconds::rep(6),
+            "Drain should measure from the last repeated time point.");
+  assert_eq(drained.window().min(), nanoseconds::rep(0),
+            "Drain should add zero length splits.");
+
+  drained.clear();
+  ConcurrentStopwatch<nanoseconds, test_clock> shared;
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < 3; ++t) {
+    workers.emplace_back([&shared] {
+      for (unsigned i = 0; i < 4; ++i) {
+        test_clock::advance(nanoseconds(5));
+        shared.record();
+      }
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  drained.drain(shared);
+  drained.drain(shared);
+  assert_eq(drained.window().count(), static_cast<uint64_t>(9),
+            "Drain should add the splits of every thread.");
+  assert_eq(drained.window().max(), nanoseconds::rep(5),
+            "Threads should be drained separately.");
+
+  // Scrapes may drain while every thread keeps recording.
+  RollingWindow<nanoseconds, test_clock, Statistics<nanoseconds>> live(
+      static_cast<size_t>(100000), 10);
+  ConcurrentStopwatch<nanoseconds, test_clock> busy;
+  std::atomic<unsigned> finished{0};
+  workers.clear();
+  for (unsigned t = 0; t < 3; ++t) {
+    workers.emplace_back([&busy, &finished] {
+      for (unsigned i = 0; i < 5000; ++i) {
+        test_clock::advance(nanoseconds(1));
+        busy.record();
+      }
+      ++finished;
+    });
+  }
+  while (finished.load() < 3) live.drain(busy);
+  for (auto& worker : workers) worker.join();
+  live.drain(busy);
+  assert_eq(live.window().count(), static_cast<uint64_t>(3 * 4999),
+            "Live drains should add every split once.");
+  assert_eq(live.window().max(), nanoseconds::rep(1),
+            "Live drains should not join splits across threads.");
+
+  bool caught = false;
+  try {
+    RollingWindow<nanoseconds, test_clock> empty(nanoseconds(10), 0);
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "Windows without buckets should throw.");
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+namespace {
+// A lazily started coroutine whose frame is timed.
+struct timed_task {
+  struct promise_type
+      : timed_promise<std::chrono::nanoseconds, test_clock> {
+    timed_task get_return_object() {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    void return_void() noexcept {}
+    void unhandled_exception() { throw; }
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+// Runs for 2 ns, waits, then runs for 3 ns.
+timed_task timed_request() {
+  test_clock::advance(std::chrono::nanoseconds(2));
+  co_await std::suspend_always{};
+  test_clock::advance(std::chrono::nanoseconds(3));
+}
+}  // namespace
+#endif
+
+void Test::test_resumable() {
+  using std::chrono::nanoseconds;
+  ResumableStopwatch<nanoseconds, test_clock> sw;
+  assert_false(sw.running(), "New stopwatch should not be running.");
+  sw.suspend();
+  assert_eq(sw.slices(), static_cast<size_t>(0),
+            "Suspending before resuming should do nothing.");
+  sw.resume();
+  test_clock::advance(nanoseconds(5));
+  sw.resume();
+  sw.suspend();
+  test_clock::advance(nanoseconds(100));
+  assert_false(sw.running(), "Suspend should stop the stopwatch.");
+
+  // The request continues on another thread, which
+  // starts from this thread's time since each has its own.
+  const auto handoff = test_clock::now();
+  std::thread other([&sw, handoff] {
+    test_clock::set(handoff);
+    sw.resume();
+    test_clock::advance(nanoseconds(7));
+    sw.suspend();
+  });
+  other.join();
+  assert_eq(sw.slices(), static_cast<size_t>(2), "Both slices should count.");
+  assert_eq(sw.migrations(), static_cast<size_t>(1),
+            "Resuming on another thread should count as a migration.");
+  assert_eq(sw.on_cpu(), nanoseconds::rep(5 + 7),
+            "On CPU time should add up the running slices.");
+  assert_eq(sw.off_cpu(), nanoseconds::rep(100),
+            "Off CPU time should span the migration.");
+  assert_eq(sw.wall(), nanoseconds::rep(5 + 100 + 7),
+            "Wall time should combine running and waiting.");
+  sw.clear();
+  assert_eq(sw.wall(), nanoseconds::rep(0), "Clear should reset the times.");
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+  auto task = timed_request();
+  const auto& timer = task.handle.promise().stopwatch();
+  assert_false(timer.running(), "Timed coroutines should start suspended.");
+  task.handle.resume();
+  test_clock::advance(nanoseconds(40));
+  task.handle.resume();
+  assert_true(task.handle.done(), "Timed coroutine should finish.");
+  assert_eq(timer.on_cpu(), nanoseconds::rep(5),
+            "Coroutine should only count running time.");
+  assert_eq(timer.off_cpu(), nanoseconds::rep(40),
+            "Coroutine should count suspended time apart.");
+  task.handle.destroy();
+#endif
+}
+
+void Test::test_analysis() {
+  using std::chrono::nanoseconds;
+  // Steady splits around 100 ns, then a regression to 150 ns.
+  vector<nanoseconds::rep> times;
+  for (unsigned i = 0; i < 200; ++i) times.push_back(100 + i % 5);
+  times[120] = 1000;
+  for (unsigned i = 0; i < 100; ++i) times.push_back(150 + i % 5);
+  const auto sw = recorded(times);
+
+  const OutlierFilter<nanoseconds> filter(sw.begin(), sw.begin() + 199, 32);
+  assert_eq(filter.count(), static_cast<uint64_t>(199),
+            "Filter should see every split.");
+  assert_eq(filter.outliers(), static_cast<uint64_t>(1),
+            "Filter should flag the spike alone.");
+  assert_geq(filter.median(), 100.0, "Median should ignore the spike.");
+  assert_true(filter.median() < 105 && filter.mad() < 3,
+              "Median and deviation should be robust.");
+
+  const ChangeDetector<nanoseconds> detector(sw.begin(), sw.end());
+  const auto& changes = detector.changes();
+  assert_eq(changes.size(), static_cast<size_t>(1),
+            "Detector should find the regression alone.");
+  assert_true(changes.front().slower, "Regression should be slower.");
+  const auto& change = changes.front();
+  assert_true(change.start + 5 >= 200 && change.detected < 205,
+              "Change should be found near where it starts.");
+
+  // Compare the captures before and after the regression.
+  const auto old_end = sw.begin() + 199;
+  const auto same = mann_whitney(sw.begin(), sw.begin() + 100,
+                                 sw.begin() + 100, old_end);
+  assert_true(same.p_value > 0.05, "Equal captures should not differ.");
+  const auto worse = mann_whitney(old_end, sw.end(), sw.begin(), old_end);
+  assert_true(worse.z > 0 && worse.p_value < 1e-6,
+              "Slower captures should differ.");
+
+  const auto p50 = bootstrap_delta(sw.begin(), old_end, old_end, sw.end(), 50,
+                                   200, 0.95, 7, 3);
+  assert_true(p50.low <= p50.estimate && p50.estimate <= p50.high,
+              "Interval should contain the estimate.");
+  assert_true(p50.low > 40 && p50.high < 60,
+              "Interval should bracket the median regression.");
+  const auto serial = bootstrap_delta(sw.begin(), old_end, old_end, sw.end(),
+                                      50, 200, 0.95, 7, 1);
+  assert_false(serial.low < p50.low || serial.low > p50.low ||
+                   serial.high < p50.high || serial.high > p50.high,
+               "Threads should not change the interval.");
+
+  bool caught = false;
+  try {
+    mann_whitney(sw.begin(), sw.begin(), sw.begin(), sw.end());
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "Empty captures should throw.");
+  caught = false;
+  try {
+    bootstrap_delta(sw.begin(), old_end, old_end, sw.end(), std::nan(""), 10,
+                    0.95, 7, 1);
+  } catch (const std::invalid_argument& err) {
+    caught = true;
+  }
+  assert_true(caught, "NaN percentiles should throw.");
+}
+
+namespace {
+// Sections timed by the instrumented function.
+Stopwatch<std::chrono::nanoseconds> instrumented_sections;
+
+// An instrumented function with compiled out verbose sites.
+int instrumented(int x) {
+  STOPWATCH_SCOPE(1, instrumented_sections, "test/instrumented"_section);
+  STOPWATCH_SCOPE(3, instrumented_sections, "test/verbose"_section);
+  STOPWATCH_RECORD(2, STOPWATCH_NAMED("test/record"));
+  STOPWATCH_RECORD(3, STOPWATCH_NAMED("test/verbose"));
+  return x + 1;
+}
+
+// Returns the summary of the global stopwatch with the given name, if any.
+std::optional<stopwatch_summary> global_summary(std::string_view name) {
+  for (auto& summary : stopwatch_registry::global().snapshot()) {
+    if (summary.name == name) return summary;
+  }
+  return std::nullopt;
+}
+}  // namespace
+
+void Test::test_instrument() {
+  stopwatch_registry registry;
+  auto& query = registry.get("db/query");
+  assert_true(&registry.get("db/query") == &query,
+              "Stopwatches should be found by name.");
+  for (int i = 0; i < 100; ++i) STOPWATCH_RECORD(1, query);
+  const auto splits = query.splits();
+  assert_eq(splits.count(), static_cast<uint64_t>(99),
+            "Named stopwatches should add splits.");
+  assert_eq(query.stopwatch().data_size(), static_cast<size_t>(100),
+            "Named stopwatches should keep time points.");
+
+  // Snapshots do not stop other threads recording.
+  auto& busy = registry.get("db/busy");
+  std::atomic<bool> done{false};
+  std::thread writer([&busy, &done] {
+    for (unsigned i = 0; i < 20000; ++i) busy.record();
+    done = true;
+  });
+  uint64_t last = 0;
+  while (!done) {
+    const auto count = registry.snapshot().back().splits.count();
+    assert_geq(count, last, "Snapshots should only grow.");
+    last = count;
+  }
+  writer.join();
+  assert_eq(busy.splits().count(), static_cast<uint64_t>(19999),
+            "Every split should be kept.");
+  assert_eq(busy.stopwatch().threads(), static_cast<size_t>(1),
+            "Time points should outlive their thread.");
+  busy.clear();
+  assert_true(busy.splits().empty(), "Clear should drop every split.");
+
+  registry.get("net/send").record();
+  registry.get("net/\"odd\\name\"");
+  registry.enable("db/", false);
+  assert_false(query.enabled() || busy.enabled(),
+               "Components should be disabled by prefix.");
+  assert_true(registry.get("net/send").enabled(),
+              "Other components should stay enabled.");
+  query.record();
+  assert_eq(query.stopwatch().data_size(), static_cast<size_t>(100),
+            "Disabled stopwatches should not record.");
+  std::ostringstream json;
+  registry.write_json(json);
+  assert_true(json.str().find("\"name\": \"net/send\"") != string::npos,
+              "Export should include every stopwatch.");
+  assert_true(json.str().find(R"("name": "net/\"odd\\name\"")") !=
+                  string::npos,
+              "Export should escape stopwatch names.");
+
+  // Sites above the compiled level never run or register.
+  int total = 0;
+  for (int i = 0; i < 10; ++i) total += instrumented(i);
+  assert_eq(total, 55, "Instrumentation should not change results.");
+  assert_eq(instrumented_sections.section_count("test/instrumented"_section),
+            static_cast<size_t>(10), "Scopes should record.");
+  assert_eq(instrumented_sections.section_count("test/verbose"_section),
+            static_cast<size_t>(0), "Compiled out scopes should not record.");
+  assert_eq(global_summary("test/record")->splits.count(),
+            static_cast<uint64_t>(9), "Records should add splits.");
+  assert_false(global_summary("test/verbose").has_value(),
+               "Compiled out sites should not register.");
+  stopwatch_registry::global().enable("test/", false);
+  for (int i = 0; i < 10; ++i) total += instrumented(i);
+  assert_eq(global_summary("test/record")->splits.count(),
+            static_cast<uint64_t>(9), "Disabled sites should not record.");
+  stopwatch_registry::global().enable("test/", true);
+}
@@ -0,0 +1,475 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Chrome Trace Event and Perfetto export of stopwatches.
+*/
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "concurrent_stopwatch.h"
+#include "section.h"
+#include "stopwatch.h"
+
+/**
+ * Display names of sections. Sections without a name
+ * are shown by their id.
+ */
+using trace_names = std::unordered_map<section_id, std::string>;
+
+/**
+ * A single preallocated output buffer that is streamed
+ * to an ostream whenever it fills up, so exporting
+ * allocates nothing per event.
+ */
+class trace_buffer {
+ private:
+  std::ostream& out;
+  std::vector<char> bytes;
+  size_t used = 0;
+
+ public:
+  /**
+   * Streams to out through a buffer of capacity bytes.
+   */
+  trace_buffer(std::ostream& out_in, size_t capacity);
+
+  /**
+   * Returns room for at least n bytes, streaming
+   * buffered bytes first if needed.
+   */
+  char* room(size_t n);
+
+  /**
+   * Commits n bytes written into room.
+   */
+  void advance(size_t n) noexcept { used += n; }
+
+  // Appends bytes.
+
+  void put(char c);
+  void put(std::string_view text);
+  void put_integer(int64_t value);
+
+  /**
+   * Streams every buffered byte.
+   */
+  void flush();
+};
+
+/**
+ * Writes Chrome Trace Event JSON, viewable in
+ * chrome://tracing and ui.perfetto.dev.
+ */
+class chrome_format {
+ private:
+  // Whether or not an event has been written.
+  bool written = false;
+
+  // Writes the fields that start every event.
+  void open(trace_buffer&, char phase, int64_t ns, uint32_t tid);
+
+ public:
+  void start(trace_buffer&);
+  void begin(trace_buffer&, std::string_view name, int64_t ns, uint32_t tid);
+  void end(trace_buffer&, int64_t ns, uint32_t tid);
+  void finish(trace_buffer&);
+};
+
+/**
+ * Writes the Perfetto Trace protobuf, with one
+ * thread track per thread id.
+ */
+class perfetto_format {
+ private:
+  // Thread ids whose tracks have been described.
+  std::vector<uint32_t> described;
+
+  // Describes the track of tid if it is new.
+  void describe(trace_buffer&, uint32_t tid);
+
+  // Writes one track event packet.
+  void event(trace_buffer&, uint64_t type, std::string_view name, int64_t ns,
+             uint32_t tid);
+
+ public:
+  void start(trace_buffer&) {}
+  void begin(trace_buffer&, std::string_view name, int64_t ns, uint32_t tid);
+  void end(trace_buffer&, int64_t ns, uint32_t tid);
+  void finish(trace_buffer&) {}
+};
+
+/**
+ * Streams stopwatches to out as a timeline in the given
+ * Format. Sections are exported as nested slices, and
+ * stopwatches without sections as one slice per split.
+ * The trace is complete once finish is called or the
+ * exporter is destroyed.
+ */
+template <typename Format>
+class trace_exporter {
+ private:
+  trace_buffer buffer;
+  Format format;
+  bool finished = false;
+
+  // Exports the spans of points as nested begin and end events.
+  template <typename Clock, typename Points, typename Name>
+  void sections(const Points& points, std::vector<section_span> spans,
+                uint32_t tid, Name name);
+
+  // Exports every split between the first count points.
+  template <typename Clock, typename Points>
+  void splits(const Points& points, size_t count, uint32_t tid);
+
+  // Returns the time point in nanoseconds since the clock epoch.
+  template <typename Clock>
+  static int64_t nanos(const typename Clock::time_point& point);
+
+ public:
+  /**
+   * Buffer capacity in bytes used by default.
+   */
+  static constexpr size_t DEFAULT_CAPACITY = 1 << 20;
+
+  /**
+   * Starts the trace.
+   */
+  explicit trace_exporter(std::ostream& out,
+                          size_t capacity = DEFAULT_CAPACITY);
+
+  trace_exporter(const trace_exporter&) = delete;
+  trace_exporter& operator=(const trace_exporter&) = delete;
+
+  /**
+   * Finishes the trace if it is not already finished.
+   */
+  ~trace_exporter();
+
+  /**
+   * Adds the sections of the stopwatch, or its splits if
+   * it has none, on the given thread. Names are looked
+   * up in names.
+   */
+  template <typename Duration, typename Clock, typename Storage>
+  void add(const Stopwatch<Duration, Clock, Storage>& sw, uint32_t tid = 0,
+           const trace_names& names = trace_names());
+
+  /**
+   * Adds the splits of every thread of the stopwatch,
+   * with thread ids numbered from first_tid.
+   * REQUIRES: no concurrent calls to record.
+   */
+  template <typename Duration, typename Clock>
+  void add(const ConcurrentStopwatch<Duration, Clock>& sw,
+           uint32_t first_tid = 0);
+
+  /**
+   * Completes the trace and streams it.
+   */
+  void finish();
+};
+
+using chrome_trace = trace_exporter<chrome_format>;
+using perfetto_trace = trace_exporter<perfetto_format>;
+
+/* --- IMPLEMENTATION --- */
+
+inline trace_buffer::trace_buffer(std::ostream& out_in, size_t capacity)
+    : out(out_in), bytes(std::max<size_t>(capacity, 64)) {}
+
+inline char* trace_buffer::room(size_t n) {
+  if (used + n > bytes.size()) {
+    flush();
+    if (n > bytes.size()) bytes.resize(n);
+  }
+  return bytes.data() + used;
+}
+
+inline void trace_buffer::put(char c) {
+  *room(1) = c;
+  advance(1);
+}
+
+inline void trace_buffer::put(std::string_view text) {
+  std::copy(text.begin(), text.end(), room(text.size()));
+  advance(text.size());
+}
+
+inline void trace_buffer::put_integer(int64_t value) {
+  constexpr size_t DIGITS = 20;
+  char* const first = room(DIGITS);
+  const auto result = std::to_chars(first, first + DIGITS, value);
+  advance(static_cast<size_t>(result.ptr - first));
+}
+
+inline void trace_buffer::flush() {
+  out.write(bytes.data(), static_cast<std::streamsize>(used));
+  used = 0;
+}
+
+inline void chrome_format::start(trace_buffer& buf) {
+  buf.put("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+}
+
+inline void chrome_format::open(trace_buffer& buf, char phase, int64_t ns,
+                                uint32_t tid) {
+  buf.put(written ? ",\n{\"ph\":\"" : "\n{\"ph\":\"");
+  written = true;
+  buf.put(phase);
+  // Timestamps are microseconds with nanosecond decimals.
+  buf.put("\",\"pid\":1,\"tid\":");
+  buf.put_integer(tid);
+  buf.put(",\"ts\":");
+  if (ns < 0) {
+    buf.put('-');
+    ns = -ns;
+  }
+  buf.put_integer(ns / 1000);
+  const auto frac = ns % 1000;
+  const char decimals[] = {'.', static_cast<char>('0' + frac / 100),
+                           static_cast<char>('0' + frac / 10 % 10),
+                           static_cast<char>('0' + frac % 10)};
+  buf.put(std::string_view(decimals, sizeof(decimals)));
+}
+
+inline void chrome_format::begin(trace_buffer& buf, std::string_view name,
+                                 int64_t ns, uint32_t tid) {
+  open(buf, 'B', ns, tid);
+  buf.put(",\"name\":\"");
+  for (const char c : name) {
+    if (c == '"' || c == '\\') {
+      buf.put('\\');
+      buf.put(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      buf.put(' ');
+    } else {
+      buf.put(c);
+    }
+  }
+  buf.put("\"}");
+}
+
+inline void chrome_format::end(trace_buffer& buf, int64_t ns, uint32_t tid) {
+  open(buf, 'E', ns, tid);
+  buf.put('}');
+}
+
+inline void chrome_format::finish(trace_buffer& buf) { buf.put("\n]}\n"); }
+
+// Protobuf wire format helpers.
+namespace proto {
+// Returns the encoded size of a varint.
+constexpr size_t varint_size(uint64_t value) noexcept {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+// Writes a base 128 varint.
+inline void put_varint(trace_buffer& buf, uint64_t value) {
+  constexpr size_t MAX_VARINT = 10;
+  char* const first = buf.room(MAX_VARINT);
+  char* last = first;
+  while (value >= 0x80) {
+    *last++ = static_cast<char>((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  *last++ = static_cast<char>(value);
+  buf.advance(static_cast<size_t>(last - first));
+}
+
+// Tag of a varint field.
+constexpr uint64_t varint_tag(uint64_t field) noexcept { return field << 3; }
+
+// Tag of a length delimited field.
+constexpr uint64_t bytes_tag(uint64_t field) noexcept {
+  return (field << 3) | 2;
+}
+
+// Size of a varint field.
+constexpr size_t varint_field(uint64_t field, uint64_t value) noexcept {
+  return varint_size(varint_tag(field)) + varint_size(value);
+}
+
+// Size of a length delimited field holding len bytes.
+constexpr size_t bytes_field(uint64_t field, size_t len) noexcept {
+  return varint_size(bytes_tag(field)) + varint_size(len) + len;
+}
+
+// Writes a varint field.
+inline void put_field(trace_buffer& buf, uint64_t field, uint64_t value) {
+  put_varint(buf, varint_tag(field));
+  put_varint(buf, value);
+}
+
+// Writes the tag and length of a length delimited field.
+inline void put_header(trace_buffer& buf, uint64_t field, size_t len) {
+  put_varint(buf, bytes_tag(field));
+  put_varint(buf, len);
+}
+}  // namespace proto
+
+inline void perfetto_format::describe(trace_buffer& buf, uint32_t tid) {
+  if (std::find(described.begin(), described.end(), tid) != described.end()) {
+    return;
+  }
+  described.push_back(tid);
+  // One process, with track uuids offset from zero.
+  constexpr uint64_t PID = 1;
+  const uint64_t uuid = uint64_t(tid) + 1;
+  // ThreadDescriptor, TrackDescriptor, then TracePacket.
+  const auto thread = proto::varint_field(1, PID) + proto::varint_field(2, tid);
+  const auto track =
+      proto::varint_field(1, uuid) + proto::bytes_field(4, thread);
+  const auto packet =
+      proto::varint_field(10, 1) + proto::bytes_field(60, track);
+  proto::put_header(buf, 1, packet);
+  proto::put_field(buf, 10, 1);
+  proto::put_header(buf, 60, track);
+  proto::put_field(buf, 1, uuid);
+  proto::put_header(buf, 4, thread);
+  proto::put_field(buf, 1, PID);
+  proto::put_field(buf, 2, tid);
+}
+
+inline void perfetto_format::event(trace_buffer& buf, uint64_t type,
+                                   std::string_view name, int64_t ns,
+                                   uint32_t tid) {
+  describe(buf, tid);
+  const uint64_t uuid = uint64_t(tid) + 1;
+  const auto stamp = static_cast<uint64_t>(ns);
+  // TrackEvent, then TracePacket.
+  auto track = proto::varint_field(9, type) + proto::varint_field(11, uuid);
+  if (!name.empty()) track += proto::bytes_field(23, name.size());
+  const auto packet = proto::varint_field(8, stamp) +
+                      proto::varint_field(10, 1) +
+                      proto::bytes_field(11, track);
+  proto::put_header(buf, 1, packet);
+  proto::put_field(buf, 8, stamp);
+  proto::put_field(buf, 10, 1);
+  proto::put_header(buf, 11, track);
+  proto::put_field(buf, 9, type);
+  proto::put_field(buf, 11, uuid);
+  if (!name.empty()) {
+    proto::put_header(buf, 23, name.size());
+    buf.put(name);
+  }
+}
+
+inline void perfetto_format::begin(trace_buffer& buf, std::string_view name,
+                                   int64_t ns, uint32_t tid) {
+  // TrackEvent.TYPE_SLICE_BEGIN
+  event(buf, 1, name, ns, tid);
+}
+
+inline void perfetto_format::end(trace_buffer& buf, int64_t ns,
+                                 uint32_t tid) {
+  // TrackEvent.TYPE_SLICE_END
+  event(buf, 2, std::string_view(), ns, tid);
+}
+
+template <typename Format>
+inline trace_exporter<Format>::trace_exporter(std::ostream& out,
+                                              size_t capacity)
+    : buffer(out, capacity) {
+  format.start(buffer);
+}
+
+template <typename Format>
+inline trace_exporter<Format>::~trace_exporter() {
+  if (!finished) finish();
+}
+
+template <typename Format>
+inline void trace_exporter<Format>::finish() {
+  format.finish(buffer);
+  buffer.flush();
+  finished = true;
+}
+
+template <typename Format>
+template <typename Clock>
+inline int64_t trace_exporter<Format>::nanos(
+    const typename Clock::time_point& point) {
+  return clock_traits<Clock>::template convert<std::chrono::nanoseconds>(
+             point.time_since_epoch())
+      .count();
+}
+
+template <typename Format>
+template <typename Clock, typename Points>
+void trace_exporter<Format>::splits(const Points& points, size_t count,
+                                    uint32_t tid) {
+  for (size_t i = 0; i + 1 < count; ++i) {
+    format.begin(buffer, "split", nanos<Clock>(points[i]), tid);
+    format.end(buffer, nanos<Clock>(points[i + 1]), tid);
+  }
+}
+
+template <typename Format>
+template <typename Clock, typename Points, typename Name>
+void trace_exporter<Format>::sections(const Points& points,
+                                      std::vector<section_span> spans,
+                                      uint32_t tid, Name name) {
+  // Enclosing spans begin first, so they are opened first.
+  std::sort(spans.begin(), spans.end(),
+            [](const section_span& a, const section_span& b) {
+              return a.begin != b.begin ? a.begin < b.begin : a.end > b.end;
+            });
+  std::vector<size_t> open;
+  for (const auto& span : spans) {
+    while (!open.empty() && open.back() <= span.begin) {
+      format.end(buffer, nanos<Clock>(points[open.back()]), tid);
+      open.pop_back();
+    }
+    format.begin(buffer, name(span.id), nanos<Clock>(points[span.begin]), tid);
+    open.push_back(span.end);
+  }
+  for (; !open.empty(); open.pop_back()) {
+    format.end(buffer, nanos<Clock>(points[open.back()]), tid);
+  }
+}
+
+template <typename Format>
+template <typename Duration, typename Clock, typename Storage>
+void trace_exporter<Format>::add(const Stopwatch<Duration, Clock, Storage>& sw,
+                                 uint32_t tid, const trace_names& names) {
+  const auto& spans = sw.section_spans();
+  if (spans.empty()) {
+    splits<Clock>(sw.data(), sw.data_size(), tid);
+    return;
+  }
+  char unnamed[] = "section 00000000";
+  const auto name = [&names, &unnamed](section_id id) {
+    const auto iter = names.find(id);
+    if (iter != names.end()) return std::string_view(iter->second);
+    constexpr char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < 8; ++i) {
+      unnamed[sizeof(unnamed) - 2 - i] = HEX[(id >> (4 * i)) & 0xF];
+    }
+    return std::string_view(unnamed, sizeof(unnamed) - 1);
+  };
+  sections<Clock>(sw.data(), spans, tid, name);
+}
+
+template <typename Format>
+template <typename Duration, typename Clock>
+void trace_exporter<Format>::add(const ConcurrentStopwatch<Duration, Clock>& sw,
+                                 uint32_t first_tid) {
+  sw.for_each_thread([this, first_tid](size_t thread, const auto& points) {
+    splits<Clock>(points, points.size(),
+                  first_tid + static_cast<uint32_t>(thread));
+  });
+}
@@ -0,0 +1,194 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of time stamp counter clock.
+*/
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <ratio>
+#include <stdexcept>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#include "stopwatch.h"
+
+/**
+ * A clock that reads the processor time stamp counter
+ * (rdtscp on x86, cntvct_el0 on ARM). Durations and
+ * time points count raw ticks, so the period is only
+ * nominal. Ticks are converted into real time using
+ * a calibration that is measured once, on the first
+ * conversion or call to calibrate_now.
+ * Only meaningful if the counter is invariant: a counter
+ * that stops or changes rate with the processor frequency
+ * gives durations that are not real time. See invariant.
+ * Satisfies the Clock requirements of Stopwatch.
+ */
+struct tsc_clock {
+  using rep = int64_t;
+  // Nominal. The real tick length is only known after calibration.
+  using period = std::ratio<1>;
+  using duration = std::chrono::duration<rep, period>;
+  using time_point = std::chrono::time_point<tsc_clock>;
+  static constexpr bool is_steady = true;
+
+  /**
+   * Reads the current counter value.
+   * Performs no conversion.
+   */
+  static time_point now() noexcept;
+
+  /**
+   * Returns the calibrated number of nanoseconds per tick.
+   * Calibration is performed on the first call.
+   */
+  static double ns_per_tick() noexcept;
+
+  /**
+   * Returns the calibrated nanoseconds per tick as a
+   * fixed-point multiplier with SHIFT fractional bits.
+   */
+  static uint64_t ns_per_tick_fixed() noexcept;
+
+  /**
+   * Calibrates now, such as at startup, rather than on the
+   * first conversion, which would otherwise spin for 10 ms.
+   * THROWS: if the counter is not invariant.
+   */
+  static void calibrate_now();
+
+  /**
+   * Returns whether or not the counter ticks at a constant
+   * rate and keeps running in every power state. On x86 this
+   * is the invariant TSC bit (CPUID 0x80000007, EDX bit 8).
+   * Some hypervisors hide the bit even though the counter is
+   * invariant.
+   */
+  static bool invariant() noexcept;
+
+  // Fractional bits of the fixed-point multiplier.
+  static constexpr unsigned SHIFT = 32;
+
+  /**
+   * Converts a duration in ticks into Duration. Integer
+   * durations use the fixed-point multiplier, which needs
+   * no floating point arithmetic.
+   */
+  template <typename Duration>
+  static Duration to_duration(duration dur) noexcept;
+
+ private:
+  // Reads the raw counter.
+  static rep ticks() noexcept;
+
+  // Measures the counter rate against steady_clock.
+  static double calibrate() noexcept;
+};
+
+/**
+ * Stopwatch converts tsc_clock durations through the calibration.
+ */
+template <>
+struct clock_traits<tsc_clock> {
+  static constexpr uint32_t id = 3;
+
+  template <typename Duration>
+  static Duration convert(tsc_clock::duration dur) noexcept {
+    return tsc_clock::to_duration<Duration>(dur);
+  }
+};
+
+/* --- IMPLEMENTATION --- */
+
+inline tsc_clock::time_point tsc_clock::now() noexcept {
+  return time_point(duration(ticks()));
+}
+
+inline double tsc_clock::ns_per_tick() noexcept {
+  static const double scale = calibrate();
+  return scale;
+}
+
+inline uint64_t tsc_clock::ns_per_tick_fixed() noexcept {
+  static const auto scale =
+      static_cast<uint64_t>(ns_per_tick() * double(uint64_t(1) << SHIFT) + 0.5);
+  return scale;
+}
+
+inline void tsc_clock::calibrate_now() {
+  if (!invariant()) {
+    throw std::runtime_error("Time stamp counter is not invariant.");
+  }
+  ns_per_tick_fixed();
+}
+
+inline bool tsc_clock::invariant() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+  return (edx & (1u << 8)) != 0;
+#else
+  // The ARM generic timer, and the steady_clock fallback,
+  // always tick at a constant rate.
+  return true;
+#endif
+}
+
+template <typename Duration>
+inline Duration tsc_clock::to_duration(duration dur) noexcept {
+#if defined(__SIZEOF_INT128__)
+  if constexpr (std::is_integral_v<typename Duration::rep>) {
+    __extension__ typedef __int128 wide;
+    const auto product = wide(dur.count()) * wide(ns_per_tick_fixed());
+    // Shifting floors, so negate first to round toward zero like
+    // duration_cast.
+    const auto scaled = product < 0 ? -(-product >> SHIFT) : product >> SHIFT;
+    const std::chrono::nanoseconds ns(static_cast<int64_t>(scaled));
+    return convert_duration<Duration>(ns);
+  }
+#endif
+  const std::chrono::duration<double, std::nano> ns(
+      static_cast<double>(dur.count()) * ns_per_tick());
+  return std::chrono::duration_cast<Duration>(ns);
+}
+
+inline tsc_clock::rep tsc_clock::ticks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned aux;
+  return static_cast<rep>(__rdtscp(&aux));
+#elif defined(__aarch64__)
+  uint64_t val;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(val));
+  return static_cast<rep>(val);
+#else
+  const auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+#endif
+}
+
+inline double tsc_clock::calibrate() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+  // Spin against steady_clock to measure the invariant counter rate.
+  using std::chrono::steady_clock;
+  const auto start = steady_clock::now();
+  const auto begin = ticks();
+  auto stop = start;
+  while (stop - start < std::chrono::milliseconds(10)) {
+    stop = steady_clock::now();
+  }
+  const auto end = ticks();
+  const std::chrono::duration<double, std::nano> elapsed = stop - start;
+  return elapsed.count() / static_cast<double>(end - begin);
+#elif defined(__aarch64__)
+  // The generic timer reports its own frequency.
+  uint64_t freq;
+  __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+  return 1e9 / static_cast<double>(freq);
+#else
+  // Fallback ticks are already nanoseconds.
+  return 1.0;
+#endif
+}
@@ -0,0 +1,82 @@
+/*
+Copyright 2020. Siwei Wang.
+
+Interface and implementation of manually advanced clock.
+*/
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include "stopwatch.h"
+
+/**
+ * A clock that only moves when told to. Each thread has
+ * its own time, starting at the epoch, so tests running
+ * on different threads cannot disturb each other. Use it
+ * to check exact splits without sleeping, or to replay
+ * recorded time points through a Stopwatch at full speed.
+ * Distinct Tags give independent clocks.
+ * Satisfies the Clock requirements of Stopwatch.
+ */
+template <typename Duration = std::chrono::nanoseconds, typename Tag = void>
+struct virtual_clock {
+  using rep = typename Duration::rep;
+  using period = typename Duration::period;
+  using duration = Duration;
+  using time_point = std::chrono::time_point<virtual_clock>;
+  static constexpr bool is_steady = true;
+
+  /**
+   * Returns the current time of the calling thread.
+   */
+  static time_point now() noexcept { return current(); }
+
+  /**
+   * Moves the time of the calling thread forward by dur.
+   */
+  template <typename Rep, typename Period>
+  static void advance(std::chrono::duration<Rep, Period> dur) noexcept;
+
+  /**
+   * Moves the time of the calling thread to point,
+   * such as the next time point of a replayed trace.
+   */
+  static void set(time_point point) noexcept { current() = point; }
+
+  /**
+   * Moves the time of the calling thread back to the epoch.
+   */
+  static void reset() noexcept { current() = time_point(); }
+
+ private:
+  // The time of the calling thread.
+  static time_point& current() noexcept;
+};
+
+/**
+ * Identifies virtual clocks in saved captures.
+ */
+template <typename Duration, typename Tag>
+struct clock_traits<virtual_clock<Duration, Tag>> {
+  static constexpr uint32_t id = 4;
+
+  template <typename To>
+  static constexpr To convert(Duration dur) {
+    return convert_duration<To>(dur);
+  }
+};
+
+/* --- TEMPLATE IMPLEMENTATION --- */
+
+template <typename Duration, typename Tag>
+template <typename Rep, typename Period>
+inline void virtual_clock<Duration, Tag>::advance(
+    std::chrono::duration<Rep, Period> dur) noexcept {
+  current() += std::chrono::duration_cast<Duration>(dur);
+}
+
+template <typename Duration, typename Tag>
+inline typename virtual_clock<Duration, Tag>::time_point&
+virtual_clock<Duration, Tag>::current() noexcept {
+  thread_local time_point point;
+  return point;
+}